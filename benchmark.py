@@ -0,0 +1,212 @@
+import sys, json, math, time, struct, random, argparse, threading, platform
+from urllib.parse import urlparse
+import paho.mqtt.client as mosquitto
+
+# Round-trip benchmark against firmware built with CONFIG_PCU_BENCH=y.
+#
+# Messages are published to dev/<dev>/uuid/<uuid>/bench/in/<qos>, the firmware
+# echoes them back on .../bench/out/<qos> at the same QoS. Each payload starts
+# with the run id, a sequence number and the send time, padded to the
+# requested size.
+
+HEADER = struct.Struct("<IIQ")
+MAX_PAYLOAD = 64
+
+def percentile(samples, p):
+    if not samples:
+        return None
+    # Nearest rank
+    rank = max(1, math.ceil(p / 100.0 * len(samples)))
+    return samples[rank - 1]
+
+class Run:
+    def __init__(self, mqttc, prefix, qos, size, rate, count, window, timeout):
+        self.mqttc = mqttc
+        self.topic = "{}/bench/in/{}".format(prefix, qos)
+        self.qos = qos
+        self.size = size
+        self.rate = rate
+        self.count = count
+        self.window = window
+        self.timeout = timeout
+
+        self.run_id = random.getrandbits(32)
+        self.lock = threading.Condition()
+        self.sent = {}
+        self.rtt = []
+        self.duplicates = 0
+
+    def on_message(self, msg):
+        if len(msg.payload) < HEADER.size:
+            return
+
+        now = time.perf_counter_ns()
+        run_id, seq, _ = HEADER.unpack_from(msg.payload)
+        if run_id != self.run_id:
+            return
+
+        with self.lock:
+            sent_at = self.sent.pop(seq, None)
+            if sent_at is None:
+                self.duplicates += 1
+            else:
+                self.rtt.append((now - sent_at) / 1000.0)
+                self.last_received = now
+            self.lock.notify_all()
+
+    def execute(self):
+        padding = bytes(self.size - HEADER.size)
+        interval = 1e9 / self.rate if self.rate > 0 else 0
+        start = time.perf_counter_ns()
+        self.last_received = start
+
+        for seq in range(self.count):
+            if interval:
+                delay = start + seq * interval - time.perf_counter_ns()
+                if delay > 0:
+                    time.sleep(delay / 1e9)
+
+            # Keep at most `window` messages outstanding so a flat out run
+            # measures sustained throughput rather than queue overruns.
+            with self.lock:
+                if not self.lock.wait_for(lambda: len(self.sent) < self.window, self.timeout):
+                    break
+                now = time.perf_counter_ns()
+                self.sent[seq] = now
+
+            payload = HEADER.pack(self.run_id, seq, now) + padding
+            self.mqttc.publish(self.topic, payload, qos=self.qos)
+
+        with self.lock:
+            self.lock.wait_for(lambda: not self.sent, self.timeout)
+            end = self.last_received
+            lost = len(self.sent)
+            rtt = sorted(self.rtt)
+
+        duration = (end - start) / 1e9
+        return {
+            "qos": self.qos,
+            "size": self.size,
+            "rate": self.rate,
+            "count": self.count,
+            "received": len(rtt),
+            "lost": lost,
+            "duplicates": self.duplicates,
+            "duration_s": round(duration, 3),
+            "throughput_msg_s": round(len(rtt) / duration, 1) if duration > 0 else 0,
+            "rtt_us": {
+                "min": rtt[0] if rtt else None,
+                "mean": round(sum(rtt) / len(rtt), 1) if rtt else None,
+                "p50": percentile(rtt, 50),
+                "p90": percentile(rtt, 90),
+                "p99": percentile(rtt, 99),
+                "max": rtt[-1] if rtt else None,
+            },
+        }
+
+def compare(results, baseline, tolerance):
+    # Flag runs whose p50/p99 latency or throughput got worse by more than
+    # `tolerance` (fraction) compared to the baseline run with the same
+    # parameters.
+    regressions = []
+    key = lambda r: (r["qos"], r["size"], r["rate"])
+    previous = {key(r): r for r in baseline["results"]}
+
+    for result in results:
+        base = previous.get(key(result))
+        if base is None:
+            continue
+
+        for metric in ("p50", "p99"):
+            old, new = base["rtt_us"][metric], result["rtt_us"][metric]
+            if old and new and new > old * (1 + tolerance):
+                regressions.append("qos={} size={} rate={}: {} {} -> {} us".format(
+                    *key(result), metric, old, new))
+
+        old, new = base["throughput_msg_s"], result["throughput_msg_s"]
+        if old and new < old * (1 - tolerance):
+            regressions.append("qos={} size={} rate={}: throughput {} -> {} msg/s".format(
+                *key(result), old, new))
+
+        if result["lost"] > base["lost"]:
+            regressions.append("qos={} size={} rate={}: lost {} -> {}".format(
+                *key(result), base["lost"], result["lost"]))
+
+    return regressions
+
+def int_list(value):
+    return [int(v) for v in value.split(",")]
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Round-trip latency and throughput benchmark")
+    parser.add_argument("url", nargs="?", default="mqtt://localhost:1883")
+    parser.add_argument("--device", default="pcu")
+    parser.add_argument("--uuid", default="42")
+    parser.add_argument("--qos", type=int_list, default=[0, 1, 2], help="comma separated QoS levels")
+    parser.add_argument("--size", type=int_list, default=[16, 64], help="comma separated payload sizes")
+    parser.add_argument("--rate", type=int_list, default=[10, 0], help="comma separated msg/s, 0 runs flat out")
+    parser.add_argument("--count", type=int, default=500, help="messages per run")
+    parser.add_argument("--window", type=int, default=8, help="maximum messages outstanding")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds to wait for echoes")
+    parser.add_argument("--output", help="write the JSON results to this file")
+    parser.add_argument("--baseline", help="compare against the JSON results of an earlier build")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="allowed regression, fraction")
+    args = parser.parse_args()
+
+    for size in args.size:
+        if size < HEADER.size or size > MAX_PAYLOAD:
+            parser.error("payload size must be between {} and {}".format(HEADER.size, MAX_PAYLOAD))
+
+    url = urlparse(args.url)
+    prefix = "dev/{}/uuid/{}".format(args.device, args.uuid)
+
+    current = {"run": None}
+    def on_message(mqttc, obj, msg):
+        run = current["run"]
+        if run is not None:
+            run.on_message(msg)
+
+    mqttc = mosquitto.Client()
+    mqttc.on_message = on_message
+    mqttc.connect(url.hostname, url.port or 1883)
+    mqttc.subscribe(prefix + "/bench/out/+", qos=2)
+    mqttc.loop_start()
+
+    results = []
+    for qos in args.qos:
+        for size in args.size:
+            for rate in args.rate:
+                run = Run(mqttc, prefix, qos, size, rate, args.count, args.window, args.timeout)
+                current["run"] = run
+                result = run.execute()
+                current["run"] = None
+                results.append(result)
+                print("qos={qos} size={size} rate={rate}: {received}/{count} received, "
+                      "{throughput_msg_s} msg/s, p50 {p50} us, p99 {p99} us".format(
+                          **result, p50=result["rtt_us"]["p50"], p99=result["rtt_us"]["p99"]),
+                      file=sys.stderr)
+
+    mqttc.loop_stop()
+    mqttc.disconnect()
+
+    report = {
+        "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "host": platform.node(),
+        "broker": args.url,
+        "device": prefix,
+        "results": results,
+    }
+
+    output = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(output + "\n")
+    else:
+        print(output)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        for regression in regressions:
+            print("REGRESSION " + regression, file=sys.stderr)
+        sys.exit(1 if regressions else 0)
@@ -0,0 +1,67 @@
+#include "capture_frame.h"
+
+#include <sys/byteorder.h>
+#include <string.h>
+
+int capture_frame_begin(struct capture_frame* frame, uint8_t* buf, size_t size,
+    uint16_t seq, uint16_t dropped, uint32_t frequency)
+{
+    if (size < CAPTURE_FRAME_HEADER_LEN) {
+        return -ENOMEM;
+    }
+
+    frame->buf = buf;
+    frame->size = size;
+    frame->len = CAPTURE_FRAME_HEADER_LEN;
+    frame->count = 0;
+    frame->last = 0;
+
+    buf[0] = CAPTURE_FRAME_VERSION;
+    sys_put_le16(seq, &buf[2]);
+    sys_put_le16(dropped, &buf[4]);
+    sys_put_le32(frequency, &buf[6]);
+    sys_put_le32(0, &buf[10]);
+    return 0;
+}
+
+int capture_frame_add(struct capture_frame* frame, uint32_t timestamp, uint8_t channel, int value) {
+    if (channel > CAPTURE_FRAME_MAX_CHANNEL) {
+        return -EINVAL;
+    }
+    if (frame->count == UINT8_MAX) {
+        return -ENOMEM;
+    }
+
+    if (frame->count == 0) {
+        sys_put_le32(timestamp, &frame->buf[10]);
+        frame->last = timestamp;
+    }
+
+    // Events recorded by nested interrupts may be slightly out of order
+    int32_t delta = (int32_t)(timestamp - frame->last);
+    uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+    uint8_t event[CAPTURE_FRAME_MAX_EVENT_LEN];
+    size_t len = 0;
+    do {
+        event[len] = zigzag & 0x7f;
+        zigzag >>= 7;
+        event[len++] |= zigzag != 0 ? 0x80 : 0;
+    } while (zigzag != 0);
+    event[len++] = channel << 1 | (value != 0);
+
+    if (frame->len + len > frame->size) {
+        return -ENOMEM;
+    }
+
+    memcpy(&frame->buf[frame->len], event, len);
+    frame->len += len;
+    frame->last = timestamp;
+    frame->count++;
+    return 0;
+}
+
+size_t capture_frame_end(struct capture_frame* frame) {
+    frame->buf[1] = frame->count;
+    return frame->len;
+}
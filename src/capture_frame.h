@@ -0,0 +1,50 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Batch of timestamped input edges, carried in a single message:
+//
+//   offset  size  field
+//   0       1     version (CAPTURE_FRAME_VERSION)
+//   1       1     number of events
+//   2       2     sequence number
+//   4       2     events dropped since the previous frame, saturating
+//   6       4     cycle counter frequency in Hz
+//   10      4     cycle count of the first event
+//   14      ...   events
+//
+// Each event is the cycle count delta to the previous event as a zigzag
+// encoded LEB128 varint (0 for the first one), followed by one byte holding
+// the channel in bits 7..1 and the value in bit 0. Multi-byte fields are
+// little endian.
+#define CAPTURE_FRAME_VERSION 1
+#define CAPTURE_FRAME_HEADER_LEN 14
+#define CAPTURE_FRAME_MAX_EVENT_LEN 6
+#define CAPTURE_FRAME_MAX_CHANNEL 127
+
+struct capture_frame {
+    uint8_t* buf;
+    size_t size;
+    size_t len;
+    uint8_t count;
+    uint32_t last;
+};
+
+// Start a frame in `buf`, -ENOMEM if `size` cannot hold the header
+int capture_frame_begin(struct capture_frame* frame, uint8_t* buf, size_t size,
+    uint16_t seq, uint16_t dropped, uint32_t frequency);
+
+// Append an event, -ENOMEM once the frame is full or -EINVAL for a channel
+// out of range
+int capture_frame_add(struct capture_frame* frame, uint32_t timestamp, uint8_t channel, int value);
+
+// Returns the encoded length
+size_t capture_frame_end(struct capture_frame* frame);
+
+#ifdef __cplusplus
+}
+#endif
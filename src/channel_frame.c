@@ -0,0 +1,66 @@
+#include "channel_frame.h"
+
+#include <sys/byteorder.h>
+
+static bool _channel_frame_valid(uint8_t count, uint32_t mask) {
+    if (count > CHANNEL_FRAME_MAX_CHANNELS) {
+        return false;
+    }
+    // No values for channels outside of the group
+    return (mask >> count) == 0;
+}
+
+int channel_frame_encode(const struct channel_frame* frame, uint8_t* buf, size_t size) {
+    if (!_channel_frame_valid(frame->count, frame->mask)) {
+        return -EINVAL;
+    }
+
+    size_t len = CHANNEL_FRAME_HEADER_LEN + 2 * __builtin_popcount(frame->mask);
+    if (len > size) {
+        return -ENOMEM;
+    }
+
+    buf[0] = CHANNEL_FRAME_VERSION;
+    buf[1] = frame->count;
+    sys_put_le16(frame->seq, &buf[2]);
+    sys_put_le32(frame->mask, &buf[4]);
+
+    uint8_t* p = &buf[CHANNEL_FRAME_HEADER_LEN];
+    for (uint8_t i = 0; i < frame->count; i++) {
+        if (frame->mask & BIT(i)) {
+            sys_put_le16(frame->values[i], p);
+            p += 2;
+        }
+    }
+
+    return len;
+}
+
+int channel_frame_decode(struct channel_frame* frame, const uint8_t* buf, size_t len) {
+    if (len < CHANNEL_FRAME_HEADER_LEN) {
+        return -EBADMSG;
+    }
+    if (buf[0] != CHANNEL_FRAME_VERSION) {
+        return -ENOTSUP;
+    }
+
+    frame->count = buf[1];
+    frame->seq = sys_get_le16(&buf[2]);
+    frame->mask = sys_get_le32(&buf[4]);
+    if (!_channel_frame_valid(frame->count, frame->mask) ||
+        len != CHANNEL_FRAME_HEADER_LEN + 2 * __builtin_popcount(frame->mask)) {
+        return -EBADMSG;
+    }
+
+    const uint8_t* p = &buf[CHANNEL_FRAME_HEADER_LEN];
+    for (uint8_t i = 0; i < frame->count; i++) {
+        if (frame->mask & BIT(i)) {
+            frame->values[i] = sys_get_le16(p);
+            p += 2;
+        } else {
+            frame->values[i] = 0;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Binary state of a group of channels, carried in a single message:
+//
+//   offset  size  field
+//   0       1     version (CHANNEL_FRAME_VERSION)
+//   1       1     number of channels in the group
+//   2       2     sequence number
+//   4       4     mask of the channels carrying a value
+//   8       2*n   value of each channel in the mask, lowest channel first
+//
+// Multi-byte fields are little endian. Digital channels use 0 and 1.
+#define CHANNEL_FRAME_VERSION 1
+#define CHANNEL_FRAME_MAX_CHANNELS 24
+#define CHANNEL_FRAME_HEADER_LEN 8
+#define CHANNEL_FRAME_MAX_LEN (CHANNEL_FRAME_HEADER_LEN + 2 * CHANNEL_FRAME_MAX_CHANNELS)
+
+struct channel_frame {
+    uint16_t seq;
+    uint8_t count;
+    uint32_t mask;
+    // Indexed by channel, only those in `mask` are meaningful
+    uint16_t values[CHANNEL_FRAME_MAX_CHANNELS];
+};
+
+// Returns the encoded length, -EINVAL for an inconsistent frame or -ENOMEM
+// when `size` is too small.
+int channel_frame_encode(const struct channel_frame* frame, uint8_t* buf, size_t size);
+
+// Returns 0, -ENOTSUP for an unknown version or -EBADMSG for a malformed frame
+int channel_frame_decode(struct channel_frame* frame, const uint8_t* buf, size_t len);
+
+// Whether `seq` is newer than `last`, allowing for wrap around
+static inline bool channel_frame_seq_newer(uint16_t seq, uint16_t last) {
+    return (int16_t)(seq - last) > 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
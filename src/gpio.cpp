@@ -1,4 +1,6 @@
 #include "gpio.h"
+#include "trace.h"
+#include <zephyr.h>
 #include <assert.h>
 
 namespace GPIO {
@@ -50,7 +52,19 @@ Output& Output::operator=(int value) {
 
 Input::Input(struct device* dev, gpio_pin_t pin)
     : Pin(dev, pin, GPIO_INPUT)
-{}
+    , _interrupt_callback_added(false)
+    , _interrupt_timestamp(0)
+    , _capture(nullptr)
+    , _capture_channel(0)
+    , _deferred_queue(nullptr)
+    , _deferred_holdoff(K_NO_WAIT)
+    , _deferred_scheduled(ATOMIC_INIT(0))
+    , _deferred_state{0, 0, 0}
+    , _coalesced_edges(0)
+{
+    _deferred_work.context = this;
+    k_delayed_work_init(&_deferred_work.base, Input::_deferred_interrupt_handler);
+}
 
 void
 Input::set_interrupt(gpio_flags_t mode) {
@@ -59,26 +73,109 @@ Input::set_interrupt(gpio_flags_t mode) {
 }
 
 void
-Input::set_interrupt_handler(InterruptHandler handler) {
-    _interrupt_handler = handler;
+Input::_register_interrupt_callback() {
+    if (_interrupt_callback_added) {
+        return;
+    }
+
     _interrupt_callback.context = this;
     auto cb = reinterpret_cast<gpio_callback*>(&_interrupt_callback.base);
     gpio_init_callback(cb, Input::_raw_interrupt_handler, BIT(this->_pin));
 	gpio_add_callback(this->_dev, cb);
+    _interrupt_callback_added = true;
 }
 
 void
-Input::clear_interrupt_handler() {
-    if (_interrupt_handler) {
+Input::_unregister_interrupt_callback() {
+    if (_interrupt_callback_added) {
         auto cb = reinterpret_cast<gpio_callback*>(&_interrupt_callback.base);
         gpio_remove_callback(this->_dev, cb);
-        _interrupt_handler = nullptr;
+        _interrupt_callback_added = false;
     }
 }
 
-void Input::_base_interrupt_handler() {
-    if (_interrupt_handler) {
-        _interrupt_handler(*this, get());
+void
+Input::_add_interrupt_callback(InterruptHandler handler) {
+    clear_interrupt_handler();
+
+    _interrupt_handler = handler;
+    _register_interrupt_callback();
+}
+
+void
+Input::set_interrupt_handler(InterruptHandler handler) {
+    _deferred_queue = nullptr;
+    _add_interrupt_callback(handler);
+}
+
+void
+Input::set_deferred_interrupt_handler(InterruptHandler handler,
+    k_timeout_t holdoff, struct k_work_q* queue)
+{
+    _deferred_queue = queue;
+    _deferred_holdoff = holdoff;
+    _add_interrupt_callback(handler);
+}
+
+void
+Input::clear_interrupt_handler() {
+    _interrupt_handler = nullptr;
+    if (_capture == nullptr) {
+        _unregister_interrupt_callback();
+    }
+
+    k_delayed_work_cancel(&_deferred_work.base);
+    atomic_clear(&_deferred_scheduled);
+}
+
+void
+Input::set_capture(Capture* capture, uint8_t channel) {
+    _capture_channel = channel;
+    _capture = capture;
+
+    if (_capture != nullptr) {
+        _register_interrupt_callback();
+    } else if (!_interrupt_handler) {
+        _unregister_interrupt_callback();
+    }
+}
+
+uint32_t
+Input::interrupt_timestamp() const {
+    return _interrupt_timestamp;
+}
+
+uint32_t
+Input::coalesced_edges() const {
+    return _coalesced_edges;
+}
+
+void Input::_base_interrupt_handler(uint32_t timestamp) {
+    int value = get();
+    TRACE(TRACE_GPIO_IRQ, _pin, value, 0);
+
+    if (_capture != nullptr) {
+        _capture->record(_capture_channel, value, timestamp);
+    }
+
+    if (!_interrupt_handler) {
+        return;
+    }
+
+    if (_deferred_queue == nullptr) {
+        _interrupt_timestamp = timestamp;
+        _interrupt_handler(*this, value);
+        return;
+    }
+
+    // Overwrite the captured state, only the first edge since the handler
+    // last ran schedules the work item.
+    _deferred_state.value = value;
+    _deferred_state.timestamp = timestamp;
+    _deferred_state.edges++;
+
+    if (atomic_cas(&_deferred_scheduled, 0, 1)) {
+        k_delayed_work_submit_to_queue(_deferred_queue, &_deferred_work.base, _deferred_holdoff);
     }
 }
 
@@ -88,7 +185,188 @@ Input::_raw_interrupt_handler(struct device *dev __unused,
 {
     auto self = reinterpret_cast<Input*>(
         reinterpret_cast<Input::InterruptCallback*>(cb)->context);
-    self->_base_interrupt_handler();
+    self->_base_interrupt_handler(k_cycle_get_32());
+}
+
+void
+Input::_deferred_interrupt_handler(struct k_work *work) {
+    auto self = reinterpret_cast<Input*>(
+        reinterpret_cast<Input::DeferredWork*>(work)->context);
+
+    // Clear the flag first so an edge arriving from here on schedules
+    // another run rather than getting lost.
+    atomic_clear(&self->_deferred_scheduled);
+
+    unsigned int key = irq_lock();
+    int value = self->_deferred_state.value;
+    uint32_t edges = self->_deferred_state.edges;
+    self->_interrupt_timestamp = self->_deferred_state.timestamp;
+    self->_deferred_state.edges = 0;
+    irq_unlock(key);
+
+    TRACE(TRACE_GPIO_DEFERRED, self->_pin, value, edges);
+    if (edges == 0 || !self->_interrupt_handler) {
+        return;
+    }
+
+    self->_coalesced_edges += edges - 1;
+    self->_interrupt_handler(*self, value);
+}
+
+Capture::Capture(Slot* slots, size_t capacity)
+    : _slots(slots)
+    , _mask(capacity - 1)
+    , _head(ATOMIC_INIT(0))
+    , _tail(ATOMIC_INIT(0))
+    , _dropped(ATOMIC_INIT(0))
+    , _batch_size(1)
+    , _max_delay(K_NO_WAIT)
+    , _queue(nullptr)
+    , _scheduled(ATOMIC_INIT(0))
+{
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_set(&_slots[i].seq, i);
+    }
+
+    _batch_work.context = this;
+    k_delayed_work_init(&_batch_work.base, Capture::_batch_work_handler);
+}
+
+void
+Capture::set_batch_handler(BatchHandler handler, size_t batch_size,
+    k_timeout_t max_delay, struct k_work_q* queue)
+{
+    _batch_handler = handler;
+    _batch_size = batch_size > 0 ? batch_size : 1;
+    _max_delay = max_delay;
+    _queue = queue;
+}
+
+bool
+Capture::record(uint8_t channel, int value, uint32_t timestamp) {
+    // Claim a slot, free for position `pos` while its sequence number equals
+    // `pos`. Producers may interrupt each other.
+    Slot* slot;
+    atomic_val_t pos = atomic_get(&_head);
+    while (1) {
+        slot = &_slots[pos & _mask];
+        int32_t diff = (int32_t)(atomic_get(&slot->seq) - pos);
+
+        if (diff == 0) {
+            if (atomic_cas(&_head, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_inc(&_dropped);
+            return false;
+        }
+
+        pos = atomic_get(&_head);
+    }
+
+    slot->event.timestamp = timestamp;
+    slot->event.channel = channel;
+    slot->event.value = value != 0;
+    atomic_set(&slot->seq, pos + 1);
+
+    _schedule(pos + 1 - atomic_get(&_tail));
+    return true;
+}
+
+bool
+Capture::peek(CaptureEvent& event) const {
+    atomic_val_t tail = atomic_get(&_tail);
+    const Slot* slot = &_slots[tail & _mask];
+    if (atomic_get(&slot->seq) != tail + 1) {
+        return false;
+    }
+    event = slot->event;
+    return true;
+}
+
+void
+Capture::pop() {
+    atomic_val_t tail = atomic_get(&_tail);
+    atomic_set(&_slots[tail & _mask].seq, tail + _mask + 1);
+    atomic_set(&_tail, tail + 1);
+}
+
+size_t
+Capture::pending() const {
+    return atomic_get(&_head) - atomic_get(&_tail);
+}
+
+uint32_t
+Capture::dropped() const {
+    return atomic_get(&_dropped);
+}
+
+// Schedule the batch handler: after `max_delay` for the first pending event,
+// right away once a full batch is pending.
+void
+Capture::_schedule(size_t pending) {
+    if (_queue == nullptr) {
+        return;
+    }
+
+    if (pending >= _batch_size) {
+        if (atomic_set(&_scheduled, 2) != 2) {
+            k_delayed_work_submit_to_queue(_queue, &_batch_work.base, K_NO_WAIT);
+        }
+    } else if (atomic_cas(&_scheduled, 0, 1)) {
+        k_delayed_work_submit_to_queue(_queue, &_batch_work.base, _max_delay);
+    }
+}
+
+void
+Capture::_batch_work_handler(struct k_work *work) {
+    auto self = reinterpret_cast<Capture*>(
+        reinterpret_cast<Capture::BatchWork*>(work)->context);
+
+    // Clear the flag first so events recorded from here on schedule another
+    // run rather than waiting for the next one.
+    atomic_clear(&self->_scheduled);
+
+    if (self->_batch_handler) {
+        self->_batch_handler(*self);
+    }
+
+    // Left over by the handler
+    size_t pending = self->pending();
+    if (pending > 0) {
+        self->_schedule(pending);
+    }
+}
+
+Port::Port(struct device* dev)
+    : _dev(dev)
+{}
+
+gpio_port_value_t
+Port::get(gpio_port_pins_t mask) const {
+    gpio_port_value_t value = 0;
+    gpio_port_get(_dev, &value);
+    return value & mask;
+}
+
+void
+Port::set_masked(gpio_port_pins_t mask, gpio_port_value_t value) {
+    gpio_port_set_masked(_dev, mask, value);
+}
+
+void
+Port::set_bits(gpio_port_pins_t pins) {
+    gpio_port_set_bits(_dev, pins);
+}
+
+void
+Port::clear_bits(gpio_port_pins_t pins) {
+    gpio_port_clear_bits(_dev, pins);
+}
+
+void
+Port::toggle_bits(gpio_port_pins_t pins) {
+    gpio_port_toggle_bits(_dev, pins);
 }
 
 } // namespace GPIO
\ No newline at end of file
@@ -1,12 +1,166 @@
 #pragma once
 
+#include <kernel.h>
 #include <device.h>
 #include <drivers/gpio.h>
 
-#include <functional>
+#include <type_traits>
+#include <assert.h>
 
 namespace GPIO {
 
+// Non-owning reference to a callable: a free function, a captureless lambda,
+// a member function or a callable object that outlives the delegate. Unlike
+// std::function it never allocates and can be invoked from ISR context.
+template<typename Signature>
+class Delegate;
+
+template<typename R, typename... Args>
+class Delegate<R(Args...)>
+{
+public:
+    using Function = R(*)(Args...);
+
+    constexpr Delegate() = default;
+    constexpr Delegate(std::nullptr_t) {}
+
+    Delegate(Function function)
+        : _function(function)
+        , _stub(function ? &_function_stub : nullptr)
+    {}
+
+    // Captureless lambdas, capturing ones have to be bound with from()
+    template<typename F, typename = typename std::enable_if<
+        std::is_convertible<F, Function>::value>::type>
+    Delegate(F function)
+        : Delegate(static_cast<Function>(function))
+    {}
+
+    template<class T, R (T::*Method)(Args...)>
+    static Delegate bind(T* object) {
+        Delegate delegate;
+        delegate._object = object;
+        delegate._stub = &_method_stub<T, Method>;
+        return delegate;
+    }
+
+    template<class T>
+    static Delegate from(T& callable) {
+        Delegate delegate;
+        delegate._object = &callable;
+        delegate._stub = &_callable_stub<T>;
+        return delegate;
+    }
+
+    R operator()(Args... args) const {
+        return _stub(*this, args...);
+    }
+
+    explicit operator bool() const {
+        return _stub != nullptr;
+    }
+
+protected:
+    using Stub = R(*)(const Delegate&, Args...);
+
+    void* _object = nullptr;
+    Function _function = nullptr;
+    Stub _stub = nullptr;
+
+    static R _function_stub(const Delegate& self, Args... args) {
+        return self._function(args...);
+    }
+
+    template<class T, R (T::*Method)(Args...)>
+    static R _method_stub(const Delegate& self, Args... args) {
+        return (static_cast<T*>(self._object)->*Method)(args...);
+    }
+
+    template<class T>
+    static R _callable_stub(const Delegate& self, Args... args) {
+        return (*static_cast<T*>(self._object))(args...);
+    }
+};
+
+// Input edge recorded by a Capture
+struct CaptureEvent {
+    // Cycle count taken on interrupt entry
+    uint32_t timestamp;
+    uint8_t channel;
+    uint8_t value;
+};
+
+// Lock-free ring of input edges, recorded in ISR context by any number of
+// inputs and consumed by a single reader. The batch handler runs on a work
+// queue once `batch_size` events are pending or the oldest pending event is
+// `max_delay` old, so edges are handed on in batches rather than one by one.
+class Capture
+{
+public:
+    using BatchHandler = Delegate<void(Capture&)>;
+
+    void set_batch_handler(BatchHandler handler,
+        size_t batch_size,
+        k_timeout_t max_delay,
+        struct k_work_q* queue = &k_sys_work_q);
+
+    // Safe from ISR context. Returns false when the ring is full, the event
+    // is dropped then.
+    bool record(uint8_t channel, int value, uint32_t timestamp);
+
+    // Reader side, oldest event first
+    bool peek(CaptureEvent& event) const;
+    void pop();
+    size_t pending() const;
+
+    // Number of events dropped on a full ring
+    uint32_t dropped() const;
+
+protected:
+    struct Slot {
+        atomic_t seq;
+        CaptureEvent event;
+    };
+
+    // `capacity` must be a power of two
+    Capture(Slot* slots, size_t capacity);
+
+    Slot* _slots;
+    size_t _mask;
+    atomic_t _head;
+    atomic_t _tail;
+    atomic_t _dropped;
+
+    struct BatchWork {
+        k_delayed_work base;
+        void* context;
+    } _batch_work;
+    BatchHandler _batch_handler;
+    size_t _batch_size;
+    k_timeout_t _max_delay;
+    struct k_work_q* _queue;
+    atomic_t _scheduled;
+
+    void _schedule(size_t pending);
+    static void _batch_work_handler(struct k_work *work);
+};
+
+template<size_t Capacity>
+class CaptureBuffer
+    : public Capture
+{
+public:
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+        "The capture capacity must be a power of two");
+
+    CaptureBuffer()
+        : Capture(_storage, Capacity)
+    {}
+
+protected:
+    Slot _storage[Capacity];
+};
+
 class Pin
 {
 public:
@@ -43,21 +197,153 @@ class Input
 public:
     Input(struct device* dev, gpio_pin_t pin);
 
-    using InterruptHandler = std::function<void(Input&, int)>;
+    using InterruptHandler = Delegate<void(Input&, int)>;
     void set_interrupt(gpio_flags_t mode);
+
+    // Invoke the handler in ISR context on every interrupt
     void set_interrupt_handler(InterruptHandler handler);
+
+    // Capture the pin state in the ISR and invoke the handler from `queue`.
+    // Edges arriving before the handler ran are coalesced into the latest
+    // state, and the handler runs at most once per `holdoff`.
+    void set_deferred_interrupt_handler(InterruptHandler handler,
+        k_timeout_t holdoff = K_NO_WAIT,
+        struct k_work_q* queue = &k_sys_work_q);
+
     void clear_interrupt_handler();
 
+    // Record every edge into `capture` as `channel`, from the ISR and in
+    // addition to any handler. nullptr stops recording.
+    void set_capture(Capture* capture, uint8_t channel = 0);
+
+    // Cycle count taken on entry of the last (delivered) interrupt
+    uint32_t interrupt_timestamp() const;
+
+    // Number of edges coalesced away in deferred mode
+    uint32_t coalesced_edges() const;
+
 protected:
     struct InterruptCallback {
         gpio_callback base;
         void* context;
     } _interrupt_callback;
+    bool _interrupt_callback_added;
     InterruptHandler _interrupt_handler;
+    uint32_t _interrupt_timestamp;
+
+    Capture* _capture;
+    uint8_t _capture_channel;
 
-    void _base_interrupt_handler();
+    struct DeferredWork {
+        k_delayed_work base;
+        void* context;
+    } _deferred_work;
+    struct k_work_q* _deferred_queue;
+    k_timeout_t _deferred_holdoff;
+    atomic_t _deferred_scheduled;
+    struct {
+        int value;
+        uint32_t timestamp;
+        uint32_t edges;
+    } _deferred_state;
+    uint32_t _coalesced_edges;
+
+    void _add_interrupt_callback(InterruptHandler handler);
+    void _register_interrupt_callback();
+    void _unregister_interrupt_callback();
+    void _base_interrupt_handler(uint32_t timestamp);
     static void _raw_interrupt_handler(struct device *dev,
         struct gpio_callback *cb, uint32_t pin);
+    static void _deferred_interrupt_handler(struct k_work *work);
+};
+
+// Pins of a single port device, read and written together in one port
+// access. Values are logical, pins configured active low are inverted by
+// the driver.
+class Port
+{
+public:
+    Port(struct device* dev);
+
+    gpio_port_value_t get(gpio_port_pins_t mask) const;
+    void set_masked(gpio_port_pins_t mask, gpio_port_value_t value);
+    void set_bits(gpio_port_pins_t pins);
+    void clear_bits(gpio_port_pins_t pins);
+    void toggle_bits(gpio_port_pins_t pins);
+
+protected:
+    struct device* _dev;
+};
+
+// Fixed group of pins on one port. Bit n of a group value maps to the n-th
+// pin of the template arguments, the translation to port bits is resolved at
+// compile time and every read or write is a single port access, so all pins
+// change together.
+template<gpio_pin_t... Pins>
+class PinGroup
+    : public Port
+{
+public:
+    static constexpr size_t size = sizeof...(Pins);
+    static constexpr gpio_port_pins_t mask = (BIT(Pins) | ... | 0U);
+
+    static_assert(size > 0 && size <= 32, "A pin group holds 1 to 32 pins");
+
+    PinGroup(struct device* dev, gpio_flags_t flags)
+        : Port(dev)
+    {
+        for (gpio_pin_t pin : _pins) {
+            int ret = gpio_pin_configure(_dev, pin, flags);
+            assert(ret == 0);
+        }
+    }
+
+    ~PinGroup() {
+        for (gpio_pin_t pin : _pins) {
+            gpio_pin_configure(_dev, pin, GPIO_DISCONNECTED);
+        }
+    }
+
+    // Port bits of the group value `bits`
+    static constexpr gpio_port_value_t to_port(uint32_t bits) {
+        gpio_port_value_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (bits & BIT(i)) {
+                value |= BIT(_pins[i]);
+            }
+        }
+        return value;
+    }
+
+    static constexpr uint32_t from_port(gpio_port_value_t value) {
+        uint32_t bits = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (value & BIT(_pins[i])) {
+                bits |= BIT(i);
+            }
+        }
+        return bits;
+    }
+
+    uint32_t read() const {
+        return from_port(get(mask));
+    }
+
+    void write(uint32_t bits) {
+        set_masked(mask, to_port(bits));
+    }
+
+    // Update only the pins selected by `select`
+    void write(uint32_t select, uint32_t bits) {
+        set_masked(to_port(select), to_port(bits));
+    }
+
+    void set(size_t index, int value) {
+        write(BIT(index), value ? BIT(index) : 0);
+    }
+
+protected:
+    static constexpr gpio_pin_t _pins[] = { Pins... };
 };
 
 }
\ No newline at end of file
@@ -2,11 +2,19 @@
 LOG_MODULE_REGISTER(pcu, LOG_LEVEL_DBG);
 
 #include "network.h"
+#include "readiness.h"
 #include "gpio.h"
 #include "mqtt_service.h"
+#include "mqtt_shadow.h"
+#include "mqtt_metrics.h"
+#include "mqtt_shell.h"
+#include "channel_frame.h"
+#include "capture_frame.h"
 
 #include <zephyr.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <random/rand32.h>
 
 #define SW0_NODE	DT_ALIAS(sw0)
@@ -25,11 +33,16 @@ LOG_MODULE_REGISTER(pcu, LOG_LEVEL_DBG);
 #define LED2_GPIO_LABEL	DT_GPIO_LABEL(LED2_NODE, gpios)
 #define LED2_GPIO_PIN	DT_GPIO_PIN(LED2_NODE, gpios)
 
-static GPIO::Output led[] = {
-    GPIO::Output(device_get_binding(LED0_GPIO_LABEL), LED0_GPIO_PIN, GPIO_OUTPUT_INIT_LOW),
-    GPIO::Output(device_get_binding(LED0_GPIO_LABEL), LED1_GPIO_PIN, GPIO_OUTPUT_INIT_LOW),
-    GPIO::Output(device_get_binding(LED0_GPIO_LABEL), LED2_GPIO_PIN, GPIO_OUTPUT_INIT_LOW)
-};
+// Minimum time between two reports of a chattering input
+#define SW_HOLDOFF_MS	20
+
+// Time allowed from connecting to all subscriptions acknowledged
+#define BOOT_READY_TIMEOUT_MS	10000
+
+// All LEDs sit on the same port and are updated in a single port write
+using LedGroup = GPIO::PinGroup<LED0_GPIO_PIN, LED1_GPIO_PIN, LED2_GPIO_PIN>;
+static LedGroup leds(device_get_binding(LED0_GPIO_LABEL), GPIO_OUTPUT_INIT_LOW);
+static const size_t led_index[LedGroup::size] = { 0, 1, 2 };
 
 static GPIO::Input sw[] = {
     GPIO::Input(device_get_binding(SW0_GPIO_LABEL), SW0_GPIO_PIN)
@@ -50,68 +63,374 @@ static GPIO::Input sw[] = {
 #define MQTT_TOPIC_LED_0    MQTT_TOPIC_PREFIX "/out/led/0"
 #define MQTT_TOPIC_LED_1    MQTT_TOPIC_PREFIX "/out/led/1"
 #define MQTT_TOPIC_LED_2    MQTT_TOPIC_PREFIX "/out/led/2"
+#define MQTT_TOPIC_LEDS     MQTT_TOPIC_PREFIX "/out/leds"
 #define MQTT_TOPIC_SW_0     MQTT_TOPIC_PREFIX "/in/sw/0"
+#define MQTT_TOPIC_LED_STATE_0  MQTT_TOPIC_PREFIX "/in/led/0"
+#define MQTT_TOPIC_LED_STATE_1  MQTT_TOPIC_PREFIX "/in/led/1"
+#define MQTT_TOPIC_LED_STATE_2  MQTT_TOPIC_PREFIX "/in/led/2"
+#define MQTT_TOPIC_GROUP_LED    MQTT_TOPIC_PREFIX "/out/group/led"
+#define MQTT_TOPIC_GROUP_SW     MQTT_TOPIC_PREFIX "/in/group/sw"
+#define MQTT_TOPIC_CAPTURE      MQTT_TOPIC_PREFIX "/in/capture"
+#define MQTT_TOPIC_STATS    MQTT_TOPIC_PREFIX "/stats"
+#define MQTT_TOPIC_ALIAS_PREFIX "a/" MQTT_TOPIC_UUID
+
+#define MQTT_TOPIC_UPTIME   MQTT_TOPIC_STATS "/uptime"
+#define MQTT_TOPIC_QUEUES   MQTT_TOPIC_STATS "/queues"
+#define MQTT_TOPIC_NET      MQTT_TOPIC_STATS "/net"
+#define MQTT_TOPIC_STACK    MQTT_TOPIC_STATS "/stack"
+#define MQTT_TOPIC_THREADS  MQTT_TOPIC_STATS "/threads"
+#define MQTT_TOPIC_OCCUPANCY MQTT_TOPIC_STATS "/occupancy"
+
+#define MQTT_STATS_INTERVAL 60000
+#define MQTT_QUEUES_INTERVAL 10000
+
+#define MQTT_TOPIC_BENCH_IN     MQTT_TOPIC_PREFIX "/bench/in/+"
+#define MQTT_TOPIC_BENCH_OUT    MQTT_TOPIC_PREFIX "/bench/out/"
+// Default topic of "mqtt bench pub" in the shell
+#define MQTT_TOPIC_BENCH_LOAD   MQTT_TOPIC_PREFIX "/bench/load"
 
 static mqtt_service_t mqtt_service;
 
-static int mqtt_update_led_state(struct mqtt_service* service, size_t payload_len, int index) {
-    if (payload_len != 1) {
+// Message handlers run on their own work queue, below the service thread, so
+// that acknowledgements and keepalives never wait on them
+#define MQTT_HANDLER_STACK_SIZE 1536
+#define MQTT_HANDLER_PRIO       (MQTT_SERVICE_PRIO + 1)
+K_THREAD_STACK_DEFINE(mqtt_handler_stack, MQTT_HANDLER_STACK_SIZE);
+static struct k_work_q mqtt_handler_queue;
+
+// Buffers publishes while the broker is unreachable
+#if defined(CONFIG_MQTT_SERVICE_STORE_NVS)
+static mqtt_store_nvs offline_store;
+#else
+static mqtt_store_ram offline_store;
+#endif
+
+// Desired LED states come in on the LED topics, the actual states are
+// reported on the LED state topics and resent after a reconnect if changed.
+static mqtt_shadow shadow;
+static int sw0_shadow;
+static int led_shadow[LedGroup::size];
+
+static void report_leds() {
+    uint32_t bits = leds.read();
+    for (size_t i = 0; i < LedGroup::size; i++) {
+        char value = bits & BIT(i) ? '1' : '0';
+        mqtt_shadow_report(&shadow, led_shadow[i], &value, 1);
+    }
+}
+
+static void shadow_update_led(struct mqtt_shadow*, int, const uint8_t* value, size_t len, void* context) {
+    if (len != 1) {
+        LOG_ERR("Invalid payload length");
+        return;
+    }
+
+    leds.set(*static_cast<const size_t*>(context), value[0] == '1');
+    report_leds();
+}
+
+// Payload of one '0' or '1' per LED, LED 0 first, applied all at once
+static int mqtt_update_leds_state(struct mqtt_service* service, const struct mqtt_utf8*, size_t payload_len, void*) {
+    if (payload_len != LedGroup::size) {
+        LOG_ERR("Invalid payload length");
+        return -1;
+    }
+    char value[LedGroup::size];
+    if (mqtt_service_read_payload(service, value, sizeof(value)) < 0) {
+        return -1;
+    }
+
+    uint32_t bits = 0;
+    for (size_t i = 0; i < LedGroup::size; i++) {
+        bits |= value[i] == '1' ? BIT(i) : 0;
+    }
+    leds.write(bits);
+    report_leds();
+
+    return 0;
+}
+
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+BUILD_ASSERT(CHANNEL_FRAME_MAX_LEN <= MQTT_QUEUE_PAYLOAD_LEN, "Channel frames must fit a queued message");
+
+// Sequence number of the last applied LED group frame, a frame with sequence
+// number 0 restarts the sequence.
+static uint16_t led_group_seq;
+
+// Apply the values of all LEDs in the channel frame at once
+static int mqtt_update_led_group(struct mqtt_service* service, const struct mqtt_utf8*, size_t payload_len, void*) {
+    uint8_t payload[CHANNEL_FRAME_MAX_LEN];
+    if (payload_len > sizeof(payload)) {
         LOG_ERR("Invalid payload length");
         return -1;
     }
-    char value[2] = {0};
-    if (mqtt_service_read_payload(service, &value, 1) < 0) {
+    if (mqtt_service_read_payload(service, payload, payload_len) < 0) {
+        return -1;
+    }
+
+    struct channel_frame frame;
+    int rc = channel_frame_decode(&frame, payload, payload_len);
+    if (rc != 0) {
+        LOG_ERR("Invalid channel frame: %d", rc);
+        return 0;
+    }
+
+    if (frame.seq != 0 && !channel_frame_seq_newer(frame.seq, led_group_seq)) {
+        LOG_WRN("Ignoring stale LED frame %u", frame.seq);
+        return 0;
+    }
+    led_group_seq = frame.seq;
+
+    uint32_t select = frame.mask & BIT_MASK(LedGroup::size);
+    uint32_t bits = 0;
+    for (size_t i = 0; i < LedGroup::size; i++) {
+        bits |= (select & BIT(i)) && frame.values[i] ? BIT(i) : 0;
+    }
+    leds.write(select, bits);
+    report_leds();
+
+    return 0;
+}
+
+// Report the state of all switches in one frame, `source` changed to `value`
+static void mqtt_publish_sw_group(GPIO::Input* source, int value) {
+    static uint16_t seq;
+
+    struct channel_frame frame = {};
+    frame.seq = ++seq;
+    frame.count = ARRAY_SIZE(sw);
+    frame.mask = BIT_MASK(ARRAY_SIZE(sw));
+    for (size_t i = 0; i < ARRAY_SIZE(sw); i++) {
+        frame.values[i] = &sw[i] == source ? value : sw[i].get();
+    }
+
+    uint8_t payload[CHANNEL_FRAME_MAX_LEN];
+    int len = channel_frame_encode(&frame, payload, sizeof(payload));
+    if (len < 0) {
+        LOG_ERR("channel_frame_encode: %d", len);
+        return;
+    }
+
+    uint32_t origin = source != nullptr ? source->interrupt_timestamp() : k_cycle_get_32();
+    mqtt_service_publish_stamped(&mqtt_service,
+        MQTT_TOPIC_GROUP_SW, MQTT_QOS_0_AT_MOST_ONCE, payload, len, origin);
+}
+#endif
+
+#if defined(CONFIG_PCU_CAPTURE)
+BUILD_ASSERT(CAPTURE_FRAME_HEADER_LEN + CAPTURE_FRAME_MAX_EVENT_LEN <= MQTT_QUEUE_PAYLOAD_LEN,
+    "A capture frame must hold at least one event");
+
+// Every edge of the switches with its timestamp, channel n being switch n
+static GPIO::CaptureBuffer<CONFIG_PCU_CAPTURE_BUFFER_SIZE> capture;
+
+// Publish the pending edges in as few frames as they fit
+static void mqtt_publish_capture(GPIO::Capture& capture) {
+    static uint16_t seq;
+    static uint32_t reported_drops;
+    // Events of frames the service did not accept
+    static uint32_t lost;
+
+    GPIO::CaptureEvent event;
+    while (capture.peek(event)) {
+        uint32_t dropped = capture.dropped() + lost;
+        uint8_t payload[MQTT_QUEUE_PAYLOAD_LEN];
+        struct capture_frame frame;
+
+        capture_frame_begin(&frame, payload, sizeof(payload), seq + 1,
+            MIN(dropped - reported_drops, UINT16_MAX), sys_clock_hw_cycles_per_sec());
+
+        while (capture.peek(event) &&
+            capture_frame_add(&frame, event.timestamp, event.channel, event.value) == 0) {
+            capture.pop();
+        }
+
+        // The events already left the ring, so a frame that cannot be queued
+        // is reported as dropped in the next one rather than retried
+        int rc = mqtt_service_publish(&mqtt_service,
+            MQTT_TOPIC_CAPTURE, MQTT_QOS_0_AT_MOST_ONCE, payload, capture_frame_end(&frame));
+        if (rc < 0) {
+            lost += frame.count;
+            continue;
+        }
+        seq++;
+        reported_drops = dropped;
+    }
+}
+#endif
+
+#if defined(CONFIG_PCU_BENCH)
+// Echo benchmark messages back at the QoS given by the last topic level
+static int mqtt_bench_echo(struct mqtt_service* service, const struct mqtt_utf8* topic, size_t payload_len, void*) {
+    static const char* const echo_topics[] = {
+        MQTT_TOPIC_BENCH_OUT "0",
+        MQTT_TOPIC_BENCH_OUT "1",
+        MQTT_TOPIC_BENCH_OUT "2",
+    };
+
+    uint8_t payload[MQTT_QUEUE_PAYLOAD_LEN];
+    if (payload_len > sizeof(payload)) {
+        LOG_ERR("Benchmark payload too large: %d", payload_len);
+        return -1;
+    }
+    if (mqtt_service_read_payload(service, payload, payload_len) < 0) {
         return -1;
     }
 
-    led[index].set(atoi(value));
+    unsigned int qos = topic->utf8[topic->size - 1] - '0';
+    if (qos >= ARRAY_SIZE(echo_topics)) {
+        return 0;
+    }
 
+    mqtt_service_publish(service, echo_topics[qos], qos, payload, payload_len);
     return 0;
 }
+#endif
 
-static int mqtt_topic_callback(struct mqtt_service* service, const char* topic, size_t payload_len) {
-    if (strcmp(MQTT_TOPIC_LED_0, topic) == 0) {
-        return mqtt_update_led_state(service, payload_len, 0);
-    } else if (strcmp(MQTT_TOPIC_LED_1, topic) == 0) {
-        return mqtt_update_led_state(service, payload_len, 1);
-    } else if (strcmp(MQTT_TOPIC_LED_2, topic) == 0) {
-        return mqtt_update_led_state(service, payload_len, 2);
+static void mqtt_subscribe_result(struct mqtt_service*, const char* topic, int result, void*) {
+    if (result < 0) {
+        LOG_ERR("Subscription to %s failed: %d", log_strdup(topic), result);
     }
+}
 
-    LOG_ERR("Unexpected topic: %s", log_strdup(topic));
+static int mqtt_topic_callback(struct mqtt_service*, const struct mqtt_utf8* topic, size_t, void*) {
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", static_cast<int>(topic->size), topic->utf8);
+    LOG_ERR("Unexpected topic: %s", log_strdup(name));
     return -1;
 }
 
 void main(void) {
+    // Does not wait for the network, the service connects once it is up
 	network_init();
-    k_sleep(K_MSEC(1000));
 
     mqtt_service_init(&mqtt_service,
         MQTT_CLIENTID,
         MQTT_BROKER_ADDR, MQTT_BROKER_PORT,
         mqtt_topic_callback);
-    mqtt_service_start(&mqtt_service);
+    mqtt_service_set_clean_session(&mqtt_service, false);
+    mqtt_service_set_ready_events(&mqtt_service, READINESS_NET_ADDR);
+    k_work_q_start(&mqtt_handler_queue, mqtt_handler_stack,
+        K_THREAD_STACK_SIZEOF(mqtt_handler_stack), MQTT_HANDLER_PRIO);
+    k_thread_name_set(&mqtt_handler_queue.thread, "mqtt_handlers");
+    mqtt_service_set_dispatch_queue(&mqtt_service, &mqtt_handler_queue);
+    mqtt_shell_set_service(&mqtt_service);
+    mqtt_shell_set_bench_topic(MQTT_TOPIC_BENCH_LOAD);
+#if defined(CONFIG_MQTT_SERVICE_STORE_NVS)
+    if (mqtt_store_nvs_init(&offline_store) == 0) {
+        mqtt_service_set_store(&mqtt_service, &offline_store.base);
+    }
+#else
+    mqtt_store_ram_init(&offline_store);
+    mqtt_service_set_store(&mqtt_service, &offline_store.base);
+#endif
+    mqtt_shadow_init(&shadow, &mqtt_service);
+    sw0_shadow = mqtt_shadow_bind(&shadow, MQTT_TOPIC_SW_0, NULL, MQTT_QOS_0_AT_MOST_ONCE, NULL, NULL);
+    led_shadow[0] = mqtt_shadow_bind(&shadow, MQTT_TOPIC_LED_STATE_0, MQTT_TOPIC_LED_0,
+        MQTT_QOS_0_AT_MOST_ONCE, shadow_update_led, (void*)&led_index[0]);
+    led_shadow[1] = mqtt_shadow_bind(&shadow, MQTT_TOPIC_LED_STATE_1, MQTT_TOPIC_LED_1,
+        MQTT_QOS_0_AT_MOST_ONCE, shadow_update_led, (void*)&led_index[1]);
+    led_shadow[2] = mqtt_shadow_bind(&shadow, MQTT_TOPIC_LED_STATE_2, MQTT_TOPIC_LED_2,
+        MQTT_QOS_0_AT_MOST_ONCE, shadow_update_led, (void*)&led_index[2]);
+
+    // Sent once connected
+    char initial_value = sw[0].get() ? '1' : '0';
+    mqtt_shadow_report(&shadow, sw0_shadow, &initial_value, 1);
+    report_leds();
 
-    while (mqtt_service.state != MQTT_SERVICE_CONNECTED) {
-        k_sleep(K_MSEC(1000));
+    mqtt_service_register_handler(&mqtt_service, MQTT_TOPIC_LEDS, mqtt_update_leds_state, NULL);
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+    mqtt_service_register_handler(&mqtt_service, MQTT_TOPIC_GROUP_LED, mqtt_update_led_group, NULL);
+#endif
+#if defined(CONFIG_PCU_BENCH)
+    mqtt_service_register_handler(&mqtt_service, MQTT_TOPIC_BENCH_IN, mqtt_bench_echo, NULL);
+#endif
+#if defined(CONFIG_PCU_TOPIC_ALIASES)
+    static const char* const aliased_topics[] = {
+        MQTT_TOPIC_SW_0,
+        MQTT_TOPIC_LED_0,
+        MQTT_TOPIC_LED_1,
+        MQTT_TOPIC_LED_2,
+        MQTT_TOPIC_LEDS,
+        MQTT_TOPIC_GROUP_SW,
+        MQTT_TOPIC_GROUP_LED,
+    };
+    mqtt_service_set_alias_prefix(&mqtt_service, MQTT_TOPIC_ALIAS_PREFIX);
+    for (const char* topic : aliased_topics) {
+        mqtt_service_add_topic_alias(&mqtt_service, topic);
     }
+#endif
+    // A bouncing switch only needs its settled state on the broker
+    static const mqtt_cache_policy sw_policy = { .on_change = true, .min_interval = 0, .max_rate = 10 };
+    mqtt_service_set_publish_policy(&mqtt_service, MQTT_TOPIC_SW_0, &sw_policy);
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+    static const mqtt_cache_policy group_policy = { .on_change = false, .min_interval = 0, .max_rate = 10 };
+    mqtt_service_set_publish_policy(&mqtt_service, MQTT_TOPIC_GROUP_SW, &group_policy);
+#endif
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+    mqtt_service_set_stats_topic(&mqtt_service, MQTT_TOPIC_STATS, MQTT_STATS_INTERVAL);
+#endif
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_UPTIME, MQTT_STATS_INTERVAL, mqtt_metrics_uptime, NULL);
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_QUEUES, MQTT_QUEUES_INTERVAL, mqtt_metrics_queues, NULL);
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_OCCUPANCY, MQTT_QUEUES_INTERVAL, mqtt_metrics_occupancy, NULL);
+#if defined(CONFIG_NET_STATISTICS_USER_API)
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_NET, MQTT_STATS_INTERVAL, mqtt_metrics_net, NULL);
+#endif
+#if defined(CONFIG_THREAD_STACK_INFO) && defined(CONFIG_INIT_STACKS)
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_STACK, MQTT_STATS_INTERVAL, mqtt_metrics_stack, NULL);
+#endif
+#if defined(CONFIG_THREAD_MONITOR)
+    mqtt_service_add_telemetry(&mqtt_service, MQTT_TOPIC_THREADS, MQTT_STATS_INTERVAL, mqtt_metrics_threads, NULL);
+#endif
 
-    char initial_value = '0';
-    mqtt_service_publish(&mqtt_service, MQTT_TOPIC_SW_0, MQTT_QOS_0_AT_MOST_ONCE, &initial_value, sizeof(initial_value));
-    mqtt_service_subscribe(&mqtt_service, MQTT_TOPIC_LED_0, MQTT_QOS_0_AT_MOST_ONCE, &initial_value, sizeof(initial_value));
-    mqtt_service_subscribe(&mqtt_service, MQTT_TOPIC_LED_1, MQTT_QOS_0_AT_MOST_ONCE, &initial_value, sizeof(initial_value));
-    mqtt_service_subscribe(&mqtt_service, MQTT_TOPIC_LED_2, MQTT_QOS_0_AT_MOST_ONCE, &initial_value, sizeof(initial_value));
+    // Requested in one SUBSCRIBE along with the shadow topics once connected
+    static const mqtt_service_topic subscriptions[] = {
+        { MQTT_TOPIC_LEDS, MQTT_QOS_0_AT_MOST_ONCE },
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+        { MQTT_TOPIC_GROUP_LED, MQTT_QOS_1_AT_LEAST_ONCE },
+#endif
+#if defined(CONFIG_PCU_BENCH)
+        { MQTT_TOPIC_BENCH_IN, MQTT_QOS_2_EXACTLY_ONCE },
+#endif
+    };
+    mqtt_service_set_subscribe_callback(&mqtt_service, mqtt_subscribe_result, NULL);
+    mqtt_service_subscribe_batch(&mqtt_service, subscriptions, ARRAY_SIZE(subscriptions));
+
+    mqtt_service_start(&mqtt_service);
+    mqtt_service_log_mem_usage();
+
+    // Live before connecting, changes reach the broker through the shadow
+    // and the offline store.
+#if defined(CONFIG_PCU_CAPTURE)
+    capture.set_batch_handler(mqtt_publish_capture,
+        CONFIG_PCU_CAPTURE_BATCH_SIZE, K_MSEC(CONFIG_PCU_CAPTURE_MAX_DELAY));
+    for (size_t i = 0; i < ARRAY_SIZE(sw); i++) {
+        sw[i].set_capture(&capture, i);
+    }
+#endif
 
     sw[0].set_interrupt(GPIO_INT_EDGE_BOTH | GPIO_INT_DEBOUNCE);
-    sw[0].set_interrupt_handler([](GPIO::Input&, int value) {
-        char strbuf[2];
-        snprintf(strbuf, sizeof(strbuf), "%d", value);
-        mqtt_service_publish(&mqtt_service,
-            MQTT_TOPIC_SW_0, MQTT_QOS_0_AT_MOST_ONCE, strbuf, 1);
+    sw[0].set_deferred_interrupt_handler([](GPIO::Input& input, int value) {
+        char state = value ? '1' : '0';
+        mqtt_shadow_report(&shadow, sw0_shadow, &state, 1);
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+        mqtt_publish_sw_group(&input, value);
+#endif
         LOG_INF("Button SW0: %s", value ? "pressed" : "released");
-    });
+    }, K_MSEC(SW_HOLDOFF_MS));
+
+    readiness_wait(READINESS_MQTT_CONNECTED, K_FOREVER);
+
+    char initial_leds[LedGroup::size];
+    memset(initial_leds, '0', sizeof(initial_leds));
+    mqtt_service_publish(&mqtt_service, MQTT_TOPIC_LEDS, MQTT_QOS_0_AT_MOST_ONCE, initial_leds, sizeof(initial_leds));
+#if defined(CONFIG_PCU_CHANNEL_FRAMES)
+    mqtt_publish_sw_group(nullptr, 0);
+#endif
 
-    while (1) {
-        k_sleep(K_MSEC(10000));
+    // Everything else runs on the service thread and the work queues
+    if (readiness_wait(READINESS_MQTT_SUBSCRIBED, K_MSEC(BOOT_READY_TIMEOUT_MS)) != 0) {
+        LOG_WRN("Subscriptions not acknowledged after %d ms", BOOT_READY_TIMEOUT_MS);
     }
+    readiness_log_timing();
 }
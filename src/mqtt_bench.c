@@ -0,0 +1,367 @@
+#include "mqtt_bench.h"
+#include "mqtt_pool.h"
+
+#include <string.h>
+#include <random/rand32.h>
+
+// The completion context of a message holds its publish cycle count, with
+// the low bits replaced by the run, so that acknowledgements still arriving
+// from a run that timed out are not counted in the next one
+#define MQTT_BENCH_RUN_MASK 0x0FU
+
+static K_MUTEX_DEFINE(_mqtt_bench_lock);
+// Given on every completion, only the publishing run takes it
+static K_SEM_DEFINE(_mqtt_bench_progress, 0, 1);
+
+static uint32_t _mqtt_bench_boot_id;
+static atomic_t _mqtt_bench_busy;
+
+static struct {
+    uint32_t run;
+    uint32_t completed;
+    uint32_t failed;
+    int64_t last_progress;
+    struct mqtt_bench_latency latency;
+} _mqtt_bench_pub;
+
+static struct {
+    char filters[MQTT_BENCH_MAX_FILTERS][MQTT_QUEUE_TOPIC_LEN + 1];
+    size_t filter_count;
+    // Index of the filter subscribed to, -1 if none
+    int active;
+    int64_t first;
+    int64_t last;
+    uint32_t last_run;
+    uint32_t next_seq;
+    struct mqtt_bench_sub_stats stats;
+} _mqtt_bench_sub = { .active = -1 };
+
+static void _mqtt_bench_latency_reset(struct mqtt_bench_latency* latency) {
+    latency->count = 0;
+    latency->min = UINT32_MAX;
+    latency->max = 0;
+    latency->sum = 0;
+}
+
+static void _mqtt_bench_latency_add(struct mqtt_bench_latency* latency, uint32_t start) {
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    latency->count++;
+    latency->min = MIN(latency->min, us);
+    latency->max = MAX(latency->max, us);
+    latency->sum += us;
+}
+
+static uint32_t _mqtt_bench_get_boot_id(void) {
+    while (_mqtt_bench_boot_id == 0) {
+        _mqtt_bench_boot_id = sys_rand32_get();
+    }
+    return _mqtt_bench_boot_id;
+}
+
+// Invoked on the service thread
+static void _mqtt_bench_complete(struct mqtt_service* service, uint16_t message_id, int result, void* context) {
+    uint32_t tag = (uint32_t)(uintptr_t)context;
+
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    if ((tag & MQTT_BENCH_RUN_MASK) == (_mqtt_bench_pub.run & MQTT_BENCH_RUN_MASK)) {
+        if (result == 0) {
+            _mqtt_bench_pub.completed++;
+            _mqtt_bench_latency_add(&_mqtt_bench_pub.latency, tag & ~MQTT_BENCH_RUN_MASK);
+        } else {
+            _mqtt_bench_pub.failed++;
+        }
+        _mqtt_bench_pub.last_progress = k_uptime_get();
+        k_sem_give(&_mqtt_bench_progress);
+    }
+    k_mutex_unlock(&_mqtt_bench_lock);
+}
+
+// Wait for a free queue slot and pool block, rather than have publishing
+// fail and log every attempt. Returns 1 when it had to wait, 0 when there
+// was room right away and -ETIMEDOUT when none freed up for
+// MQTT_BENCH_TIMEOUT_MS, e.g. while the broker is unreachable.
+static int _mqtt_bench_wait_for_room(struct mqtt_service* service) {
+    int64_t deadline = k_uptime_get() + MQTT_BENCH_TIMEOUT_MS;
+    int stalled = 0;
+    while (1) {
+        struct mqtt_queue_stats queue;
+        struct mqtt_pool_stats pool;
+        mqtt_service_get_queue_stats(service, &queue);
+        mqtt_pool_get_stats(&pool);
+        if (queue.used < MQTT_QUEUE_SIZE && pool.used < pool.blocks) {
+            return stalled;
+        }
+        if (k_uptime_get() >= deadline) {
+            return -ETIMEDOUT;
+        }
+        stalled = 1;
+        k_sleep(K_MSEC(1));
+    }
+}
+
+// QoS 0 messages complete once written to the socket, counted by the queue
+// statistics from `sent`, its count before the run. An empty queue alone says
+// nothing: while disconnected the service moves queued messages to the
+// store instead. Other traffic written meanwhile counts as well, which the
+// empty queue keeps to the messages queued during the run.
+static int _mqtt_bench_wait_sent(struct mqtt_service* service, uint32_t sent,
+    struct mqtt_bench_pub_result* result, int64_t* end)
+{
+    int64_t deadline = k_uptime_get() + MQTT_BENCH_TIMEOUT_MS;
+    struct mqtt_queue_stats queue;
+    int rc = 0;
+
+    mqtt_service_get_queue_stats(service, &queue);
+    while (queue.used > 0 || queue.sent - sent < result->published) {
+        if (mqtt_service_get_state(service) != MQTT_SERVICE_CONNECTED) {
+            rc = -ENOTCONN;
+            break;
+        }
+        if (k_uptime_get() >= deadline) {
+            rc = -ETIMEDOUT;
+            break;
+        }
+
+        uint32_t written = queue.sent;
+        k_sleep(K_MSEC(1));
+        mqtt_service_get_queue_stats(service, &queue);
+        if (queue.sent != written) {
+            deadline = k_uptime_get() + MQTT_BENCH_TIMEOUT_MS;
+        }
+    }
+
+    *end = k_uptime_get();
+    result->completed = MIN(queue.sent - sent, result->published);
+    return rc;
+}
+
+// Until every message is acknowledged or none was for MQTT_BENCH_TIMEOUT_MS
+// since `published`, the time the last one was enqueued
+static int _mqtt_bench_wait_acked(struct mqtt_bench_pub_result* result, int64_t published, int64_t* end) {
+    int rc = 0;
+
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    while (_mqtt_bench_pub.completed + _mqtt_bench_pub.failed < result->published) {
+        int64_t progress = MAX(_mqtt_bench_pub.last_progress, published);
+        int64_t remaining = progress + MQTT_BENCH_TIMEOUT_MS - k_uptime_get();
+        if (remaining <= 0) {
+            rc = -ETIMEDOUT;
+            break;
+        }
+        k_mutex_unlock(&_mqtt_bench_lock);
+        k_sem_take(&_mqtt_bench_progress, K_MSEC(remaining));
+        k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    }
+
+    result->completed = _mqtt_bench_pub.completed;
+    result->failed = _mqtt_bench_pub.failed;
+    result->latency = _mqtt_bench_pub.latency;
+    *end = _mqtt_bench_pub.last_progress;
+    // Late acknowledgements no longer count
+    _mqtt_bench_pub.run++;
+    k_mutex_unlock(&_mqtt_bench_lock);
+
+    return rc;
+}
+
+int mqtt_bench_publish(struct mqtt_service* service, const struct mqtt_bench_pub_params* params,
+    struct mqtt_bench_pub_result* result)
+{
+    if (params->size > MQTT_QUEUE_PAYLOAD_LEN || params->qos > MQTT_QOS_2_EXACTLY_ONCE ||
+        strlen(params->topic) > MQTT_QUEUE_TOPIC_LEN) {
+        return -EINVAL;
+    }
+
+    memset(result, 0, sizeof(*result));
+    _mqtt_bench_latency_reset(&result->latency);
+
+    // Stored rather than sent, there would be nothing to measure
+    if (params->qos == MQTT_QOS_0_AT_MOST_ONCE && mqtt_service_get_state(service) != MQTT_SERVICE_CONNECTED) {
+        return -ENOTCONN;
+    }
+    if (!atomic_cas(&_mqtt_bench_busy, 0, 1)) {
+        return -EBUSY;
+    }
+
+    uint32_t rejected = 0;
+    int stalled = 0;
+    int64_t start = k_uptime_get();
+
+    struct mqtt_queue_stats queue;
+    mqtt_service_get_queue_stats(service, &queue);
+
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    uint32_t run = ++_mqtt_bench_pub.run;
+    _mqtt_bench_pub.completed = 0;
+    _mqtt_bench_pub.failed = 0;
+    _mqtt_bench_pub.last_progress = start;
+    _mqtt_bench_latency_reset(&_mqtt_bench_pub.latency);
+    k_sem_reset(&_mqtt_bench_progress);
+    k_mutex_unlock(&_mqtt_bench_lock);
+
+    uint8_t payload[MQTT_QUEUE_PAYLOAD_LEN];
+    memset(payload, 0x55, sizeof(payload));
+    struct mqtt_bench_header header = {
+        .boot_id = _mqtt_bench_get_boot_id(),
+        .run = run,
+    };
+
+    for (uint32_t i = 0; i < params->count; i++) {
+        if (params->rate > 0) {
+            int64_t due = start + (int64_t)i * MSEC_PER_SEC / params->rate;
+            int64_t now = k_uptime_get();
+            if (due > now) {
+                k_sleep(K_MSEC(due - now));
+            }
+        }
+        stalled = _mqtt_bench_wait_for_room(service);
+        if (stalled < 0) {
+            // The messages published so far are still waited for
+            break;
+        }
+        result->stalls += stalled;
+
+        header.seq = i;
+        header.timestamp = k_cycle_get_32();
+        if (params->size >= sizeof(header)) {
+            memcpy(payload, &header, sizeof(header));
+        }
+
+        void* tag = (void*)(uintptr_t)((header.timestamp & ~MQTT_BENCH_RUN_MASK) | (run & MQTT_BENCH_RUN_MASK));
+        int rc = mqtt_service_publish_cb(service, params->topic, params->qos, payload, params->size,
+            _mqtt_bench_complete, tag);
+        if (rc != 0) {
+            // Only when other publishers took the room meanwhile
+            rejected++;
+            continue;
+        }
+        result->published++;
+    }
+
+    int64_t end;
+    int rc = params->qos == MQTT_QOS_0_AT_MOST_ONCE ?
+        _mqtt_bench_wait_sent(service, queue.sent, result, &end) :
+        _mqtt_bench_wait_acked(result, k_uptime_get(), &end);
+    result->failed += rejected;
+    result->elapsed_ms = (uint32_t)(end - start);
+    if (rc == 0 && stalled < 0) {
+        rc = stalled;
+    }
+
+    atomic_clear(&_mqtt_bench_busy);
+    return rc;
+}
+
+// Counts whole messages, the header is taken from the first chunk
+static int _mqtt_bench_receive(struct mqtt_service* service, const struct mqtt_utf8* topic,
+    const struct mqtt_topic_chunk* chunk, void* context)
+{
+    int filter = (int)(intptr_t)context;
+    if (chunk->offset != 0) {
+        return 0;
+    }
+
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    if (filter != _mqtt_bench_sub.active) {
+        k_mutex_unlock(&_mqtt_bench_lock);
+        return 0;
+    }
+
+    int64_t now = k_uptime_get();
+    if (_mqtt_bench_sub.stats.received++ == 0) {
+        _mqtt_bench_sub.first = now;
+    }
+    _mqtt_bench_sub.last = now;
+    _mqtt_bench_sub.stats.bytes += chunk->total;
+
+    struct mqtt_bench_header header;
+    if (chunk->len >= sizeof(header)) {
+        memcpy(&header, chunk->data, sizeof(header));
+        if (header.boot_id == _mqtt_bench_boot_id && _mqtt_bench_boot_id != 0) {
+            _mqtt_bench_latency_add(&_mqtt_bench_sub.stats.latency, header.timestamp);
+            if (header.run == _mqtt_bench_sub.last_run && header.seq < _mqtt_bench_sub.next_seq) {
+                _mqtt_bench_sub.stats.reordered++;
+            }
+            _mqtt_bench_sub.last_run = header.run;
+            _mqtt_bench_sub.next_seq = header.seq + 1;
+        }
+    }
+    k_mutex_unlock(&_mqtt_bench_lock);
+    return 0;
+}
+
+static int _mqtt_bench_find_filter(struct mqtt_service* service, const char* filter) {
+    for (size_t i = 0; i < _mqtt_bench_sub.filter_count; i++) {
+        if (strcmp(_mqtt_bench_sub.filters[i], filter) == 0) {
+            return i;
+        }
+    }
+
+    if (_mqtt_bench_sub.filter_count >= MQTT_BENCH_MAX_FILTERS) {
+        return -ENOMEM;
+    }
+
+    // The handler and the subscription keep referring to the filter
+    int index = _mqtt_bench_sub.filter_count;
+    strcpy(_mqtt_bench_sub.filters[index], filter);
+    int rc = mqtt_service_register_stream_handler(service, _mqtt_bench_sub.filters[index],
+        _mqtt_bench_receive, (void*)(intptr_t)index);
+    if (rc != 0) {
+        return rc;
+    }
+    _mqtt_bench_sub.filter_count++;
+    return index;
+}
+
+int mqtt_bench_subscribe(struct mqtt_service* service, const char* filter, uint8_t qos) {
+    if (strlen(filter) > MQTT_QUEUE_TOPIC_LEN || qos > MQTT_QOS_2_EXACTLY_ONCE) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    int index = _mqtt_bench_find_filter(service, filter);
+    if (index < 0) {
+        k_mutex_unlock(&_mqtt_bench_lock);
+        return index;
+    }
+
+    int previous = _mqtt_bench_sub.active;
+    _mqtt_bench_sub.active = index;
+    _mqtt_bench_sub.last_run = 0;
+    _mqtt_bench_sub.next_seq = 0;
+    memset(&_mqtt_bench_sub.stats, 0, sizeof(_mqtt_bench_sub.stats));
+    _mqtt_bench_latency_reset(&_mqtt_bench_sub.stats.latency);
+    k_mutex_unlock(&_mqtt_bench_lock);
+
+    if (previous >= 0 && previous != index) {
+        mqtt_service_unsubscribe(service, _mqtt_bench_sub.filters[previous]);
+    }
+    return mqtt_service_subscribe(service, _mqtt_bench_sub.filters[index], qos, NULL, 0);
+}
+
+int mqtt_bench_unsubscribe(struct mqtt_service* service) {
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    int previous = _mqtt_bench_sub.active;
+    _mqtt_bench_sub.active = -1;
+    k_mutex_unlock(&_mqtt_bench_lock);
+
+    if (previous < 0) {
+        return -ENOENT;
+    }
+    return mqtt_service_unsubscribe(service, _mqtt_bench_sub.filters[previous]);
+}
+
+const char* mqtt_bench_get_filter(void) {
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    int active = _mqtt_bench_sub.active;
+    k_mutex_unlock(&_mqtt_bench_lock);
+
+    return active < 0 ? NULL : _mqtt_bench_sub.filters[active];
+}
+
+void mqtt_bench_get_sub_stats(struct mqtt_bench_sub_stats* stats) {
+    k_mutex_lock(&_mqtt_bench_lock, K_FOREVER);
+    *stats = _mqtt_bench_sub.stats;
+    stats->elapsed_ms = (uint32_t)(_mqtt_bench_sub.last - _mqtt_bench_sub.first);
+    k_mutex_unlock(&_mqtt_bench_lock);
+}
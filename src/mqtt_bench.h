@@ -0,0 +1,96 @@
+#pragma once
+
+#include "mqtt_service.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Give up waiting for acknowledgements after this long without progress
+#define MQTT_BENCH_TIMEOUT_MS 10000
+// Distinct filters "mqtt bench sub" can use before rebooting, handlers
+// cannot be unregistered
+#define MQTT_BENCH_MAX_FILTERS 4
+
+// Start of every benchmark payload of at least this size, so a subscriber on
+// the same device can tell the end-to-end latency through the broker
+struct mqtt_bench_header {
+    // Random per boot, tells messages of this device from the others
+    uint32_t boot_id;
+    uint32_t run;
+    uint32_t seq;
+    // Cycle count when published
+    uint32_t timestamp;
+};
+
+struct mqtt_bench_latency {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+};
+
+struct mqtt_bench_pub_params {
+    const char* topic;
+    uint32_t count;
+    uint16_t size;
+    uint8_t qos;
+    // Messages per second, 0 to publish as fast as the queue takes them
+    uint32_t rate;
+};
+
+struct mqtt_bench_pub_result {
+    // Accepted by the queue
+    uint32_t published;
+    // Acknowledged by the broker, or written to the socket for QoS 0
+    uint32_t completed;
+    // Completed with an error, e.g. dropped as too large
+    uint32_t failed;
+    // Times publishing waited for the queue or the message pool to drain
+    uint32_t stalls;
+    // First publish to last completion
+    uint32_t elapsed_ms;
+    // Publish to PUBACK/PUBCOMP in microseconds, QoS 1/2 only
+    struct mqtt_bench_latency latency;
+};
+
+struct mqtt_bench_sub_stats {
+    uint32_t received;
+    uint32_t bytes;
+    // First to last message received
+    uint32_t elapsed_ms;
+    // Messages of this device's own runs, with the publish to receive
+    // latency in microseconds, and those received out of order
+    struct mqtt_bench_latency latency;
+    uint32_t reordered;
+};
+
+// Publish `params->count` messages of `params->size` bytes and wait until
+// all of them completed, blocking the caller throughout. Waits for room in
+// the queue rather than dropping messages, so with a rate of 0 the result is
+// the publish ceiling of the service at that QoS. Returns -EBUSY while
+// another run is in progress and -ETIMEDOUT when messages were still
+// outstanding MQTT_BENCH_TIMEOUT_MS after the last progress, or the queue
+// had no room for as long, the result then covers those that completed.
+// QoS 0 runs only count messages written to the socket and return
+// -ENOTCONN when the service is, or gets, disconnected, as the messages
+// would be stored instead.
+int mqtt_bench_publish(struct mqtt_service* service, const struct mqtt_bench_pub_params* params,
+    struct mqtt_bench_pub_result* result);
+
+// Subscribe to `filter` and count the messages received on it, replacing the
+// previous benchmark subscription. The counters start over.
+int mqtt_bench_subscribe(struct mqtt_service* service, const char* filter, uint8_t qos);
+int mqtt_bench_unsubscribe(struct mqtt_service* service);
+
+// Filter subscribed to, NULL if none
+const char* mqtt_bench_get_filter(void);
+void mqtt_bench_get_sub_stats(struct mqtt_bench_sub_stats* stats);
+
+static inline uint32_t mqtt_bench_latency_avg(const struct mqtt_bench_latency* latency) {
+    return latency->count > 0 ? (uint32_t)(latency->sum / latency->count) : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
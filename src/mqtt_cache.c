@@ -0,0 +1,120 @@
+#include "mqtt_cache.h"
+
+#include <string.h>
+
+void mqtt_cache_init(struct mqtt_cache* self) {
+    self->count = 0;
+    self->stats.suppressed = 0;
+    self->stats.coalesced = 0;
+}
+
+int mqtt_cache_add(struct mqtt_cache* self, const char* topic, const struct mqtt_cache_policy* policy) {
+    size_t len = strlen(topic);
+    struct mqtt_cache_entry* entry = mqtt_cache_find(self, topic, len);
+
+    if (entry == NULL) {
+        if (self->count >= MQTT_CACHE_SIZE) {
+            return -ENOMEM;
+        }
+
+        entry = &self->entries[self->count++];
+        entry->topic = topic;
+        entry->topic_len = len;
+        entry->valid = false;
+        entry->sent_at = 0;
+        entry->held = NULL;
+    }
+
+    entry->policy = *policy;
+    return 0;
+}
+
+struct mqtt_cache_entry* mqtt_cache_find(struct mqtt_cache* self, const char* topic, size_t len) {
+    for (size_t i = 0; i < self->count; i++) {
+        struct mqtt_cache_entry* entry = &self->entries[i];
+        if (entry->topic_len == len && memcmp(entry->topic, topic, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t _mqtt_cache_rate_interval(const struct mqtt_cache_entry* entry) {
+    return entry->policy.max_rate > 0 ? 1000 / entry->policy.max_rate : 0;
+}
+
+bool mqtt_cache_unchanged(const struct mqtt_cache_entry* entry, const struct mqtt_queue_msg* msg) {
+    return entry->policy.on_change && entry->valid && msg->payload_len == entry->value_len &&
+        memcmp(msg->payload, entry->value, msg->payload_len) == 0;
+}
+
+enum mqtt_cache_verdict mqtt_cache_check(const struct mqtt_cache_entry* entry,
+    const struct mqtt_queue_msg* msg, int64_t now)
+{
+    if (!entry->valid) {
+        return MQTT_CACHE_PASS;
+    }
+
+    // Once a value is held back, newer ones take its place until it is due
+    if (entry->held != NULL) {
+        return MQTT_CACHE_HOLD;
+    }
+
+    if (mqtt_cache_unchanged(entry, msg)) {
+        return MQTT_CACHE_DROP;
+    }
+
+    int64_t elapsed = now - entry->sent_at;
+    if (elapsed < entry->policy.min_interval) {
+        return MQTT_CACHE_DROP;
+    }
+
+    if (elapsed < _mqtt_cache_rate_interval(entry)) {
+        return MQTT_CACHE_HOLD;
+    }
+
+    return MQTT_CACHE_PASS;
+}
+
+void mqtt_cache_sent(struct mqtt_cache_entry* entry, const struct mqtt_queue_msg* msg, int64_t now) {
+    entry->valid = true;
+    entry->sent_at = now;
+    entry->value_len = msg->payload_len;
+    memcpy(entry->value, msg->payload, msg->payload_len);
+}
+
+static int64_t _mqtt_cache_release_at(const struct mqtt_cache_entry* entry) {
+    return entry->valid ? entry->sent_at + _mqtt_cache_rate_interval(entry) : 0;
+}
+
+struct mqtt_cache_entry* mqtt_cache_next_due(struct mqtt_cache* self, int64_t now) {
+    for (size_t i = 0; i < self->count; i++) {
+        struct mqtt_cache_entry* entry = &self->entries[i];
+        if (entry->held != NULL && _mqtt_cache_release_at(entry) <= now) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int64_t mqtt_cache_next_release(const struct mqtt_cache* self) {
+    int64_t release = INT64_MAX;
+    for (size_t i = 0; i < self->count; i++) {
+        const struct mqtt_cache_entry* entry = &self->entries[i];
+        if (entry->held != NULL) {
+            release = MIN(release, _mqtt_cache_release_at(entry));
+        }
+    }
+    return release;
+}
+
+void mqtt_cache_invalidate(struct mqtt_cache* self) {
+    for (size_t i = 0; i < self->count; i++) {
+        self->entries[i].valid = false;
+    }
+}
+
+void mqtt_cache_get_stats(const struct mqtt_cache* self, struct mqtt_cache_stats* stats) {
+    stats->suppressed = self->stats.suppressed;
+    stats->coalesced = self->stats.coalesced;
+}
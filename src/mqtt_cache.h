@@ -0,0 +1,90 @@
+#pragma once
+
+#include <zephyr.h>
+
+#include "mqtt_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_CACHE_SIZE CONFIG_MQTT_SERVICE_CACHE_SIZE
+
+struct mqtt_cache_policy {
+    // Drop values equal to the last one sent
+    bool on_change;
+    // Drop values arriving within this many milliseconds of the last one sent
+    uint32_t min_interval;
+    // Send at most this many values per second, holding back the latest one
+    // until the next slot (latest value wins)
+    uint32_t max_rate;
+};
+
+enum mqtt_cache_verdict {
+    MQTT_CACHE_PASS = 0,
+    MQTT_CACHE_DROP = 1,
+    MQTT_CACHE_HOLD = 2,
+};
+
+struct mqtt_cache_entry {
+    const char* topic;
+    uint16_t topic_len;
+    struct mqtt_cache_policy policy;
+
+    // Last value sent
+    bool valid;
+    int64_t sent_at;
+    uint16_t value_len;
+    uint8_t value[MQTT_QUEUE_PAYLOAD_LEN];
+
+    // Latest value held back by the rate limit, from the message pool
+    struct mqtt_queue_msg* held;
+};
+
+struct mqtt_cache_stats {
+    uint32_t suppressed;
+    uint32_t coalesced;
+};
+
+// Last-value cache of the topics with a publish policy. Only to be used from
+// the service thread, entries are to be added before the service starts.
+struct mqtt_cache {
+    struct mqtt_cache_entry entries[MQTT_CACHE_SIZE];
+    size_t count;
+
+    struct {
+        uint32_t suppressed;
+        uint32_t coalesced;
+    } stats;
+};
+
+void mqtt_cache_init(struct mqtt_cache* self);
+
+int mqtt_cache_add(struct mqtt_cache* self, const char* topic, const struct mqtt_cache_policy* policy);
+
+struct mqtt_cache_entry* mqtt_cache_find(struct mqtt_cache* self, const char* topic, size_t len);
+
+// Whether `msg` repeats the last value sent on a topic published on change only
+bool mqtt_cache_unchanged(const struct mqtt_cache_entry* entry, const struct mqtt_queue_msg* msg);
+
+// Decide on a message about to be sent, without changing the cache state
+enum mqtt_cache_verdict mqtt_cache_check(const struct mqtt_cache_entry* entry,
+    const struct mqtt_queue_msg* msg, int64_t now);
+
+// Record `msg` as the last value sent
+void mqtt_cache_sent(struct mqtt_cache_entry* entry, const struct mqtt_queue_msg* msg, int64_t now);
+
+// Entry whose held back value is due for sending, NULL if none
+struct mqtt_cache_entry* mqtt_cache_next_due(struct mqtt_cache* self, int64_t now);
+
+// Uptime at which the next held back value is due, INT64_MAX if none
+int64_t mqtt_cache_next_release(const struct mqtt_cache* self);
+
+// Forget the last values sent, so the next value of every topic passes
+void mqtt_cache_invalidate(struct mqtt_cache* self);
+
+void mqtt_cache_get_stats(const struct mqtt_cache* self, struct mqtt_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,219 @@
+#include "mqtt_dispatch.h"
+#include "mqtt_latency.h"
+#include "mqtt_pool.h"
+#include "mqtt_service.h"
+#include "trace.h"
+
+#include <string.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mqtt_dispatch, LOG_LEVEL_INF);
+
+// FNV-1a, the lane only needs to be stable for a topic
+static struct mqtt_dispatch_lane* _mqtt_dispatch_lane(struct mqtt_dispatch* self,
+    const char* topic, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)topic[i]) * 16777619U;
+    }
+    return &self->lanes[hash % MQTT_DISPATCH_LANES];
+}
+
+static void _mqtt_dispatch_lane_work(struct k_work* work) {
+    struct mqtt_dispatch_lane* lane = CONTAINER_OF(work, struct mqtt_dispatch_lane, work);
+    struct mqtt_dispatch* self = lane->dispatch;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    sys_snode_t* node = sys_slist_get(&lane->pending);
+    k_mutex_unlock(&self->lock);
+
+    if (node == NULL) {
+        return;
+    }
+
+    struct mqtt_dispatch_entry* entry = CONTAINER_OF(node, struct mqtt_dispatch_entry, node);
+    const struct mqtt_queue_msg* msg = entry->msg;
+    const struct mqtt_utf8 topic = {
+        .utf8 = (const uint8_t*)msg->topic,
+        .size = msg->topic_len,
+    };
+
+    self->current = msg;
+    self->offset = 0;
+    entry->result = entry->handler(self->service, &topic, msg->payload_len, entry->context);
+    self->current = NULL;
+    TRACE(TRACE_MQTT_HANDLED, 0, entry->message_id, entry->result);
+
+    if (entry->result >= 0) {
+        MQTT_LATENCY_RECORD(MQTT_LATENCY_RECEIVE_TO_HANDLED, msg->timestamp);
+    }
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    if (entry->result < 0) {
+        self->stats.failed++;
+    }
+    sys_slist_append(&self->done, &entry->node);
+    lane->queued--;
+    bool more = !sys_slist_is_empty(&lane->pending);
+    k_mutex_unlock(&self->lock);
+
+    mqtt_service_wakeup(self->service);
+
+    // Back of the queue, behind the other lanes
+    if (more) {
+        k_work_submit_to_queue(self->queue, &lane->work);
+    }
+}
+
+void mqtt_dispatch_init(struct mqtt_dispatch* self, struct mqtt_service* service) {
+    self->service = service;
+    self->queue = NULL;
+    self->generation = 0;
+    self->current = NULL;
+    self->offset = 0;
+    k_mutex_init(&self->lock);
+
+    sys_slist_init(&self->free);
+    sys_slist_init(&self->done);
+    for (size_t i = 0; i < MQTT_DISPATCH_DEPTH; i++) {
+        sys_slist_append(&self->free, &self->entries[i].node);
+    }
+    for (size_t i = 0; i < MQTT_DISPATCH_LANES; i++) {
+        self->lanes[i].dispatch = self;
+        k_work_init(&self->lanes[i].work, _mqtt_dispatch_lane_work);
+        sys_slist_init(&self->lanes[i].pending);
+        self->lanes[i].queued = 0;
+    }
+
+    self->stats.dispatched = 0;
+    self->stats.inline_handled = 0;
+    self->stats.failed = 0;
+    self->stats.pending = 0;
+    self->stats.max_pending = 0;
+}
+
+void mqtt_dispatch_set_queue(struct mqtt_dispatch* self, struct k_work_q* queue) {
+    self->queue = queue;
+}
+
+bool mqtt_dispatch_full(struct mqtt_dispatch* self) {
+    k_mutex_lock(&self->lock, K_FOREVER);
+    bool full = sys_slist_is_empty(&self->free);
+    k_mutex_unlock(&self->lock);
+    return full;
+}
+
+struct mqtt_dispatch_entry* mqtt_dispatch_alloc(struct mqtt_dispatch* self,
+    const struct mqtt_utf8* topic, size_t payload_len)
+{
+    struct mqtt_queue_msg* msg = NULL;
+    sys_snode_t* node = NULL;
+
+    if (topic->size <= MQTT_QUEUE_TOPIC_LEN && payload_len <= MQTT_QUEUE_PAYLOAD_LEN) {
+        msg = mqtt_pool_alloc();
+    }
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    if (msg != NULL) {
+        node = sys_slist_get(&self->free);
+    }
+    k_mutex_unlock(&self->lock);
+
+    if (node == NULL) {
+        if (msg != NULL) {
+            mqtt_pool_free(msg);
+        }
+        return NULL;
+    }
+
+    struct mqtt_dispatch_entry* entry = CONTAINER_OF(node, struct mqtt_dispatch_entry, node);
+    entry->msg = msg;
+    msg->complete = NULL;
+    msg->context = NULL;
+    msg->retain = 0;
+    msg->topic_len = topic->size;
+    msg->payload_len = payload_len;
+    memcpy(msg->topic, topic->utf8, topic->size);
+    return entry;
+}
+
+bool mqtt_dispatch_take_turn(struct mqtt_dispatch* self, const struct mqtt_utf8* topic) {
+    struct mqtt_dispatch_lane* lane = _mqtt_dispatch_lane(self, (const char*)topic->utf8, topic->size);
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    bool idle = lane->queued == 0;
+    if (idle) {
+        self->stats.inline_handled++;
+    }
+    k_mutex_unlock(&self->lock);
+    return idle;
+}
+
+void mqtt_dispatch_cancel(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry) {
+    mqtt_pool_free(entry->msg);
+    entry->msg = NULL;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    sys_slist_append(&self->free, &entry->node);
+    k_mutex_unlock(&self->lock);
+}
+
+void mqtt_dispatch_submit(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry) {
+    struct mqtt_dispatch_lane* lane = _mqtt_dispatch_lane(self, entry->msg->topic, entry->msg->topic_len);
+    entry->generation = self->generation;
+    TRACE(TRACE_MQTT_DISPATCH, lane - self->lanes, entry->message_id, 0);
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    sys_slist_append(&lane->pending, &entry->node);
+    lane->queued++;
+    self->stats.dispatched++;
+    self->stats.pending++;
+    self->stats.max_pending = MAX(self->stats.max_pending, self->stats.pending);
+    k_mutex_unlock(&self->lock);
+
+    k_work_submit_to_queue(self->queue, &lane->work);
+}
+
+struct mqtt_dispatch_entry* mqtt_dispatch_next_done(struct mqtt_dispatch* self) {
+    k_mutex_lock(&self->lock, K_FOREVER);
+    sys_snode_t* node = sys_slist_get(&self->done);
+    k_mutex_unlock(&self->lock);
+
+    return node == NULL ? NULL : CONTAINER_OF(node, struct mqtt_dispatch_entry, node);
+}
+
+void mqtt_dispatch_release(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry) {
+    mqtt_pool_free(entry->msg);
+    entry->msg = NULL;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    sys_slist_append(&self->free, &entry->node);
+    self->stats.pending--;
+    k_mutex_unlock(&self->lock);
+}
+
+bool mqtt_dispatch_in_handler(const struct mqtt_dispatch* self) {
+    return self->queue != NULL && k_current_get() == &self->queue->thread && self->current != NULL;
+}
+
+int mqtt_dispatch_read_payload(struct mqtt_dispatch* self, void* buffer, size_t len) {
+    const struct mqtt_queue_msg* msg = self->current;
+    if (msg == NULL || self->offset + len > msg->payload_len) {
+        return -EINVAL;
+    }
+
+    memcpy(buffer, msg->payload + self->offset, len);
+    self->offset += len;
+    return 0;
+}
+
+void mqtt_dispatch_get_stats(struct mqtt_dispatch* self, struct mqtt_dispatch_stats* stats) {
+    k_mutex_lock(&self->lock, K_FOREVER);
+    stats->dispatched = self->stats.dispatched;
+    stats->inline_handled = self->stats.inline_handled;
+    stats->failed = self->stats.failed;
+    stats->pending = self->stats.pending;
+    stats->max_pending = self->stats.max_pending;
+    k_mutex_unlock(&self->lock);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <zephyr.h>
+#include <sys/slist.h>
+#include <net/mqtt.h>
+
+#include "mqtt_queue.h"
+#include "mqtt_topic_trie.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_DISPATCH_DEPTH CONFIG_MQTT_SERVICE_DISPATCH_DEPTH
+#define MQTT_DISPATCH_LANES CONFIG_MQTT_SERVICE_DISPATCH_LANES
+
+struct mqtt_service;
+struct mqtt_dispatch;
+
+struct mqtt_dispatch_entry {
+    sys_snode_t node;
+    // Topic and payload, from the message pool
+    struct mqtt_queue_msg* msg;
+    uint16_t message_id;
+    // Connection the message arrived on, its acknowledgement is dropped
+    // once that connection is gone
+    uint32_t generation;
+    mqtt_topic_handler_t handler;
+    void* context;
+    int result;
+};
+
+// Messages of one topic always go through the same lane, one at a time
+struct mqtt_dispatch_lane {
+    struct mqtt_dispatch* dispatch;
+    struct k_work work;
+    sys_slist_t pending;
+    // Submitted messages whose handler has not returned yet
+    uint32_t queued;
+};
+
+struct mqtt_dispatch_stats {
+    uint32_t dispatched;
+    uint32_t inline_handled;
+    uint32_t failed;
+    uint32_t pending;
+    uint32_t max_pending;
+};
+
+// Runs the handlers of inbound messages on a work queue instead of the
+// service thread. The service thread copies the message into a pooled
+// buffer, hands it to the lane of its topic and goes back to the network;
+// the acknowledgement is sent by the service thread once the handler has
+// returned. Lanes run in turn, one message each, so a busy topic does not
+// hold up the others while every topic keeps its order.
+//
+// Once every entry is taken the service stops reading the socket until one
+// is released. A message that still cannot be dispatched, being too large
+// or out of pooled buffers, is left on the socket until an entry frees up
+// or the handlers queued on its lane have returned, then it is handled on
+// the service thread.
+struct mqtt_dispatch {
+    struct mqtt_service* service;
+    struct k_work_q* queue;
+    struct mqtt_dispatch_entry entries[MQTT_DISPATCH_DEPTH];
+    struct mqtt_dispatch_lane lanes[MQTT_DISPATCH_LANES];
+    sys_slist_t free;
+    // Handled, waiting for the service thread to acknowledge them
+    sys_slist_t done;
+    uint32_t generation;
+    struct k_mutex lock;
+
+    // Message being handled on the work queue, read by
+    // mqtt_service_read_payload()
+    const struct mqtt_queue_msg* current;
+    size_t offset;
+
+    struct {
+        uint32_t dispatched;
+        uint32_t inline_handled;
+        uint32_t failed;
+        uint32_t pending;
+        uint32_t max_pending;
+    } stats;
+};
+
+void mqtt_dispatch_init(struct mqtt_dispatch* self, struct mqtt_service* service);
+
+// Run the handlers on `queue`, NULL to run them on the service thread
+void mqtt_dispatch_set_queue(struct mqtt_dispatch* self, struct k_work_q* queue);
+
+static inline bool mqtt_dispatch_enabled(const struct mqtt_dispatch* self) {
+    return self->queue != NULL;
+}
+
+// True when no entry is left, the socket is not to be read until one is
+bool mqtt_dispatch_full(struct mqtt_dispatch* self);
+
+// Reserve an entry and a pooled buffer for a message with `topic`, NULL
+// when either is exhausted or the message does not fit, in which case the
+// message is to be handled on the service thread once
+// mqtt_dispatch_take_turn() allows. The payload is to be read into
+// entry->msg before submitting.
+struct mqtt_dispatch_entry* mqtt_dispatch_alloc(struct mqtt_dispatch* self,
+    const struct mqtt_utf8* topic, size_t payload_len);
+
+// True when the handlers of every message submitted on the lane of `topic`
+// have returned, the message is then counted as handled on the service
+// thread. Never blocks.
+bool mqtt_dispatch_take_turn(struct mqtt_dispatch* self, const struct mqtt_utf8* topic);
+
+// Give back an entry that was not submitted
+void mqtt_dispatch_cancel(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry);
+
+void mqtt_dispatch_submit(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry);
+
+// Next message whose handler has returned, to be acknowledged and released
+// by the service thread
+struct mqtt_dispatch_entry* mqtt_dispatch_next_done(struct mqtt_dispatch* self);
+void mqtt_dispatch_release(struct mqtt_dispatch* self, struct mqtt_dispatch_entry* entry);
+
+// Drop the acknowledgements of the messages still in flight, called when
+// the connection is lost
+static inline void mqtt_dispatch_disconnected(struct mqtt_dispatch* self) {
+    self->generation++;
+}
+
+// True when called from a handler run by the dispatcher
+bool mqtt_dispatch_in_handler(const struct mqtt_dispatch* self);
+
+// Copy the next `len` bytes of the payload of the message being handled
+int mqtt_dispatch_read_payload(struct mqtt_dispatch* self, void* buffer, size_t len);
+
+void mqtt_dispatch_get_stats(struct mqtt_dispatch* self, struct mqtt_dispatch_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
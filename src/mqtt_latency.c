@@ -0,0 +1,93 @@
+#include "mqtt_latency.h"
+
+#include <string.h>
+
+struct mqtt_latency_histogram {
+    atomic_t buckets[MQTT_LATENCY_BUCKETS];
+    atomic_t count;
+    atomic_t min;
+    atomic_t max;
+};
+
+static const char* const _mqtt_latency_stage_names[MQTT_LATENCY_STAGE_COUNT] = {
+    [MQTT_LATENCY_ORIGIN_TO_ENQUEUE] = "enqueue",
+    [MQTT_LATENCY_ENQUEUE_TO_SEND] = "send",
+    [MQTT_LATENCY_PUBLISH_TO_ACK] = "ack",
+    [MQTT_LATENCY_RECEIVE_TO_HANDLED] = "handle",
+};
+
+static struct mqtt_latency_histogram _mqtt_latency[MQTT_LATENCY_STAGE_COUNT];
+
+const char* mqtt_latency_stage_name(enum mqtt_latency_stage stage) {
+    return stage < MQTT_LATENCY_STAGE_COUNT ? _mqtt_latency_stage_names[stage] : "unknown";
+}
+
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+
+void mqtt_latency_record(enum mqtt_latency_stage stage, uint32_t start) {
+    struct mqtt_latency_histogram* hist = &_mqtt_latency[stage];
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+    size_t bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+    atomic_inc(&hist->buckets[MIN(bucket, MQTT_LATENCY_BUCKETS - 1)]);
+
+    // The first sample initializes min, count is incremented last so
+    // readers never see a sample without its min/max.
+    atomic_val_t min = atomic_get(&hist->min);
+    while ((atomic_get(&hist->count) == 0 || (uint32_t)min > us) &&
+        !atomic_cas(&hist->min, min, us)) {
+        min = atomic_get(&hist->min);
+    }
+
+    atomic_val_t max = atomic_get(&hist->max);
+    while ((uint32_t)max < us && !atomic_cas(&hist->max, max, us)) {
+        max = atomic_get(&hist->max);
+    }
+
+    atomic_inc(&hist->count);
+}
+
+#endif
+
+static uint32_t _mqtt_latency_percentile(const struct mqtt_latency_histogram* hist,
+    uint32_t count, uint32_t percent)
+{
+    uint32_t rank = (count * percent + 99) / 100;
+    uint32_t total = 0;
+
+    for (size_t i = 0; i < MQTT_LATENCY_BUCKETS; i++) {
+        total += atomic_get(&hist->buckets[i]);
+        if (total >= rank) {
+            return i == 0 ? 0 : BIT(i) - 1;
+        }
+    }
+    return UINT32_MAX;
+}
+
+void mqtt_latency_summary(enum mqtt_latency_stage stage, struct mqtt_latency_summary* summary) {
+    const struct mqtt_latency_histogram* hist = &_mqtt_latency[stage];
+
+    memset(summary, 0, sizeof(*summary));
+    summary->count = atomic_get(&hist->count);
+    if (summary->count == 0) {
+        return;
+    }
+
+    summary->min = atomic_get(&hist->min);
+    summary->max = atomic_get(&hist->max);
+    summary->p50 = MIN(_mqtt_latency_percentile(hist, summary->count, 50), summary->max);
+    summary->p90 = MIN(_mqtt_latency_percentile(hist, summary->count, 90), summary->max);
+    summary->p99 = MIN(_mqtt_latency_percentile(hist, summary->count, 99), summary->max);
+}
+
+void mqtt_latency_reset(void) {
+    for (size_t stage = 0; stage < MQTT_LATENCY_STAGE_COUNT; stage++) {
+        struct mqtt_latency_histogram* hist = &_mqtt_latency[stage];
+        atomic_clear(&hist->count);
+        for (size_t i = 0; i < MQTT_LATENCY_BUCKETS; i++) {
+            atomic_clear(&hist->buckets[i]);
+        }
+        atomic_clear(&hist->min);
+        atomic_clear(&hist->max);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Log2 histogram buckets, bucket n counts samples below 2^n microseconds
+#define MQTT_LATENCY_BUCKETS 24
+
+enum mqtt_latency_stage {
+    // Origin of the event (e.g. GPIO interrupt) to enqueued for publishing
+    MQTT_LATENCY_ORIGIN_TO_ENQUEUE = 0,
+    // Enqueued to written to the socket
+    MQTT_LATENCY_ENQUEUE_TO_SEND,
+    // PUBLISH sent to PUBACK/PUBCOMP received
+    MQTT_LATENCY_PUBLISH_TO_ACK,
+    // PUBLISH received to handler completed
+    MQTT_LATENCY_RECEIVE_TO_HANDLED,
+
+    MQTT_LATENCY_STAGE_COUNT
+};
+
+struct mqtt_latency_summary {
+    uint32_t count;
+    uint32_t min;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t max;
+};
+
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+
+#define MQTT_LATENCY_TIMESTAMP() k_cycle_get_32()
+#define MQTT_LATENCY_RECORD(stage, start) mqtt_latency_record((stage), (start))
+
+// Record the time elapsed since the `start` cycle count. Safe from ISR context.
+void mqtt_latency_record(enum mqtt_latency_stage stage, uint32_t start);
+
+#else
+
+#define MQTT_LATENCY_TIMESTAMP() 0U
+#define MQTT_LATENCY_RECORD(stage, start) do { (void)(start); } while (0)
+
+#endif
+
+const char* mqtt_latency_stage_name(enum mqtt_latency_stage stage);
+
+// Summary in microseconds, percentiles are bucket upper bounds
+void mqtt_latency_summary(enum mqtt_latency_stage stage, struct mqtt_latency_summary* summary);
+
+void mqtt_latency_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,197 @@
+#include "mqtt_metrics.h"
+#include "mqtt_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mqtt_metrics, LOG_LEVEL_INF);
+
+#if defined(CONFIG_NET_STATISTICS_USER_API)
+#include <net/net_mgmt.h>
+#include <net/net_stats.h>
+#endif
+
+static void _mqtt_metrics_publish(struct mqtt_service* service, const char* topic, char* payload, int len) {
+    if (len > 0) {
+        mqtt_service_publish(service, topic, MQTT_QOS_0_AT_MOST_ONCE, payload,
+            MIN(len, MQTT_QUEUE_PAYLOAD_LEN - 1));
+    }
+}
+
+void mqtt_metrics_uptime(struct mqtt_service* service, const char* topic, void* context) {
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(payload, sizeof(payload), "%u", (uint32_t)(k_uptime_get() / MSEC_PER_SEC));
+    _mqtt_metrics_publish(service, topic, payload, len);
+}
+
+void mqtt_metrics_queues(struct mqtt_service* service, const char* topic, void* context) {
+    struct mqtt_queue_stats queue;
+    struct mqtt_outbox_stats outbox;
+    struct mqtt_pool_stats pool;
+
+    mqtt_service_get_queue_stats(service, &queue);
+    mqtt_service_get_outbox_stats(service, &outbox);
+    mqtt_pool_get_stats(&pool);
+
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(payload, sizeof(payload), "%u,%u,%u,%u,%u,%u,%u",
+        queue.enqueued, queue.dropped, queue.sent, queue.writes, outbox.inflight, pool.used, pool.max_used);
+    _mqtt_metrics_publish(service, topic, payload, len);
+}
+
+void mqtt_metrics_net(struct mqtt_service* service, const char* topic, void* context) {
+#if defined(CONFIG_NET_STATISTICS_USER_API)
+    struct net_stats stats;
+    if (net_mgmt(NET_REQUEST_STATS_GET_ALL, NULL, &stats, sizeof(stats)) != 0) {
+        return;
+    }
+
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(payload, sizeof(payload), "%u,%u,%u,%u,%u,%u,%u,%u",
+        stats.ipv4.recv, stats.ipv4.sent, stats.ipv4.drop,
+        stats.tcp.recv, stats.tcp.sent, stats.tcp.drop,
+        stats.bytes.received, stats.bytes.sent);
+    _mqtt_metrics_publish(service, topic, payload, len);
+#endif
+}
+
+void mqtt_metrics_stack(struct mqtt_service* service, const char* topic, void* context) {
+#if defined(CONFIG_THREAD_STACK_INFO) && defined(CONFIG_INIT_STACKS)
+    // Publishers run on the service thread
+    struct k_thread* thread = k_current_get();
+    size_t unused;
+    if (k_thread_stack_space_get(thread, &unused) != 0) {
+        return;
+    }
+
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(payload, sizeof(payload), "%u,%u", thread->stack_info.size, unused);
+    _mqtt_metrics_publish(service, topic, payload, len);
+#endif
+}
+
+struct _mqtt_metrics_thread_list {
+    const struct k_thread* threads[MQTT_METRICS_MAX_THREADS];
+    size_t count;
+};
+
+#if defined(CONFIG_THREAD_MONITOR)
+// Runs with the kernel locked, only collect
+static void _mqtt_metrics_collect_thread(const struct k_thread* thread, void* context) {
+    struct _mqtt_metrics_thread_list* list = context;
+    if (list->count < MQTT_METRICS_MAX_THREADS) {
+        list->threads[list->count++] = thread;
+    }
+}
+#endif
+
+int mqtt_metrics_foreach_thread(mqtt_metrics_thread_cb_t fn, void* context) {
+#if defined(CONFIG_THREAD_MONITOR)
+    struct _mqtt_metrics_thread_list list = { .count = 0 };
+    k_thread_foreach(_mqtt_metrics_collect_thread, &list);
+
+    for (size_t i = 0; i < list.count; i++) {
+        struct k_thread* thread = (struct k_thread*)list.threads[i];
+        struct mqtt_metrics_thread info = {
+            .thread = thread,
+            .stack_size = 0,
+            .stack_used = 0,
+            .cycles = 0,
+        };
+
+        const char* name = k_thread_name_get(thread);
+        if (name != NULL && name[0] != '\0') {
+            snprintf(info.name, sizeof(info.name), "%s", name);
+        } else {
+            snprintf(info.name, sizeof(info.name), "%p", (void*)thread);
+        }
+
+#if defined(CONFIG_THREAD_STACK_INFO) && defined(CONFIG_INIT_STACKS)
+        size_t unused;
+        if (k_thread_stack_space_get(thread, &unused) == 0) {
+            info.stack_size = thread->stack_info.size;
+            info.stack_used = info.stack_size - unused;
+        }
+#endif
+#if defined(CONFIG_THREAD_RUNTIME_STATS)
+        k_thread_runtime_stats_t stats;
+        if (k_thread_runtime_stats_get(thread, &stats) == 0) {
+            info.cycles = stats.execution_cycles;
+        }
+#endif
+        fn(&info, context);
+    }
+    return list.count;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static uint32_t _mqtt_metrics_cycles_to_ms(uint64_t cycles) {
+    return (uint32_t)(cycles * MSEC_PER_SEC / sys_clock_hw_cycles_per_sec());
+}
+
+// Lines of as many threads as fit one message
+struct _mqtt_metrics_thread_publish {
+    struct mqtt_service* service;
+    const char* topic;
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len;
+};
+
+static void _mqtt_metrics_flush_threads(struct _mqtt_metrics_thread_publish* publish) {
+    if (publish->len > 0) {
+        mqtt_service_publish(publish->service, publish->topic, MQTT_QOS_0_AT_MOST_ONCE,
+            publish->payload, publish->len);
+        publish->len = 0;
+    }
+}
+
+static void _mqtt_metrics_publish_thread(const struct mqtt_metrics_thread* info, void* context) {
+    struct _mqtt_metrics_thread_publish* publish = context;
+
+    if (info->stack_size > 0 && info->stack_used * 100 > info->stack_size * MQTT_METRICS_STACK_WARN) {
+        LOG_WRN("Stack of %s %u of %u bytes used", log_strdup(info->name),
+            info->stack_used, info->stack_size);
+    }
+
+    char line[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(line, sizeof(line), "%s,%u,%u,%u\n", info->name,
+        info->stack_size, info->stack_used, _mqtt_metrics_cycles_to_ms(info->cycles));
+    if (len < 0 || len >= sizeof(line)) {
+        return;
+    }
+
+    if (publish->len + len > sizeof(publish->payload)) {
+        _mqtt_metrics_flush_threads(publish);
+    }
+    memcpy(publish->payload + publish->len, line, len);
+    publish->len += len;
+}
+
+void mqtt_metrics_threads(struct mqtt_service* service, const char* topic, void* context) {
+    struct _mqtt_metrics_thread_publish publish = { .service = service, .topic = topic, .len = 0 };
+    mqtt_metrics_foreach_thread(_mqtt_metrics_publish_thread, &publish);
+    _mqtt_metrics_flush_threads(&publish);
+}
+
+void mqtt_metrics_occupancy(struct mqtt_service* service, const char* topic, void* context) {
+    struct mqtt_queue_stats queue;
+    struct mqtt_outbox_stats outbox;
+    struct mqtt_pool_stats pool;
+    struct mqtt_dispatch_stats dispatch;
+
+    mqtt_service_get_queue_stats(service, &queue);
+    mqtt_service_get_outbox_stats(service, &outbox);
+    mqtt_pool_get_stats(&pool);
+    mqtt_service_get_dispatch_stats(service, &dispatch);
+
+    char payload[MQTT_QUEUE_PAYLOAD_LEN];
+    int len = snprintf(payload, sizeof(payload), "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
+        queue.used, queue.max_used, MQTT_QUEUE_SIZE,
+        outbox.inflight, outbox.max_inflight, outbox.window,
+        pool.used, pool.max_used, pool.blocks,
+        dispatch.pending, dispatch.max_pending, MQTT_DISPATCH_DEPTH);
+    _mqtt_metrics_publish(service, topic, payload, len);
+}
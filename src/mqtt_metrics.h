@@ -0,0 +1,64 @@
+#pragma once
+
+#include "mqtt_service.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Ready made publishers for mqtt_service_add_telemetry(), each publishing
+// one line of comma separated values. The context is unused. Publishers
+// whose data is not available in the build publish nothing.
+
+// "seconds"
+void mqtt_metrics_uptime(struct mqtt_service* service, const char* topic, void* context);
+
+// "enqueued,dropped,sent,writes,inflight,pool_used,pool_max_used"
+void mqtt_metrics_queues(struct mqtt_service* service, const char* topic, void* context);
+
+// "ipv4_recv,ipv4_sent,ipv4_drop,tcp_recv,tcp_sent,tcp_drop,bytes_recv,bytes_sent"
+// Requires CONFIG_NET_STATISTICS_USER_API.
+void mqtt_metrics_net(struct mqtt_service* service, const char* topic, void* context);
+
+// "size,unused" in bytes, of the stack of the service thread. Requires
+// CONFIG_THREAD_STACK_INFO and CONFIG_INIT_STACKS.
+void mqtt_metrics_stack(struct mqtt_service* service, const char* topic, void* context);
+
+// A "name,size,used,cpu_ms" line for every thread: stack size and high-water
+// mark in bytes, and CPU time since boot. The lines are packed into as few
+// messages on `topic` as fit, rather than one message per thread. Warns in
+// the log when a stack is more than MQTT_METRICS_STACK_WARN percent used.
+// Requires CONFIG_THREAD_MONITOR, cpu_ms is 0 without
+// CONFIG_THREAD_RUNTIME_STATS.
+void mqtt_metrics_threads(struct mqtt_service* service, const char* topic, void* context);
+
+// "queue_used,queue_max,queue_size,outbox_inflight,outbox_max,outbox_window,
+//  pool_used,pool_max,pool_blocks,dispatch_pending,dispatch_max,dispatch_depth"
+// Current and highest occupancy of the service buffers against their size.
+void mqtt_metrics_occupancy(struct mqtt_service* service, const char* topic, void* context);
+
+#define MQTT_METRICS_STACK_WARN 90
+#define MQTT_METRICS_MAX_THREADS 16
+
+struct mqtt_metrics_thread {
+    const struct k_thread* thread;
+    // Thread name, or its address when unnamed
+    char name[16];
+    // Bytes, used is the high-water mark, 0 when unknown
+    size_t stack_size;
+    size_t stack_used;
+    // Cycles run since boot, 0 without CONFIG_THREAD_RUNTIME_STATS
+    uint64_t cycles;
+};
+
+typedef void (*mqtt_metrics_thread_cb_t)(const struct mqtt_metrics_thread* info, void* context);
+
+// Call `fn` for each thread, up to MQTT_METRICS_MAX_THREADS. The threads are
+// listed under the kernel lock but inspected after it is released, as
+// measuring a stack scans it. Returns the number of threads or -ENOTSUP
+// without CONFIG_THREAD_MONITOR.
+int mqtt_metrics_foreach_thread(mqtt_metrics_thread_cb_t fn, void* context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,74 @@
+#include "mqtt_outbox.h"
+#include "mqtt_latency.h"
+
+#include <string.h>
+
+void mqtt_outbox_init(struct mqtt_outbox* self) {
+    self->count = 0;
+    self->window = MQTT_OUTBOX_SIZE;
+    atomic_set(&self->next_id, 0);
+    self->stats.completed = 0;
+    self->stats.retransmits = 0;
+    self->stats.max_inflight = 0;
+}
+
+uint16_t mqtt_outbox_next_id(struct mqtt_outbox* self) {
+    uint16_t message_id;
+    do {
+        message_id = (uint16_t)(atomic_inc(&self->next_id) + 1);
+    } while (message_id == 0 || mqtt_outbox_find(self, message_id) != NULL);
+    return message_id;
+}
+
+struct mqtt_outbox_entry* mqtt_outbox_add(struct mqtt_outbox* self,
+    const struct mqtt_queue_msg* msg, uint16_t message_id, int64_t now)
+{
+    if (self->count >= MQTT_OUTBOX_SIZE) {
+        return NULL;
+    }
+
+    struct mqtt_outbox_entry* entry = &self->entries[self->count++];
+    self->stats.max_inflight = MAX(self->stats.max_inflight, self->count);
+    entry->message_id = message_id;
+    entry->state = MQTT_OUTBOX_PUBLISHED;
+    entry->sent_at = now;
+    memcpy(&entry->msg, msg, sizeof(entry->msg));
+    entry->msg.timestamp = MQTT_LATENCY_TIMESTAMP();
+    return entry;
+}
+
+struct mqtt_outbox_entry* mqtt_outbox_find(struct mqtt_outbox* self, uint16_t message_id) {
+    for (size_t i = 0; i < self->count; i++) {
+        if (self->entries[i].message_id == message_id) {
+            return &self->entries[i];
+        }
+    }
+    return NULL;
+}
+
+void mqtt_outbox_remove(struct mqtt_outbox* self, struct mqtt_outbox_entry* entry) {
+    size_t index = entry - self->entries;
+    if (index >= self->count) {
+        return;
+    }
+
+    // Keep the entries packed and in order
+    memmove(entry, entry + 1, (self->count - index - 1) * sizeof(*entry));
+    self->count--;
+}
+
+int64_t mqtt_outbox_next_deadline(const struct mqtt_outbox* self) {
+    int64_t deadline = INT64_MAX;
+    for (size_t i = 0; i < self->count; i++) {
+        deadline = MIN(deadline, self->entries[i].sent_at + MQTT_OUTBOX_RETRY_TIMEOUT);
+    }
+    return deadline;
+}
+
+void mqtt_outbox_get_stats(const struct mqtt_outbox* self, struct mqtt_outbox_stats* stats) {
+    stats->inflight = self->count;
+    stats->max_inflight = self->stats.max_inflight;
+    stats->window = self->window;
+    stats->completed = self->stats.completed;
+    stats->retransmits = self->stats.retransmits;
+}
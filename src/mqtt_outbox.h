@@ -0,0 +1,76 @@
+#pragma once
+
+#include <zephyr.h>
+
+#include "mqtt_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_OUTBOX_SIZE CONFIG_MQTT_SERVICE_OUTBOX_SIZE
+#define MQTT_OUTBOX_RETRY_TIMEOUT 10000
+
+enum mqtt_outbox_state {
+    // PUBLISH sent, waiting for PUBACK (QoS 1) or PUBREC (QoS 2)
+    MQTT_OUTBOX_PUBLISHED = 0,
+    // PUBREL sent, waiting for PUBCOMP (QoS 2)
+    MQTT_OUTBOX_RELEASED = 1,
+};
+
+struct mqtt_outbox_entry {
+    uint16_t message_id;
+    enum mqtt_outbox_state state;
+    int64_t sent_at;
+    struct mqtt_queue_msg msg;
+};
+
+struct mqtt_outbox_stats {
+    uint32_t inflight;
+    uint32_t max_inflight;
+    uint32_t window;
+    uint32_t completed;
+    uint32_t retransmits;
+};
+
+// In-flight table of unacknowledged QoS 1/2 messages, kept in the order they
+// were first sent so they can be resent in that same order. Up to `window`
+// messages are in flight at once. Only to be used from the service thread,
+// apart from mqtt_outbox_next_id().
+struct mqtt_outbox {
+    struct mqtt_outbox_entry entries[MQTT_OUTBOX_SIZE];
+    size_t count;
+    size_t window;
+    atomic_t next_id;
+
+    struct {
+        uint32_t completed;
+        uint32_t retransmits;
+        uint32_t max_inflight;
+    } stats;
+};
+
+void mqtt_outbox_init(struct mqtt_outbox* self);
+
+static inline bool mqtt_outbox_full(const struct mqtt_outbox* self) {
+    return self->count >= self->window;
+}
+
+// Sequential packet identifier, skipping 0 and identifiers still in flight
+uint16_t mqtt_outbox_next_id(struct mqtt_outbox* self);
+
+struct mqtt_outbox_entry* mqtt_outbox_add(struct mqtt_outbox* self,
+    const struct mqtt_queue_msg* msg, uint16_t message_id, int64_t now);
+
+struct mqtt_outbox_entry* mqtt_outbox_find(struct mqtt_outbox* self, uint16_t message_id);
+
+void mqtt_outbox_remove(struct mqtt_outbox* self, struct mqtt_outbox_entry* entry);
+
+// Uptime at which the oldest entry is due for retransmission, INT64_MAX if none
+int64_t mqtt_outbox_next_deadline(const struct mqtt_outbox* self);
+
+void mqtt_outbox_get_stats(const struct mqtt_outbox* self, struct mqtt_outbox_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
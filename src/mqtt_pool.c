@@ -0,0 +1,35 @@
+#include "mqtt_pool.h"
+
+K_MEM_SLAB_DEFINE(_mqtt_pool_slab, sizeof(struct mqtt_queue_msg), MQTT_POOL_SIZE, 4);
+
+static atomic_t _mqtt_pool_max_used;
+static atomic_t _mqtt_pool_failures;
+
+struct mqtt_queue_msg* mqtt_pool_alloc(void) {
+    void* block;
+    if (k_mem_slab_alloc(&_mqtt_pool_slab, &block, K_NO_WAIT) != 0) {
+        atomic_inc(&_mqtt_pool_failures);
+        return NULL;
+    }
+
+    atomic_val_t used = k_mem_slab_num_used_get(&_mqtt_pool_slab);
+    atomic_val_t max_used = atomic_get(&_mqtt_pool_max_used);
+    while (used > max_used && !atomic_cas(&_mqtt_pool_max_used, max_used, used)) {
+        max_used = atomic_get(&_mqtt_pool_max_used);
+    }
+
+    return block;
+}
+
+void mqtt_pool_free(struct mqtt_queue_msg* msg) {
+    void* block = msg;
+    k_mem_slab_free(&_mqtt_pool_slab, &block);
+}
+
+void mqtt_pool_get_stats(struct mqtt_pool_stats* stats) {
+    stats->block_size = sizeof(struct mqtt_queue_msg);
+    stats->blocks = MQTT_POOL_SIZE;
+    stats->used = k_mem_slab_num_used_get(&_mqtt_pool_slab);
+    stats->max_used = atomic_get(&_mqtt_pool_max_used);
+    stats->failures = atomic_get(&_mqtt_pool_failures);
+}
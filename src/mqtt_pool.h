@@ -0,0 +1,30 @@
+#pragma once
+
+#include <zephyr.h>
+
+#include "mqtt_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_POOL_SIZE CONFIG_MQTT_SERVICE_MSG_POOL_SIZE
+
+struct mqtt_pool_stats {
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t used;
+    uint32_t max_used;
+    uint32_t failures;
+};
+
+// Fixed-size blocks holding queued messages, shared by all services. Never
+// blocks, safe from ISR context. Returns NULL when the pool is exhausted.
+struct mqtt_queue_msg* mqtt_pool_alloc(void);
+void mqtt_pool_free(struct mqtt_queue_msg* msg);
+
+void mqtt_pool_get_stats(struct mqtt_pool_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
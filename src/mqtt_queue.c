@@ -0,0 +1,109 @@
+#include "mqtt_queue.h"
+#include "mqtt_latency.h"
+#include "mqtt_pool.h"
+
+#include <string.h>
+
+#define MQTT_QUEUE_MASK (MQTT_QUEUE_SIZE - 1)
+
+void mqtt_queue_init(struct mqtt_queue* self) {
+    for (uint32_t i = 0; i < MQTT_QUEUE_SIZE; i++) {
+        atomic_set(&self->slots[i].seq, i);
+    }
+
+    atomic_set(&self->head, 0);
+    self->tail = 0;
+
+    atomic_clear(&self->stats.enqueued);
+    atomic_clear(&self->stats.dropped);
+    atomic_clear(&self->stats.sent);
+    atomic_clear(&self->stats.writes);
+    atomic_clear(&self->stats.max_used);
+}
+
+int mqtt_queue_push(struct mqtt_queue* self, const char* topic, uint8_t qos, uint8_t retain,
+    const void* data, size_t len, mqtt_queue_complete_t complete, void* context)
+{
+    size_t topic_len = strlen(topic);
+    if (topic_len > MQTT_QUEUE_TOPIC_LEN || len > MQTT_QUEUE_PAYLOAD_LEN) {
+        atomic_inc(&self->stats.dropped);
+        return -EMSGSIZE;
+    }
+
+    struct mqtt_queue_msg* msg = mqtt_pool_alloc();
+    if (msg == NULL) {
+        atomic_inc(&self->stats.dropped);
+        return -ENOMEM;
+    }
+
+    msg->complete = complete;
+    msg->context = context;
+    msg->qos = qos;
+    msg->retain = retain;
+    msg->topic_len = topic_len;
+    msg->payload_len = len;
+    msg->timestamp = MQTT_LATENCY_TIMESTAMP();
+    memcpy(msg->topic, topic, topic_len);
+    memcpy(msg->payload, data, len);
+
+    // Claim a slot. A slot is free for position `pos` when its sequence
+    // number equals `pos`; a smaller value means the consumer has not
+    // released it yet and the queue is full.
+    struct mqtt_queue_slot* slot;
+    atomic_val_t pos = atomic_get(&self->head);
+    while (1) {
+        slot = &self->slots[pos & MQTT_QUEUE_MASK];
+        int32_t diff = (int32_t)(atomic_get(&slot->seq) - pos);
+
+        if (diff == 0) {
+            if (atomic_cas(&self->head, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            mqtt_pool_free(msg);
+            atomic_inc(&self->stats.dropped);
+            return -ENOMEM;
+        }
+
+        pos = atomic_get(&self->head);
+    }
+
+    slot->msg = msg;
+
+    // Hand the slot over to the consumer
+    atomic_set(&slot->seq, pos + 1);
+    atomic_inc(&self->stats.enqueued);
+
+    // High-water mark, against a possibly stale tail
+    atomic_val_t used = pos + 1 - (atomic_val_t)self->tail;
+    atomic_val_t max_used = atomic_get(&self->stats.max_used);
+    while (used > max_used && !atomic_cas(&self->stats.max_used, max_used, used)) {
+        max_used = atomic_get(&self->stats.max_used);
+    }
+    return 0;
+}
+
+struct mqtt_queue_msg* mqtt_queue_peek(struct mqtt_queue* self) {
+    struct mqtt_queue_slot* slot = &self->slots[self->tail & MQTT_QUEUE_MASK];
+    if (atomic_get(&slot->seq) != (atomic_val_t)(self->tail + 1)) {
+        return NULL;
+    }
+    return slot->msg;
+}
+
+void mqtt_queue_pop(struct mqtt_queue* self) {
+    struct mqtt_queue_slot* slot = &self->slots[self->tail & MQTT_QUEUE_MASK];
+    mqtt_pool_free(slot->msg);
+    slot->msg = NULL;
+    atomic_set(&slot->seq, self->tail + MQTT_QUEUE_SIZE);
+    self->tail++;
+}
+
+void mqtt_queue_get_stats(struct mqtt_queue* self, struct mqtt_queue_stats* stats) {
+    stats->enqueued = atomic_get(&self->stats.enqueued);
+    stats->dropped = atomic_get(&self->stats.dropped);
+    stats->sent = atomic_get(&self->stats.sent);
+    stats->writes = atomic_get(&self->stats.writes);
+    stats->used = (uint32_t)atomic_get(&self->head) - self->tail;
+    stats->max_used = atomic_get(&self->stats.max_used);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <zephyr.h>
+#include <sys/atomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of slots, must be a power of two.
+#define MQTT_QUEUE_SIZE CONFIG_MQTT_SERVICE_QUEUE_SIZE
+#define MQTT_QUEUE_TOPIC_LEN CONFIG_MQTT_SERVICE_TOPIC_LEN
+#define MQTT_QUEUE_PAYLOAD_LEN CONFIG_MQTT_SERVICE_PAYLOAD_LEN
+
+BUILD_ASSERT((MQTT_QUEUE_SIZE & (MQTT_QUEUE_SIZE - 1)) == 0,
+    "MQTT_QUEUE_SIZE must be a power of two");
+
+struct mqtt_service;
+
+// Completion callback of a QoS 1/2 message, invoked on the service thread with
+// 0 once the broker acknowledged delivery or a negative error when dropped.
+typedef void(*mqtt_queue_complete_t)(struct mqtt_service* service,
+    uint16_t message_id, int result, void* context);
+
+struct mqtt_queue_msg {
+    mqtt_queue_complete_t complete;
+    void* context;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    // Cycle count when enqueued, or first sent once in the outbox
+    uint32_t timestamp;
+    char topic[MQTT_QUEUE_TOPIC_LEN];
+    uint8_t payload[MQTT_QUEUE_PAYLOAD_LEN];
+};
+
+struct mqtt_queue_slot {
+    atomic_t seq;
+    struct mqtt_queue_msg* msg;
+};
+
+struct mqtt_queue_stats {
+    uint32_t enqueued;
+    uint32_t dropped;
+    uint32_t sent;
+    uint32_t writes;
+    // Slots in use now and at most so far
+    uint32_t used;
+    uint32_t max_used;
+};
+
+// Bounded multi-producer/single-consumer queue of outbound messages.
+//
+// Producers claim a slot by advancing `head` with a compare-and-swap and
+// publish it by bumping the slot sequence number, which makes enqueueing
+// safe from any thread or ISR without taking a lock. Only the owning
+// service thread may peek and pop.
+//
+// Slots only reference messages, which live in the shared message pool
+// (mqtt_pool.h) until popped. A queue costs a few bytes per slot, the pool
+// bounds the memory held by all queues together.
+struct mqtt_queue {
+    struct mqtt_queue_slot slots[MQTT_QUEUE_SIZE];
+    atomic_t head;
+    uint32_t tail;
+
+    struct {
+        atomic_t enqueued;
+        atomic_t dropped;
+        atomic_t sent;
+        atomic_t writes;
+        atomic_t max_used;
+    } stats;
+};
+
+void mqtt_queue_init(struct mqtt_queue* self);
+
+int mqtt_queue_push(struct mqtt_queue* self, const char* topic, uint8_t qos, uint8_t retain,
+    const void* data, size_t len, mqtt_queue_complete_t complete, void* context);
+
+struct mqtt_queue_msg* mqtt_queue_peek(struct mqtt_queue* self);
+void mqtt_queue_pop(struct mqtt_queue* self);
+
+void mqtt_queue_get_stats(struct mqtt_queue* self, struct mqtt_queue_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,8 +1,15 @@
 #include "mqtt_service.h"
+#include "mqtt_latency.h"
+#include "mqtt_pool.h"
+#include "readiness.h"
+#include "trace.h"
 
 #include <net/socket.h>
 #include <net/mqtt.h>
 #include <random/rand32.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(mqtt_service, LOG_LEVEL_INF);
@@ -21,43 +28,374 @@ LOG_MODULE_REGISTER(mqtt_service, LOG_LEVEL_INF);
 		} \
 	} while (0)
 
-static int _mqtt_service_discard_payload(struct mqtt_service* self, size_t len) {
+int mqtt_service_read_payload(struct mqtt_service* self, void* buffer, size_t len) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(buffer);
+
+    // The payload was copied off the socket before dispatching
+    if (mqtt_dispatch_in_handler(&self->dispatch)) {
+        return mqtt_dispatch_read_payload(&self->dispatch, buffer, len);
+    }
+
     struct mqtt_client* client = (struct mqtt_client*)&self->client;
 
-    int bytes_read = 0;
+    size_t bytes_read = 0;
     while (bytes_read < len) {
-        uint8_t buffer[32] = {0};
-        size_t remaining = len - bytes_read;
-
-        int ret = mqtt_read_publish_payload(client, buffer, MIN(remaining, sizeof(buffer)));
-        if (ret < 0 && ret != -EAGAIN) {
-            LOG_ERR("mqtt_read_publish_payload: %d", ret);
+        int ret = mqtt_read_publish_payload_blocking(client, (uint8_t*)buffer + bytes_read, len - bytes_read);
+        if (ret < 0) {
+            LOG_ERR("mqtt_read_publish_payload_blocking: %d", ret);
             return ret;
-        } else if(ret == -EAGAIN) {
-            return 0;
         }
 
         bytes_read += ret;
+        self->stream.received += ret;
     }
 
     return 0;
 }
 
-int mqtt_service_read_payload(struct mqtt_service* self, void* buffer, size_t len) {
+static void _mqtt_service_ack_publish(struct mqtt_service* self, uint8_t qos, uint16_t message_id) {
     struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    int err;
 
-    NULL_PARAM_CHECK(self);
-    NULL_PARAM_CHECK(buffer);
+    // Reply to the broker we received the message in good order.
+    if (qos != MQTT_QOS_0_AT_MOST_ONCE) {
+        TRACE(TRACE_MQTT_ACK_OUT, qos, message_id, 0);
+    }
+    switch (qos) {
+        case MQTT_QOS_1_AT_LEAST_ONCE: {
+            const struct mqtt_puback_param param = {
+                .message_id = message_id
+            };
+
+            err = mqtt_publish_qos1_ack(client, &param);
+            if (err != 0) {
+                LOG_ERR("Failed to send PUBACK: %d", err);
+            }
+        } break;
+
+        case MQTT_QOS_2_EXACTLY_ONCE: {
+            const struct mqtt_pubrec_param param = {
+                .message_id = message_id
+            };
+
+            err = mqtt_publish_qos2_receive(client, &param);
+            if (err != 0) {
+                LOG_ERR("Failed to send PUBREC: %d", err);
+            }
+        } break;
+    }
+}
+
+static bool _mqtt_service_store_pending(struct mqtt_service* self) {
+    return self->store.store != NULL && mqtt_store_count(self->store.store) > 0;
+}
+
+static bool _mqtt_service_stream_blocked(struct mqtt_service* self) {
+    return self->stream.active && (self->stream.pending > 0 || self->stream.deferred != NULL);
+}
+
+// The next message could not be dispatched in turn
+static bool _mqtt_service_dispatch_blocked(struct mqtt_service* self) {
+    return mqtt_dispatch_enabled(&self->dispatch) && mqtt_dispatch_full(&self->dispatch);
+}
+
+// Hand the chunk currently held in the chunk buffer to the stream handler.
+static void _mqtt_service_stream_deliver(struct mqtt_service* self) {
+    struct mqtt_service_stream* stream = &self->stream;
+
+    const struct mqtt_topic_chunk chunk = {
+        .data = self->buffer.chunk,
+        .len = stream->pending,
+        .offset = stream->received - stream->pending,
+        .total = stream->total,
+    };
+
+    int rc = stream->handler(self, &stream->topic, &chunk, stream->context);
+    if (rc == -EAGAIN) {
+        // Back pressure, keep the chunk and offer it again on the next pass.
+        // Meanwhile the socket is left unread so TCP flow control kicks in.
+        return;
+    }
+
+    stream->pending = 0;
+    if (rc < 0) {
+        LOG_WRN("Stream handler aborted at %d/%d bytes", chunk.offset, chunk.total);
+        stream->handler = NULL;
+    }
+}
+
+// Run the handler of the deferred message on the service thread, reading
+// its payload straight from the socket
+static void _mqtt_service_handle_deferred(struct mqtt_service* self) {
+    struct mqtt_service_stream* stream = &self->stream;
+    mqtt_service_handler_t handler = stream->deferred;
+
+    stream->deferred = NULL;
+    stream->received = 0;
+    if (handler(self, &stream->topic, stream->total, stream->context) < 0) {
+        // The rest of the payload is skipped by the stream, which then
+        // acknowledges the message
+        LOG_WRN("Discarding %d bytes of payload", stream->total - stream->received);
+        return;
+    }
+
+    stream->active = false;
+    MQTT_LATENCY_RECORD(MQTT_LATENCY_RECEIVE_TO_HANDLED, stream->timestamp);
+    _mqtt_service_ack_publish(self, stream->qos, stream->message_id);
+}
+
+// Hand the deferred message over to the dispatch work queue, along with a
+// copy of its payload. Failing that it is handled right here once nothing of
+// its topic is left on the work queue. Until either happens it stays on the
+// socket, which is not read meanwhile, so the service thread never waits on
+// a handler.
+static void _mqtt_service_dispatch(struct mqtt_service* self) {
+    struct mqtt_service_stream* stream = &self->stream;
+    struct mqtt_dispatch_entry* entry = mqtt_dispatch_alloc(&self->dispatch, &stream->topic, stream->total);
+    if (entry == NULL) {
+        if (mqtt_dispatch_take_turn(&self->dispatch, &stream->topic)) {
+            _mqtt_service_handle_deferred(self);
+        }
+        return;
+    }
+
+    entry->handler = stream->deferred;
+    entry->context = stream->context;
+    entry->message_id = stream->message_id;
+    entry->msg->qos = stream->qos;
+    entry->msg->timestamp = stream->timestamp;
+    stream->deferred = NULL;
+    stream->active = false;
+
+    stream->received = 0;
+    if (mqtt_service_read_payload(self, entry->msg->payload, stream->total) < 0) {
+        // The connection is lost along with the message
+        mqtt_dispatch_cancel(&self->dispatch, entry);
+        return;
+    }
+    mqtt_dispatch_submit(&self->dispatch, entry);
+}
+
+// Move the pending payload of the current message from the socket to its
+// stream handler, or skip it when there is no handler (left). Only reads what
+// is available right now and gives up after a few chunks, so the service loop
+// keeps up with keepalive and outbound traffic during large transfers.
+static int _mqtt_service_stream_process(struct mqtt_service* self) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    struct mqtt_service_stream* stream = &self->stream;
+
+    if (stream->deferred != NULL) {
+        _mqtt_service_dispatch(self);
+        return 0;
+    }
 
-    int ret = mqtt_read_publish_payload_blocking(client, buffer, len);
-    if (ret < 0) {
-        LOG_ERR("mqtt_read_publish_payload_block: %d", ret);
-        return ret;
-    } 
+    if (stream->pending > 0) {
+        _mqtt_service_stream_deliver(self);
+        if (stream->pending > 0) {
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < MQTT_SERVICE_STREAM_BURST && stream->received < stream->total; i++) {
+        size_t len = MIN(stream->total - stream->received, sizeof(self->buffer.chunk));
+        int ret = mqtt_read_publish_payload(client, self->buffer.chunk, len);
+        if (ret == -EAGAIN) {
+            break;
+        } else if (ret < 0) {
+            LOG_ERR("mqtt_read_publish_payload: %d", ret);
+            stream->active = false;
+            return ret;
+        }
+
+        stream->received += ret;
+        if (stream->handler != NULL) {
+            stream->pending = ret;
+            _mqtt_service_stream_deliver(self);
+            if (stream->pending > 0) {
+                return 0;
+            }
+        }
+    }
+
+    if (stream->received == stream->total) {
+        stream->active = false;
+        if (stream->handler != NULL) {
+            MQTT_LATENCY_RECORD(MQTT_LATENCY_RECEIVE_TO_HANDLED, stream->timestamp);
+        }
+        _mqtt_service_ack_publish(self, stream->qos, stream->message_id);
+    }
 
     return 0;
 }
 
+// Acknowledge the messages whose handler returned on the dispatch work queue
+static void _mqtt_service_dispatch_acks(struct mqtt_service* self) {
+    struct mqtt_dispatch_entry* entry;
+
+    while ((entry = mqtt_dispatch_next_done(&self->dispatch)) != NULL) {
+        if (self->state == MQTT_SERVICE_CONNECTED && entry->generation == self->dispatch.generation) {
+            _mqtt_service_ack_publish(self, entry->msg->qos, entry->message_id);
+        }
+        mqtt_dispatch_release(&self->dispatch, entry);
+    }
+}
+
+static void _mqtt_service_stream_begin(struct mqtt_service* self,
+    const struct mqtt_publish_param* publish, const struct mqtt_utf8* topic,
+    mqtt_service_stream_handler_t handler, void* context,
+    size_t received)
+{
+    struct mqtt_service_stream* stream = &self->stream;
+
+    stream->active = true;
+    stream->handler = handler;
+    stream->deferred = NULL;
+    stream->context = context;
+    stream->topic = *topic;
+    stream->qos = publish->message.topic.qos;
+    stream->message_id = publish->message_id;
+    stream->total = publish->message.payload.len;
+    stream->received = received;
+    stream->pending = 0;
+    stream->timestamp = MQTT_LATENCY_TIMESTAMP();
+
+    // Zero length messages still get their (single, empty) chunk
+    if (handler != NULL && stream->total == 0) {
+        _mqtt_service_stream_deliver(self);
+    }
+}
+
+// Map a command sent to "<prefix>/cmd/<n>" onto the full topic of alias n
+static bool _mqtt_service_resolve_alias(struct mqtt_service* self,
+    const struct mqtt_utf8* topic, struct mqtt_utf8* resolved)
+{
+    if (self->aliases.prefix == NULL) {
+        return false;
+    }
+
+    // Match the filter up to its trailing '+'
+    size_t prefix_len = strlen(self->aliases.filter) - 1;
+    if (topic->size <= prefix_len || memcmp(topic->utf8, self->aliases.filter, prefix_len) != 0) {
+        return false;
+    }
+
+    size_t alias = 0;
+    for (size_t i = prefix_len; i < topic->size; i++) {
+        if (topic->utf8[i] < '0' || topic->utf8[i] > '9' || alias > self->aliases.count) {
+            return false;
+        }
+        alias = alias * 10 + (topic->utf8[i] - '0');
+    }
+
+    if (alias == 0 || alias > self->aliases.count) {
+        return false;
+    }
+
+    resolved->utf8 = (const uint8_t*)self->aliases.topics[alias - 1];
+    resolved->size = strlen(self->aliases.topics[alias - 1]);
+    return true;
+}
+
+static void _mqtt_service_outbox_complete(struct mqtt_service* self, uint16_t message_id) {
+    struct mqtt_outbox_entry* entry = mqtt_outbox_find(&self->outbox, message_id);
+    if (entry == NULL) {
+        LOG_WRN("Acknowledgement for unknown packet id: %u", message_id);
+        return;
+    }
+
+    mqtt_queue_complete_t complete = entry->msg.complete;
+    void* context = entry->msg.context;
+    MQTT_LATENCY_RECORD(MQTT_LATENCY_PUBLISH_TO_ACK, entry->msg.timestamp);
+
+    mqtt_outbox_remove(&self->outbox, entry);
+    self->outbox.stats.completed++;
+
+    if (complete != NULL) {
+        complete(self, message_id, 0, context);
+    }
+
+    // A slot in the send window opened up
+    mqtt_service_wakeup(self);
+}
+
+static struct mqtt_service_subscription* _mqtt_service_find_subscription(struct mqtt_service* self,
+    const char* topic)
+{
+    for (size_t i = 0; i < self->subscriptions.count; i++) {
+        if (strcmp(self->subscriptions.list[i].topic, topic) == 0) {
+            return &self->subscriptions.list[i];
+        }
+    }
+    return NULL;
+}
+
+static void _mqtt_service_remove_subscription(struct mqtt_service* self, struct mqtt_service_subscription* sub) {
+    size_t index = sub - self->subscriptions.list;
+    memmove(sub, sub + 1, (self->subscriptions.count - index - 1) * sizeof(*sub));
+    self->subscriptions.count--;
+}
+
+// Subscribed once the broker answered every subscription request, refused
+// ones included.
+static void _mqtt_service_update_subscribed(struct mqtt_service* self) {
+    bool outstanding = false;
+
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    for (size_t i = 0; i < self->subscriptions.count && !outstanding; i++) {
+        enum mqtt_service_subscription_state state = self->subscriptions.list[i].state;
+        outstanding = state == MQTT_SERVICE_SUBSCRIPTION_PENDING || state == MQTT_SERVICE_SUBSCRIPTION_REQUESTED;
+    }
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    if (outstanding) {
+        readiness_clear(READINESS_MQTT_SUBSCRIBED);
+    } else {
+        readiness_set(READINESS_MQTT_SUBSCRIBED);
+    }
+}
+
+// Apply the return codes of a SUBACK, in the order the topics were sent
+static void _mqtt_service_suback(struct mqtt_service* self, const struct mqtt_suback_param* suback) {
+    struct {
+        const char* topic;
+        int result;
+    } results[MQTT_SERVICE_MAX_SUBSCRIPTIONS];
+    size_t count = 0;
+
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    for (size_t i = 0; i < self->subscriptions.count; i++) {
+        struct mqtt_service_subscription* sub = &self->subscriptions.list[i];
+        if (sub->state != MQTT_SERVICE_SUBSCRIPTION_REQUESTED || sub->message_id != suback->message_id) {
+            continue;
+        }
+
+        uint8_t code = count < suback->return_codes.len ? suback->return_codes.data[count] : MQTT_SUBACK_FAILURE;
+        if (code == MQTT_SUBACK_FAILURE) {
+            LOG_WRN("Subscription refused: %s", log_strdup(sub->topic));
+            sub->state = MQTT_SERVICE_SUBSCRIPTION_FAILED;
+            results[count].result = -EACCES;
+        } else {
+            sub->state = MQTT_SERVICE_SUBSCRIPTION_ACTIVE;
+            results[count].result = code;
+        }
+        results[count++].topic = sub->topic;
+    }
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    // Outside of the lock, the callback may subscribe again
+    for (size_t i = 0; self->subscriptions.callback != NULL && i < count; i++) {
+        self->subscriptions.callback(self, results[i].topic, results[i].result, self->subscriptions.context);
+    }
+
+    _mqtt_service_update_subscribed(self);
+}
+
+static void _mqtt_service_set_state(struct mqtt_service* self, enum mqtt_service_state state) {
+    TRACE(TRACE_MQTT_STATE, state, self->connection.attempt, 0);
+    self->state = state;
+}
+
 static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct mqtt_evt *evt)
 {
     struct mqtt_service* self = ((struct mqtt_service_client*)client)->context;
@@ -66,18 +404,36 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 
     switch (evt->type) {
     case MQTT_EVT_CONNACK:
+        TRACE(TRACE_MQTT_CONNACK, evt->param.connack.session_present_flag, 0, evt->result);
         if (evt->result != 0) {
             LOG_ERR("MQTT connect failed %d", evt->result);
             break;
         }
 
-        self->state = MQTT_SERVICE_CONNECTED;
-        LOG_INF("Connected!");
+        _mqtt_service_set_state(self, MQTT_SERVICE_CONNECTED);
+        self->session.present = evt->param.connack.session_present_flag;
+        self->session.restore = true;
+        LOG_INF("Connected! (session present: %d)", self->session.present);
         break;
 
     case MQTT_EVT_DISCONNECT:
+        TRACE(TRACE_MQTT_DISCONNECT, 0, 0, evt->result);
         LOG_INF("Disconnected: %d", evt->result);
-        self->state = MQTT_SERVICE_DISCONNECTED;
+        bool was_connected = self->state == MQTT_SERVICE_CONNECTED;
+        if (was_connected) {
+            // Spread the reconnects of a fleet losing the same broker
+            self->connection.retry_at = k_uptime_get() + sys_rand32_get() % MQTT_SERVICE_BACKOFF_MIN;
+        }
+        _mqtt_service_set_state(self, MQTT_SERVICE_DISCONNECTED);
+        self->stream.active = false;
+        mqtt_dispatch_disconnected(&self->dispatch);
+
+        if (was_connected) {
+            readiness_clear(READINESS_MQTT_CONNECTED | READINESS_MQTT_SUBSCRIBED);
+        }
+        if (was_connected && self->state_callback != NULL) {
+            self->state_callback(self, MQTT_SERVICE_DISCONNECTED, self->state_context);
+        }
         break;
 
     case MQTT_EVT_PUBLISH:
@@ -86,50 +442,63 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			break;
 		}
 
-        // Parse topic in to string buffer
-        char topic[MQTT_MAX_TOPIC_LEN];
-        size_t topic_len = MIN(evt->param.publish.message.topic.topic.size, MQTT_MAX_TOPIC_LEN);
-        if (evt->param.publish.message.topic.topic.size > MQTT_MAX_TOPIC_LEN) {
-            LOG_WRN("Truncating %d bytes from the topic", evt->param.publish.message.topic.topic.size - topic_len);
-        }
-        strncpy(topic, evt->param.publish.message.topic.topic.utf8, topic_len);
-        topic[topic_len] = '\0';
-		LOG_DBG("PUBLISH on topic: %s", log_strdup(topic));
+        uint32_t received_at = MQTT_LATENCY_TIMESTAMP();
+        const struct mqtt_utf8* topic = &evt->param.publish.message.topic.topic;
+        TRACE(TRACE_MQTT_PUBLISH_IN, evt->param.publish.message.topic.qos, evt->param.publish.message_id,
+            (uint32_t)trace_hash(topic->utf8, topic->size) << 16 | MIN(evt->param.publish.message.payload.len, 0xFFFF));
 
-        // Invoke callback handler to read and parse the message payload
-        size_t payload_len = evt->param.publish.message.payload.len;
-        if (self->callback == NULL || self->callback(self, topic, payload_len) < 0) {
-            // The callback is either not set or did not return successfully. Discard the pending data in order
-            // to prevent the process handler for going mental on the remaining bytes in the buffer.
-            // It has cost me at least a f*$&ng day to figure this one out...
-            LOG_WRN("Discarding %d bytes of payload", payload_len);
-            _mqtt_service_discard_payload(self, payload_len);
+        struct mqtt_utf8 resolved;
+        if (_mqtt_service_resolve_alias(self, topic, &resolved)) {
+            topic = &resolved;
         }
 
-        // Reply to the broker we received the message in good order.
-        switch (evt->param.publish.message.topic.qos) {
-            case MQTT_QOS_1_AT_LEAST_ONCE: {
-                const struct mqtt_puback_param param = {
-                    .message_id = evt->param.publish.message_id
-                };
+        // Look up the most specific handler for the topic, falling back on
+        // the default callback when no filter matches.
+        mqtt_service_handler_t handler = self->callback;
+        mqtt_service_stream_handler_t stream = NULL;
+        void* context = NULL;
+
+        k_mutex_lock(&self->handlers.lock, K_FOREVER);
+        const struct mqtt_topic_trie_node* node = mqtt_topic_trie_match(
+            &self->handlers.trie, topic->utf8, topic->size);
+        if (node != NULL) {
+            handler = node->handler;
+            stream = node->stream;
+            context = node->context;
+        }
+        k_mutex_unlock(&self->handlers.lock);
 
-                err = mqtt_publish_qos1_ack(client, &param);
-                if (err != 0) {
-                    LOG_ERR("Failed to send PUBACK: %d", err);
-                }
-            } break;
+        // Stream handlers are fed from the service loop, the PUBACK/PUBREC
+        // is sent once the whole payload has been consumed.
+        if (stream != NULL) {
+            _mqtt_service_stream_begin(self, &evt->param.publish, topic, stream, context, 0);
+            break;
+        }
 
-            case MQTT_QOS_2_EXACTLY_ONCE: {
-                const struct mqtt_pubrec_param param = {
-                    .message_id = evt->param.publish.message_id
-                };
+        // The acknowledgement follows once the handler returned
+        if (handler != NULL && mqtt_dispatch_enabled(&self->dispatch)) {
+            _mqtt_service_stream_begin(self, &evt->param.publish, topic, NULL, context, 0);
+            self->stream.deferred = handler;
+            self->stream.timestamp = received_at;
+            _mqtt_service_dispatch(self);
+            break;
+        }
 
-                err = mqtt_publish_qos2_receive(client, &param);
-                if (err != 0) {
-                    LOG_ERR("Failed to send PUBREC: %d", err);
-                }
-            } break;
+        // Invoke handler to read and parse the message payload
+        size_t payload_len = evt->param.publish.message.payload.len;
+        self->stream.received = 0;
+        if (handler == NULL || handler(self, topic, payload_len, context) < 0) {
+            // The handler is either not set or did not return successfully. Discard the pending data in order
+            // to prevent the process handler for going mental on the remaining bytes in the buffer.
+            // It has cost me at least a f*$&ng day to figure this one out...
+            LOG_WRN("Discarding %d bytes of payload", payload_len - self->stream.received);
+            _mqtt_service_stream_begin(self, &evt->param.publish, topic, NULL, NULL, self->stream.received);
+            break;
         }
+
+        MQTT_LATENCY_RECORD(MQTT_LATENCY_RECEIVE_TO_HANDLED, received_at);
+        _mqtt_service_ack_publish(self, evt->param.publish.message.topic.qos,
+            evt->param.publish.message_id);
         break;
 
     case MQTT_EVT_PUBACK:
@@ -138,7 +507,8 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			break;
 		}
 
-		LOG_DBG("PUBACK packet id: %u", evt->param.puback.message_id);
+		TRACE(TRACE_MQTT_PUBACK, 0, evt->param.puback.message_id, 0);
+        _mqtt_service_outbox_complete(self, evt->param.puback.message_id);
 		break;
 
     case MQTT_EVT_PUBREC: {
@@ -146,7 +516,13 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			LOG_ERR("PUBREC error %d", evt->result);
 			break;
 		}
-		LOG_DBG("PUBREC packet id: %u", evt->param.pubrec.message_id);
+		TRACE(TRACE_MQTT_PUBREC, 0, evt->param.pubrec.message_id, 0);
+
+        struct mqtt_outbox_entry* entry = mqtt_outbox_find(&self->outbox, evt->param.pubrec.message_id);
+        if (entry != NULL) {
+            entry->state = MQTT_OUTBOX_RELEASED;
+            entry->sent_at = k_uptime_get();
+        }
 
 		const struct mqtt_pubrel_param param = {
 			.message_id = evt->param.pubrec.message_id
@@ -163,7 +539,7 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			LOG_ERR("PUBREL error %d", evt->result);
 			break;
 		}
-		LOG_DBG("PUBREL packet id: %u", evt->param.pubrel.message_id);
+		TRACE(TRACE_MQTT_PUBREL, 0, evt->param.pubrel.message_id, 0);
         
 		const struct mqtt_pubcomp_param param = {
 			.message_id = evt->param.pubrel.message_id
@@ -181,7 +557,8 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			break;
 		}
 
-		LOG_DBG("PUBCOMP packet id: %u", evt->param.pubcomp.message_id);
+		TRACE(TRACE_MQTT_PUBCOMP, 0, evt->param.pubcomp.message_id, 0);
+        _mqtt_service_outbox_complete(self, evt->param.pubcomp.message_id);
 		break;
 
     case MQTT_EVT_SUBACK:
@@ -189,7 +566,8 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			LOG_ERR("SUBACK error %d", evt->result);
 			break;
 		}
-		LOG_DBG("SUBACK packet id: %u", evt->param.suback.message_id);
+		TRACE(TRACE_MQTT_SUBACK, 0, evt->param.suback.message_id, 0);
+        _mqtt_service_suback(self, &evt->param.suback);
         break;
 
     case MQTT_EVT_UNSUBACK:
@@ -197,11 +575,11 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 			LOG_ERR("UNSUBACK error %d", evt->result);
 			break;
 		}
-		LOG_DBG("UNSUBACK packet id: %u", evt->param.unsuback.message_id);
+		TRACE(TRACE_MQTT_UNSUBACK, 0, evt->param.unsuback.message_id, 0);
         break;
 
 	case MQTT_EVT_PINGRESP:
-		LOG_DBG("PINGRESP packet");
+		TRACE(TRACE_MQTT_PINGRESP, 0, 0, evt->result);
 		break;
 
 	default:
@@ -209,204 +587,1443 @@ static void _mqtt_service_evt_handler(struct mqtt_client *client, const struct m
 	}
 }
 
-static int _mqtt_service_wait(struct mqtt_service *self, int timeout) {
-    struct mqtt_client* client = (struct mqtt_client*)&self->client;
-    struct pollfd fds[1];
+static void _mqtt_service_group_wakeup_write(struct mqtt_service_group* self) {
+    uint8_t token = 0;
+    if (zsock_send(self->wakeup.fds[1], &token, sizeof(token), ZSOCK_MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+        LOG_ERR("wakeup send: %d", errno);
+    }
+}
 
-    fds[0].fd = client->transport.tcp.sock;
-    fds[0].events = ZSOCK_POLLIN;
+static void _mqtt_service_group_wakeup_work(struct k_work* work) {
+    struct mqtt_service_group* self = CONTAINER_OF(work, struct mqtt_service_group, wakeup.work);
+    _mqtt_service_group_wakeup_write(self);
+}
 
-    int ret = zsock_poll(fds, 1, timeout);
-    if (ret < 0) {
-        LOG_ERR("poll error: %d", errno);
-    }
+// Consume the pending wakeup tokens, then clear the pending flag. A wakeup
+// that raced the drain either left its token in the socket or finds the flag
+// cleared and writes a new one, and the flag is cleared before the service
+// loop looks at its work again, so no wakeup can get lost. Clearing first
+// would let a token written in between be drained with the flag left set,
+// silencing every later wakeup.
+static void _mqtt_service_group_wakeup_clear(struct mqtt_service_group* self) {
+    uint8_t tokens[8];
 
-    if (fds[0].revents & ZSOCK_POLLHUP) {
-        LOG_WRN("poll HUP event");
+    while (zsock_recv(self->wakeup.fds[0], tokens, sizeof(tokens), ZSOCK_MSG_DONTWAIT) > 0) {
     }
+    atomic_clear(&self->wakeup.pending);
+}
 
-	return ret;
+static int _mqtt_service_time_until(int64_t deadline) {
+    int64_t remaining = deadline - k_uptime_get();
+    return remaining <= 0 ? 0 : (int)MIN(remaining, INT_MAX);
 }
 
-static int _mqtt_service_connect(struct mqtt_service* self, int attempts) {
+// Time in milliseconds until the client has work to do on its own
+static int _mqtt_service_next_timeout(struct mqtt_service* self) {
     struct mqtt_client* client = (struct mqtt_client*)&self->client;
-    int rc, attempt = 0;
 
-    while (attempt++ < attempts && self->state != MQTT_SERVICE_CONNECTED) {
-        LOG_INF("Connecting to broker... (%d/%d)", attempt, attempts);
-        rc = mqtt_connect(client);
-        if (rc != 0) {
-            LOG_ERR("mqtt_connect: %d", rc);
-            k_sleep(K_MSEC(1000));
-            continue;
+    switch (self->state) {
+        case MQTT_SERVICE_DISCONNECTED:
+            // Woken by the readiness listener once the network is up
+            if (!readiness_test(self->connection.ready_events)) {
+                return SYS_FOREVER_MS;
+            }
+            return _mqtt_service_time_until(self->connection.retry_at);
+
+        case MQTT_SERVICE_CONNECTING:
+            return _mqtt_service_time_until(self->connection.deadline);
+
+        default:
+            break;
+    }
+
+    if (_mqtt_service_stream_blocked(self)) {
+        return MQTT_SERVICE_STREAM_RETRY_INTERVAL;
+    }
+
+    int timeout = SYS_FOREVER_MS;
+    uint32_t keepalive = mqtt_keepalive_time_left(client);
+    if (keepalive <= INT_MAX) {
+        timeout = keepalive;
+    }
+
+    if (_mqtt_service_store_pending(self)) {
+        int drain_timeout = _mqtt_service_time_until(self->store.next_drain);
+        if (timeout == SYS_FOREVER_MS || drain_timeout < timeout) {
+            timeout = drain_timeout;
         }
+    }
 
-        if (_mqtt_service_wait(self, 5000)) {
-            rc = mqtt_input(client);
-            if (rc != 0) {
-                LOG_ERR("mqtt_input: %d", rc);
-            }
+    int64_t telemetry = mqtt_telemetry_next_deadline(&self->telemetry);
+    if (telemetry != INT64_MAX) {
+        int telemetry_timeout = _mqtt_service_time_until(telemetry);
+        if (timeout == SYS_FOREVER_MS || telemetry_timeout < timeout) {
+            timeout = telemetry_timeout;
         }
+    }
 
-        if (self->state != MQTT_SERVICE_CONNECTED) {
-            LOG_WRN("Failed to connect");
-			mqtt_abort(client);
-		} else {
-            return 0;
+    int64_t release = mqtt_cache_next_release(&self->cache);
+    if (release != INT64_MAX) {
+        int release_timeout = _mqtt_service_time_until(release);
+        if (timeout == SYS_FOREVER_MS || release_timeout < timeout) {
+            timeout = release_timeout;
+        }
+    }
+
+    int64_t retransmit = mqtt_outbox_next_deadline(&self->outbox);
+    if (retransmit != INT64_MAX) {
+        int retransmit_timeout = _mqtt_service_time_until(retransmit);
+        if (timeout == SYS_FOREVER_MS || retransmit_timeout < timeout) {
+            timeout = retransmit_timeout;
         }
     }
 
-    return -1;
+    return timeout;
+}
+
+// Exponential backoff with jitter: wait a random time between half and the
+// full backoff interval, which doubles on every failed attempt.
+static void _mqtt_service_schedule_retry(struct mqtt_service* self) {
+    uint32_t backoff = MQTT_SERVICE_BACKOFF_MIN << MIN(self->connection.attempt, 16);
+    backoff = MIN(backoff, MQTT_SERVICE_BACKOFF_MAX);
+    self->connection.attempt++;
+
+    uint32_t delay = backoff / 2 + sys_rand32_get() % (backoff / 2 + 1);
+    LOG_INF("Retrying in %d ms...", delay);
+    self->connection.retry_at = k_uptime_get() + delay;
 }
 
-static int _mqtt_service_process(struct mqtt_service* self) {
+static void _mqtt_service_connect(struct mqtt_service* self) {
     struct mqtt_client* client = (struct mqtt_client*)&self->client;
-    int rc = 0;
 
-    if (_mqtt_service_wait(self, 1000) != 0) {
-        rc = mqtt_input(client);
-        if (rc != 0) {
-            LOG_ERR("mqtt_input: %d", rc);
-        }
-    } else {
-        rc = mqtt_live(client);
-        if (rc != 0 && rc != -EAGAIN) {
-            LOG_ERR("mqtt_live: %d", rc);
-        }
+    LOG_INF("Connecting to broker... (attempt %d)", self->connection.attempt + 1);
+    int rc = mqtt_connect(client);
+    if (rc != 0) {
+        LOG_ERR("mqtt_connect: %d", rc);
+        _mqtt_service_schedule_retry(self);
+        return;
     }
 
-    return rc;
+    // Wait for the CONNACK from the service loop
+    _mqtt_service_set_state(self, MQTT_SERVICE_CONNECTING);
+    self->connection.deadline = k_uptime_get() + MQTT_SERVICE_CONNACK_TIMEOUT;
 }
 
-static void _mqtt_service_task(void* context, void* b __unused, void* c __unused) {
-    struct mqtt_service* self = (struct mqtt_service*)(context);
-
-    while(1) {
-        switch (self->state) {
-            case MQTT_SERVICE_DISCONNECTED:
-                // Connect to MQTT broker
-                if (_mqtt_service_connect(self, 5) != 0) {
-                    LOG_ERR("Unable to connect");
-                    LOG_INF("Retrying in 30 sec...");
-                    k_sleep(K_SECONDS(30));
-                }
-                break;
-            
-            case MQTT_SERVICE_CONNECTED:
-                // Process MQTT communication
-                _mqtt_service_process(self);
-                break;
-
-            default: return;
+// Topic to send `msg` on: "<prefix>/<n>" when the topic has alias n, using
+// `buf` for the alias topic.
+static const char* _mqtt_service_publish_topic(struct mqtt_service* self,
+    const struct mqtt_queue_msg* msg, char* buf, size_t size, size_t* len)
+{
+    for (size_t i = 0; self->aliases.prefix != NULL && i < self->aliases.count; i++) {
+        const char* topic = self->aliases.topics[i];
+        if (strncmp(topic, msg->topic, msg->topic_len) == 0 && topic[msg->topic_len] == '\0') {
+            *len = snprintf(buf, size, "%s/%u", self->aliases.prefix, i + 1);
+            return buf;
         }
     }
+
+    *len = msg->topic_len;
+    return msg->topic;
 }
 
-void mqtt_service_init(struct mqtt_service* self,
-    const char* client_id,
-    const char* broker_addr, uint16_t broker_port,
-    mqtt_service_callback_t callback)
+static int _mqtt_service_encode_publish(struct mqtt_service* self, uint8_t* buf, size_t size,
+    const struct mqtt_queue_msg* msg, uint16_t message_id, bool dup)
 {
-    NULL_PARAM_CHECK_VOID(self);
-    NULL_PARAM_CHECK_VOID(client_id);
-    NULL_PARAM_CHECK_VOID(broker_addr);
+    char alias[MQTT_QUEUE_TOPIC_LEN + 1];
+    size_t topic_len;
+    const char* topic = _mqtt_service_publish_topic(self, msg, alias, sizeof(alias), &topic_len);
 
-    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    size_t remaining = 2 + topic_len + msg->payload_len;
+    if (msg->qos > MQTT_QOS_0_AT_MOST_ONCE) {
+        remaining += 2;
+    }
 
-    // MQTT service configuration
-    self->state = MQTT_SERVICE_DISCONNECTED;
-    self->callback = callback;
-    self->client.context = self;
+    // Fixed header: packet type and flags followed by the variable length
+    // encoded remaining length (at most 4 bytes).
+    uint8_t header[5];
+    size_t header_len = 0;
+    header[header_len++] = 0x30 | (dup ? 0x08 : 0) | ((msg->qos & 0x03) << 1) | (msg->retain ? 1 : 0);
+    do {
+        uint8_t byte = remaining % 128;
+        remaining /= 128;
+        header[header_len++] = byte | (remaining > 0 ? 0x80 : 0);
+    } while (remaining > 0 && header_len < sizeof(header));
+
+    size_t total = header_len + 2 + topic_len + msg->payload_len;
+    if (msg->qos > MQTT_QOS_0_AT_MOST_ONCE) {
+        total += 2;
+    }
+    if (total > size) {
+        return -ENOMEM;
+    }
 
-    // MQTT broker configuration
-    struct sockaddr_in *broker4 = (struct sockaddr_in *)&self->broker;
-    broker4->sin_family = AF_INET;
-    broker4->sin_port = htons(broker_port);
-    inet_pton(AF_INET, broker_addr, &broker4->sin_addr);
+    uint8_t* p = buf;
+    memcpy(p, header, header_len);
+    p += header_len;
+    *p++ = topic_len >> 8;
+    *p++ = topic_len & 0xFF;
+    memcpy(p, topic, topic_len);
+    p += topic_len;
+    if (msg->qos > MQTT_QOS_0_AT_MOST_ONCE) {
+        *p++ = message_id >> 8;
+        *p++ = message_id & 0xFF;
+    }
+    memcpy(p, msg->payload, msg->payload_len);
 
-    // MQTT client configuration
-    mqtt_client_init(client);
-    client->broker = &self->broker;
-    client->evt_cb = _mqtt_service_evt_handler;
-    client->client_id.utf8 = (uint8_t*)client_id;
-    client->client_id.size = strlen(client_id);
-    client->password = NULL;
-    client->user_name = NULL;
-    client->protocol_version = MQTT_VERSION_3_1_1;
-    client->transport.type = MQTT_TRANSPORT_NON_SECURE;
+    TRACE(TRACE_MQTT_PUBLISH_OUT, msg->qos | (dup ? 0x80 : 0), message_id,
+        (uint32_t)trace_hash(msg->topic, msg->topic_len) << 16 | msg->payload_len);
+    return total;
+}
 
-    // MQTT buffers configuration
-    client->rx_buf = self->buffer.rx;
-    client->rx_buf_size = sizeof(self->buffer.rx);
-    client->tx_buf = self->buffer.tx;
-    client->tx_buf_size = sizeof(self->buffer.tx); 
+static int _mqtt_service_send(struct mqtt_service* self, const uint8_t* data, size_t len) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+
+    while (len > 0) {
+        ssize_t ret = zsock_send(client->transport.tcp.sock, data, len, 0);
+        if (ret < 0) {
+            LOG_ERR("send: %d", errno);
+            return -errno;
+        }
+        data += ret;
+        len -= ret;
+    }
+
+    return 0;
 }
 
-void mqtt_service_start(struct mqtt_service* self) {
-    NULL_PARAM_CHECK_VOID(self);
+static int _mqtt_service_send_batch(struct mqtt_service* self, size_t used) {
+    k_mutex_lock(&self->lock, K_FOREVER);
+    int rc = _mqtt_service_send(self, self->buffer.batch, used);
+    k_mutex_unlock(&self->lock);
 
-    self->thread.id = k_thread_create(&self->thread.data,
-        self->thread.stack, K_THREAD_STACK_SIZEOF(self->thread.stack),
-        _mqtt_service_task, self, NULL, NULL,
-        MQTT_SERVICE_PRIO, 0, K_NO_WAIT);
-    k_thread_name_set(self->thread.id, "mqtt_service");
+    if (rc == 0) {
+        atomic_inc(&self->queue.stats.writes);
+    }
+    return rc;
 }
 
-int mqtt_service_subscribe(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len) {
-    NULL_PARAM_CHECK(self);
-    NULL_PARAM_CHECK(topic);
+// Append a PUBLISH of `msg` to the batch buffer. QoS 1/2 messages are moved
+// to the outbox until acknowledged. Returns the number of bytes added, 0 when
+// the batch buffer or the send window is full, or a negative error when the
+// message had to be dropped.
+static int _mqtt_service_batch_add(struct mqtt_service* self, const struct mqtt_queue_msg* msg, size_t* used) {
+    bool acked = msg->qos > MQTT_QOS_0_AT_MOST_ONCE;
+    if (acked && mqtt_outbox_full(&self->outbox)) {
+        return 0;
+    }
 
-    int rc = 0;
-    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    uint16_t message_id = acked ? mqtt_outbox_next_id(&self->outbox) : 0;
+    int len = _mqtt_service_encode_publish(self, self->buffer.batch + *used,
+        sizeof(self->buffer.batch) - *used, msg, message_id, false);
+    if (len < 0) {
+        if (*used > 0) {
+            return 0;
+        }
 
-    if (data != NULL) {
-        rc = mqtt_service_publish(self, topic, MQTT_QOS_0_AT_MOST_ONCE, data, len);
-        if (rc != 0) {
-            return rc;
+        // Does not even fit an empty batch buffer
+        LOG_ERR("Dropping %d byte message on topic of %d bytes",
+            msg->payload_len, msg->topic_len);
+        atomic_inc(&self->queue.stats.dropped);
+        if (acked && msg->complete != NULL) {
+            msg->complete(self, message_id, -EMSGSIZE, msg->context);
         }
+        return -EMSGSIZE;
     }
 
-    struct mqtt_topic topics[] = {
-        { .topic = { .utf8 = (const uint8_t*)topic, .size = strlen(topic) }, .qos = qos },
-    };
+    if (acked) {
+        mqtt_outbox_add(&self->outbox, msg, message_id, k_uptime_get());
+    }
 
-    struct mqtt_subscription_list subscriptions = {
-        .list = topics,
-        .list_count = 1,
-        .message_id = sys_rand32_get()
-    };
+    *used += len;
+    return len;
+}
 
-    rc = mqtt_subscribe(client, &subscriptions);
+// Send a filled batch buffer holding `count` messages, of which `unacked` are
+// QoS 0. Messages in the outbox are replayed after reconnecting when sending
+// fails, the QoS 0 ones are lost.
+static int _mqtt_service_send_messages(struct mqtt_service* self, size_t used, uint32_t count, uint32_t unacked) {
+    int rc = _mqtt_service_send_batch(self, used);
     if (rc != 0) {
-        LOG_ERR("mqtt_subscribe: %d", rc);
+        atomic_add(&self->queue.stats.dropped, unacked);
         return rc;
     }
 
+    atomic_add(&self->queue.stats.sent, count);
     return 0;
 }
 
-int mqtt_service_publish(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len) {
-    NULL_PARAM_CHECK(self);
-    NULL_PARAM_CHECK(topic);
-    NULL_PARAM_CHECK(data);
+// Notify the publisher of a QoS 1/2 message suppressed by its publish policy
+static void _mqtt_service_cancel(struct mqtt_service* self, const struct mqtt_queue_msg* msg) {
+    if (msg->qos > MQTT_QOS_0_AT_MOST_ONCE && msg->complete != NULL) {
+        msg->complete(self, 0, -ECANCELED, msg->context);
+    }
+}
+
+static void _mqtt_service_free_held(struct mqtt_cache_entry* entry) {
+    mqtt_pool_free(entry->held);
+    entry->held = NULL;
+}
+
+// Next message to send: a held back value that is due, or else the next
+// queued message its publish policy lets through. Suppressed messages are
+// dropped or held back on the way. `entry` is set to the cache entry of the
+// topic, if any.
+static struct mqtt_queue_msg* _mqtt_service_next(struct mqtt_service* self, int64_t now,
+    struct mqtt_cache_entry** entry)
+{
+    struct mqtt_queue_msg* msg;
+
+    while ((*entry = mqtt_cache_next_due(&self->cache, now)) != NULL) {
+        if (!mqtt_cache_unchanged(*entry, (*entry)->held)) {
+            return (*entry)->held;
+        }
+
+        // Bounced back to the value last sent
+        self->cache.stats.suppressed++;
+        _mqtt_service_cancel(self, (*entry)->held);
+        _mqtt_service_free_held(*entry);
+    }
+
+    while ((msg = mqtt_queue_peek(&self->queue)) != NULL) {
+        *entry = mqtt_cache_find(&self->cache, msg->topic, msg->topic_len);
+        if (*entry == NULL) {
+            return msg;
+        }
+
+        switch (mqtt_cache_check(*entry, msg, now)) {
+            case MQTT_CACHE_PASS:
+                return msg;
+
+            case MQTT_CACHE_DROP:
+                self->cache.stats.suppressed++;
+                _mqtt_service_cancel(self, msg);
+                break;
+
+            case MQTT_CACHE_HOLD:
+                if ((*entry)->held == NULL) {
+                    (*entry)->held = mqtt_pool_alloc();
+                    if ((*entry)->held == NULL) {
+                        // No room to hold it back, rather send it now
+                        return msg;
+                    }
+                } else {
+                    self->cache.stats.coalesced++;
+                    _mqtt_service_cancel(self, (*entry)->held);
+                }
+                memcpy((*entry)->held, msg, sizeof(*msg));
+                break;
+        }
+
+        mqtt_queue_pop(&self->queue);
+    }
+
+    return NULL;
+}
+
+// Release a message returned by _mqtt_service_next(), `sent` when it has
+// been sent or stored.
+static void _mqtt_service_consume(struct mqtt_service* self, struct mqtt_queue_msg* msg,
+    struct mqtt_cache_entry* entry, bool sent, int64_t now)
+{
+    if (entry != NULL && sent) {
+        mqtt_cache_sent(entry, msg, now);
+    }
+
+    if (entry != NULL && msg == entry->held) {
+        _mqtt_service_free_held(entry);
+    } else {
+        mqtt_queue_pop(&self->queue);
+    }
+}
+
+// Drain the outbound queue, packing as many PUBLISH packets as fit into the
+// batch buffer before handing them to the socket in a single write. Draining
+// stops while the send window is full.
+static int _mqtt_service_flush(struct mqtt_service* self) {
+    struct mqtt_cache_entry* entry;
+    struct mqtt_queue_msg* msg;
+    int64_t now = k_uptime_get();
+
+    while (1) {
+        size_t used = 0;
+        uint32_t count = 0;
+        uint32_t unacked = 0;
+
+        while ((msg = _mqtt_service_next(self, now, &entry)) != NULL) {
+            int len = _mqtt_service_batch_add(self, msg, &used);
+            if (len == 0) {
+                break;
+            } else if (len > 0) {
+                count++;
+                unacked += msg->qos == MQTT_QOS_0_AT_MOST_ONCE;
+                // Taken as the message is packed, right ahead of the write
+                MQTT_LATENCY_RECORD(MQTT_LATENCY_ENQUEUE_TO_SEND, msg->timestamp);
+            }
+
+            _mqtt_service_consume(self, msg, entry, len > 0, now);
+        }
+
+        if (used == 0) {
+            break;
+        }
+
+        int rc = _mqtt_service_send_messages(self, used, count, unacked);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+// Notify the publisher of a QoS 1/2 message that leaves the send path
+static void _mqtt_service_complete(struct mqtt_service* self, const struct mqtt_queue_msg* msg, int result) {
+    if (msg->qos > MQTT_QOS_0_AT_MOST_ONCE && msg->complete != NULL) {
+        msg->complete(self, 0, result, msg->context);
+    }
+}
+
+// While offline, or while older messages are still waiting in the store,
+// queued messages are appended to the store so they go out in order.
+static void _mqtt_service_spool(struct mqtt_service* self) {
+    struct mqtt_store* store = self->store.store;
+    struct mqtt_cache_entry* entry;
+    struct mqtt_queue_msg* msg;
+    int64_t now = k_uptime_get();
+
+    while ((msg = _mqtt_service_next(self, now, &entry)) != NULL) {
+        // The oldest message is about to be evicted, its callback with it
+        struct mqtt_queue_msg oldest;
+        if (!store->persistent && mqtt_store_count(store) >= store->capacity &&
+            mqtt_store_peek(store, &oldest) == 0) {
+            _mqtt_service_complete(self, &oldest, -ENOBUFS);
+        }
+
+        int rc = mqtt_store_append(store, msg);
+        if (rc != 0) {
+            atomic_inc(&self->queue.stats.dropped);
+            _mqtt_service_complete(self, msg, rc);
+        } else if (store->persistent) {
+            _mqtt_service_complete(self, msg, -EINPROGRESS);
+        }
+        _mqtt_service_consume(self, msg, entry, rc == 0, now);
+    }
+}
+
+// Forward a batch of stored messages, at most MQTT_STORE_DRAIN_BATCH per
+// MQTT_STORE_DRAIN_INTERVAL so a long backlog does not flood the broker.
+struct _mqtt_service_drain {
+    struct mqtt_service* service;
+    size_t used;
+    uint32_t unacked;
+};
+
+// Add a stored message to the batch, stops the drain once it is full
+static int _mqtt_service_drain_msg(const struct mqtt_queue_msg* msg, void* context) {
+    struct _mqtt_service_drain* drain = context;
+
+    int len = _mqtt_service_batch_add(drain->service, msg, &drain->used);
+    if (len == 0) {
+        return -EAGAIN;
+    } else if (len < 0) {
+        return len;
+    }
+
+    drain->unacked += msg->qos == MQTT_QOS_0_AT_MOST_ONCE;
+    return 0;
+}
 
+static int _mqtt_service_drain_store(struct mqtt_service* self) {
+    struct mqtt_store* store = self->store.store;
+    struct _mqtt_service_drain drain = { .service = self, .used = 0, .unacked = 0 };
+
+    int64_t now = k_uptime_get();
+    if (now < self->store.next_drain) {
+        return 0;
+    }
+    self->store.next_drain = now + MQTT_STORE_DRAIN_INTERVAL;
+
+    uint32_t discarded = store->discarded;
+    size_t count = mqtt_store_drain(store, MQTT_STORE_DRAIN_BATCH, _mqtt_service_drain_msg, &drain);
+    atomic_add(&self->queue.stats.dropped, store->discarded - discarded);
+
+    if (drain.used == 0) {
+        return 0;
+    }
+
+    if (mqtt_store_count(store) == 0) {
+        LOG_INF("Store drained");
+    }
+    return _mqtt_service_send_messages(self, drain.used, count, drain.unacked);
+}
+
+// Resend the in-flight messages last sent at or before `before`, in the
+// order they were originally sent.
+static int _mqtt_service_resend(struct mqtt_service* self, int64_t before) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    struct mqtt_outbox* outbox = &self->outbox;
+    int64_t now = k_uptime_get();
+    size_t used = 0;
+    int rc;
+
+    for (size_t i = 0; i < outbox->count;) {
+        struct mqtt_outbox_entry* entry = &outbox->entries[i];
+
+        if (entry->sent_at > before) {
+            i++;
+            continue;
+        }
+
+        if (entry->state == MQTT_OUTBOX_RELEASED) {
+            // The PUBRELs go out directly, write the PUBLISHes batched ahead
+            // of them first to keep the original order
+            if (used > 0) {
+                rc = _mqtt_service_send_batch(self, used);
+                if (rc != 0) {
+                    return rc;
+                }
+                used = 0;
+            }
+
+            const struct mqtt_pubrel_param param = {
+                .message_id = entry->message_id
+            };
+            rc = mqtt_publish_qos2_release(client, &param);
+            if (rc != 0) {
+                LOG_ERR("Failed to send PUBREL: %d", rc);
+                return rc;
+            }
+        } else {
+            int len = _mqtt_service_encode_publish(self, self->buffer.batch + used,
+                sizeof(self->buffer.batch) - used, &entry->msg, entry->message_id, true);
+            if (len < 0 && used > 0) {
+                rc = _mqtt_service_send_batch(self, used);
+                if (rc != 0) {
+                    return rc;
+                }
+                used = 0;
+                continue;
+            }
+            if (len < 0) {
+                // Does not even fit an empty batch buffer, it would hold its
+                // window slot forever
+                LOG_ERR("Dropping unsendable message %u: %d", entry->message_id, len);
+                mqtt_queue_complete_t complete = entry->msg.complete;
+                void* context = entry->msg.context;
+                uint16_t message_id = entry->message_id;
+                mqtt_outbox_remove(outbox, entry);
+                if (complete != NULL) {
+                    complete(self, message_id, -EMSGSIZE, context);
+                }
+                continue;
+            }
+            used += len;
+        }
+
+        entry->sent_at = now;
+        outbox->stats.retransmits++;
+        i++;
+    }
+
+    if (used > 0) {
+        return _mqtt_service_send_batch(self, used);
+    }
+    return 0;
+}
+
+// Send a single SUBSCRIBE, or UNSUBSCRIBE for `state` REMOVED, carrying as
+// many of the subscriptions in `state` as fit the tx buffer. Returns the
+// number of topics sent.
+static int _mqtt_service_send_subscriptions(struct mqtt_service* self,
+    enum mqtt_service_subscription_state state)
+{
     struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    struct mqtt_topic topics[MQTT_SERVICE_MAX_SUBSCRIPTIONS];
+    bool unsubscribe = state == MQTT_SERVICE_SUBSCRIPTION_REMOVED;
+
+    struct mqtt_subscription_list subscriptions = {
+        .list = topics,
+        .list_count = 0,
+        .message_id = mqtt_outbox_next_id(&self->outbox)
+    };
+
+    // Fixed header with the longest remaining length, and the packet identifier
+    size_t size = 5 + 2;
+
+    // Held while sending so the table does not change under the packet, only
+    // the service thread sends.
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    for (size_t i = 0; i < self->subscriptions.count; i++) {
+        struct mqtt_service_subscription* sub = &self->subscriptions.list[i];
+        if (sub->state != state) {
+            continue;
+        }
+
+        // Length prefixed topic, followed by the requested QoS
+        size_t topic_len = strlen(sub->topic);
+        size_t topic_size = 2 + topic_len + (unsubscribe ? 0 : 1);
+        if (5 + 2 + topic_size > MQTT_SERVICE_TX_BUFFER_SIZE) {
+            LOG_ERR("Topic too long to %s: %s", unsubscribe ? "unsubscribe" : "subscribe", log_strdup(sub->topic));
+            if (unsubscribe) {
+                // Never subscribed either, forgotten along with the topics
+                // sent below rather than restored as a failed subscription
+                sub->message_id = subscriptions.message_id;
+                continue;
+            }
+            if (self->subscriptions.callback != NULL) {
+                self->subscriptions.callback(self, sub->topic, -EMSGSIZE, self->subscriptions.context);
+            }
+            sub->state = MQTT_SERVICE_SUBSCRIPTION_FAILED;
+            continue;
+        }
+        if (size + topic_size > MQTT_SERVICE_TX_BUFFER_SIZE) {
+            continue;
+        }
+
+        topics[subscriptions.list_count].topic.utf8 = (const uint8_t*)sub->topic;
+        topics[subscriptions.list_count].topic.size = topic_len;
+        topics[subscriptions.list_count].qos = sub->qos;
+        subscriptions.list_count++;
+        size += topic_size;
+
+        sub->message_id = subscriptions.message_id;
+        sub->state = unsubscribe ? MQTT_SERVICE_SUBSCRIPTION_REMOVED : MQTT_SERVICE_SUBSCRIPTION_REQUESTED;
+    }
+
+    int rc = 0;
+    if (subscriptions.list_count > 0) {
+        rc = unsubscribe ? mqtt_unsubscribe(client, &subscriptions) : mqtt_subscribe(client, &subscriptions);
+        if (rc != 0) {
+            LOG_ERR("%s: %d", unsubscribe ? "mqtt_unsubscribe" : "mqtt_subscribe", rc);
+        }
+    }
+
+    for (size_t i = 0; i < self->subscriptions.count;) {
+        struct mqtt_service_subscription* sub = &self->subscriptions.list[i];
+        if (sub->message_id != subscriptions.message_id || sub->state != (unsubscribe ?
+            MQTT_SERVICE_SUBSCRIPTION_REMOVED : MQTT_SERVICE_SUBSCRIPTION_REQUESTED)) {
+            i++;
+        } else if (rc != 0) {
+            // Sent again on the next connection
+            sub->state = state;
+            i++;
+        } else if (unsubscribe) {
+            // Forgotten right away, the UNSUBACK carries no result
+            _mqtt_service_remove_subscription(self, sub);
+        } else {
+            i++;
+        }
+    }
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    return rc == 0 ? subscriptions.list_count : rc;
+}
+
+// Send the pending subscriptions, then the pending unsubscriptions
+static void _mqtt_service_sync_subscriptions(struct mqtt_service* self) {
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    bool changed = self->subscriptions.changed;
+    self->subscriptions.changed = false;
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    if (!changed) {
+        return;
+    }
+
+    int sent;
+    do {
+        sent = _mqtt_service_send_subscriptions(self, MQTT_SERVICE_SUBSCRIPTION_PENDING);
+    } while (sent > 0);
+
+    do {
+        sent = _mqtt_service_send_subscriptions(self, MQTT_SERVICE_SUBSCRIPTION_REMOVED);
+    } while (sent > 0);
+
+    _mqtt_service_update_subscribed(self);
+}
+
+// Publish the alias map, retained, ahead of any aliased message. The broker
+// handles the packets of a connection in order, so QoS 0 suffices: the map
+// is in place before the first aliased message and is sent again on every
+// connection.
+static int _mqtt_service_announce_aliases(struct mqtt_service* self) {
+    struct mqtt_queue_msg msg = {
+        .qos = MQTT_QOS_0_AT_MOST_ONCE,
+        .retain = 1U,
+    };
+    size_t used = 0;
+
+    for (size_t i = 0; self->aliases.prefix != NULL && i < self->aliases.count; i++) {
+        msg.topic_len = snprintf(msg.topic, sizeof(msg.topic), "%s/map/%u", self->aliases.prefix, i + 1);
+        msg.payload_len = strlen(self->aliases.topics[i]);
+        memcpy(msg.payload, self->aliases.topics[i], msg.payload_len);
+
+        int len = _mqtt_service_encode_publish(self, self->buffer.batch + used,
+            sizeof(self->buffer.batch) - used, &msg, 0, false);
+        if (len < 0 && used > 0) {
+            int rc = _mqtt_service_send_batch(self, used);
+            if (rc != 0) {
+                return rc;
+            }
+            used = 0;
+            i--;
+            continue;
+        }
+        used += MAX(len, 0);
+    }
+
+    if (used > 0) {
+        return _mqtt_service_send_batch(self, used);
+    }
+    return 0;
+}
+
+// Restore the session state once the broker accepted the connection
+static void _mqtt_service_restore_session(struct mqtt_service* self) {
+    bool session_present = self->session.present;
+    self->session.restore = false;
+
+    _mqtt_service_announce_aliases(self);
+
+    // The broker may have lost the retained values meanwhile, send the next
+    // value of every topic regardless of its publish policy.
+    mqtt_cache_invalidate(&self->cache);
+
+    // Subscriptions unanswered on the last connection are requested again,
+    // without a session all of them are.
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    for (size_t i = 0; i < self->subscriptions.count;) {
+        struct mqtt_service_subscription* sub = &self->subscriptions.list[i];
+        if (sub->state == MQTT_SERVICE_SUBSCRIPTION_REMOVED && !session_present) {
+            _mqtt_service_remove_subscription(self, sub);
+            continue;
+        }
+        if (sub->state == MQTT_SERVICE_SUBSCRIPTION_REQUESTED || sub->state == MQTT_SERVICE_SUBSCRIPTION_FAILED ||
+            (sub->state == MQTT_SERVICE_SUBSCRIPTION_ACTIVE && !session_present)) {
+            sub->state = MQTT_SERVICE_SUBSCRIPTION_PENDING;
+        }
+        i++;
+    }
+    self->subscriptions.changed = true;
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    // Without a session the broker no longer knows about the QoS 2 messages
+    // it already received, there is nothing left to release.
+    struct mqtt_outbox* outbox = &self->outbox;
+    for (size_t i = 0; !session_present && i < outbox->count;) {
+        struct mqtt_outbox_entry* entry = &outbox->entries[i];
+        if (entry->state == MQTT_OUTBOX_RELEASED) {
+            _mqtt_service_outbox_complete(self, entry->message_id);
+        } else {
+            i++;
+        }
+    }
+
+    if (outbox->count > 0) {
+        LOG_INF("Replaying %d unacknowledged messages", outbox->count);
+        _mqtt_service_resend(self, INT64_MAX);
+    }
+
+    _mqtt_service_sync_subscriptions(self);
+
+    readiness_set(READINESS_MQTT_CONNECTED);
+    if (self->state_callback != NULL) {
+        self->state_callback(self, MQTT_SERVICE_CONNECTED, self->state_context);
+    }
+}
+
+static int _mqtt_service_input(struct mqtt_service* self, bool readable) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    int rc = 0;
+
+    if (self->stream.active) {
+        // The library refuses new input until the payload has been read
+        rc = _mqtt_service_stream_process(self);
+    } else if (readable) {
+        rc = mqtt_input(client);
+        if (rc != 0) {
+            LOG_ERR("mqtt_input: %d", rc);
+        }
+    }
+
+    return rc;
+}
+
+// Attempts made before the network came up say nothing about the broker,
+// start over without backoff once it does.
+static bool _mqtt_service_network_ready(struct mqtt_service* self) {
+    bool ready = readiness_test(self->connection.ready_events);
+    if (ready && !self->connection.ready) {
+        self->connection.attempt = 0;
+        self->connection.retry_at = 0;
+    }
+    self->connection.ready = ready;
+    return ready;
+}
+
+// Advance the connection state of a client after its socket has been polled
+static void _mqtt_service_step(struct mqtt_service* self, bool readable) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+    int rc;
+
+    switch (self->state) {
+        case MQTT_SERVICE_DISCONNECTED:
+            if (!_mqtt_service_network_ready(self)) {
+                break;
+            }
+            if (k_uptime_get() >= self->connection.retry_at) {
+                _mqtt_service_connect(self);
+            }
+            break;
+
+        case MQTT_SERVICE_CONNECTING:
+            rc = _mqtt_service_input(self, readable);
+            if (self->state == MQTT_SERVICE_CONNECTED) {
+                self->connection.attempt = 0;
+            } else if (rc != 0 || k_uptime_get() >= self->connection.deadline) {
+                LOG_WRN("Failed to connect");
+                mqtt_abort(client);
+                _mqtt_service_set_state(self, MQTT_SERVICE_DISCONNECTED);
+                _mqtt_service_schedule_retry(self);
+            }
+            break;
+
+        case MQTT_SERVICE_CONNECTED:
+            _mqtt_service_input(self, readable);
+            break;
+    }
+}
+
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+// Telemetry publisher of the latency summaries, one topic per stage
+static void _mqtt_service_publish_latency(struct mqtt_service* self, const char* prefix, void* context) {
+    for (int stage = 0; stage < MQTT_LATENCY_STAGE_COUNT; stage++) {
+        struct mqtt_latency_summary summary;
+        char topic[MQTT_QUEUE_TOPIC_LEN + 1];
+        char payload[MQTT_QUEUE_PAYLOAD_LEN];
+
+        mqtt_latency_summary(stage, &summary);
+        snprintf(topic, sizeof(topic), "%s/latency/%s", prefix, mqtt_latency_stage_name(stage));
+        int len = snprintf(payload, sizeof(payload), "%u,%u,%u,%u,%u,%u",
+            summary.count, summary.min, summary.p50, summary.p90, summary.p99, summary.max);
+
+        mqtt_queue_push(&self->queue, topic, MQTT_QOS_0_AT_MOST_ONCE, 0U,
+            payload, MIN(len, sizeof(payload) - 1), NULL, NULL);
+    }
+}
+#endif
+
+// Send what has been queued for the client, including messages forwarded by
+// the handlers of other clients in the same group during this pass.
+static void _mqtt_service_flush_and_live(struct mqtt_service* self) {
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+
+    // Ahead of the flush, acknowledgements never wait behind publishes
+    _mqtt_service_dispatch_acks(self);
+
+    if (self->store.store != NULL &&
+        (self->state != MQTT_SERVICE_CONNECTED || _mqtt_service_store_pending(self))) {
+        _mqtt_service_spool(self);
+    }
+
+    if (self->state != MQTT_SERVICE_CONNECTED) {
+        return;
+    }
+
+    // All publishers due go out together with the next flush
+    mqtt_telemetry_run(&self->telemetry, self, k_uptime_get());
+
+    if (self->session.restore) {
+        _mqtt_service_restore_session(self);
+    }
+
+    _mqtt_service_sync_subscriptions(self);
+
+    if (mqtt_outbox_next_deadline(&self->outbox) <= k_uptime_get()) {
+        _mqtt_service_resend(self, k_uptime_get() - MQTT_OUTBOX_RETRY_TIMEOUT);
+    }
+
+    if (_mqtt_service_store_pending(self)) {
+        if (_mqtt_service_drain_store(self) != 0) {
+            return;
+        }
+    } else if (_mqtt_service_flush(self) != 0) {
+        return;
+    }
+
+    int rc = mqtt_live(client);
+    if (rc != 0 && rc != -EAGAIN) {
+        LOG_ERR("mqtt_live: %d", rc);
+    }
+}
+
+static void _mqtt_service_group_task(void* context, void* b __unused, void* c __unused) {
+    struct mqtt_service_group* self = (struct mqtt_service_group*)(context);
+    struct mqtt_service* services[MQTT_SERVICE_GROUP_MAX];
+    struct pollfd fds[MQTT_SERVICE_GROUP_MAX + 1];
+    int fd_index[MQTT_SERVICE_GROUP_MAX];
+
+    while (1) {
+        k_mutex_lock(&self->lock, K_FOREVER);
+        size_t count = self->count;
+        memcpy(services, self->services, count * sizeof(services[0]));
+        k_mutex_unlock(&self->lock);
+
+        // One poll over the wakeup channel and all connected clients, timing
+        // out at the earliest deadline of any of them.
+        int timeout = SYS_FOREVER_MS;
+        size_t nfds = 1;
+        fds[0].fd = self->wakeup.fds[0];
+        fds[0].events = ZSOCK_POLLIN;
+
+        for (size_t i = 0; i < count; i++) {
+            struct mqtt_service* service = services[i];
+            int service_timeout = _mqtt_service_next_timeout(service);
+            if (service_timeout != SYS_FOREVER_MS && (timeout == SYS_FOREVER_MS || service_timeout < timeout)) {
+                timeout = service_timeout;
+            }
+
+            fd_index[i] = -1;
+            if (service->state != MQTT_SERVICE_DISCONNECTED) {
+                fd_index[i] = nfds;
+                fds[nfds].fd = service->client.client.transport.tcp.sock;
+                // Stop reading while a stream handler applies back pressure or
+                // every dispatch entry is taken, TCP flow control takes over
+                bool blocked = _mqtt_service_stream_blocked(service) || _mqtt_service_dispatch_blocked(service);
+                fds[nfds].events = blocked ? 0 : ZSOCK_POLLIN;
+                nfds++;
+            }
+        }
+
+        int ret = zsock_poll(fds, nfds, timeout);
+        if (ret < 0) {
+            LOG_ERR("poll error: %d", errno);
+            k_sleep(K_MSEC(MQTT_SERVICE_RETRY_INTERVAL));
+            continue;
+        }
+
+        if (fds[0].revents & ZSOCK_POLLIN) {
+            _mqtt_service_group_wakeup_clear(self);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            bool readable = false;
+            if (fd_index[i] >= 0) {
+                short revents = fds[fd_index[i]].revents;
+                if (revents & ZSOCK_POLLHUP) {
+                    LOG_WRN("poll HUP event");
+                }
+                readable = (revents & (ZSOCK_POLLIN | ZSOCK_POLLHUP | ZSOCK_POLLERR)) != 0;
+            }
+            _mqtt_service_step(services[i], readable);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            _mqtt_service_flush_and_live(services[i]);
+        }
+    }
+}
+
+void mqtt_service_group_init(struct mqtt_service_group* self) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->count = 0;
+    self->thread.id = NULL;
+    k_mutex_init(&self->lock);
+
+    // Wakeup channel for the service loop
+    atomic_clear(&self->wakeup.pending);
+    k_work_init(&self->wakeup.work, _mqtt_service_group_wakeup_work);
+    if (zsock_socketpair(AF_UNIX, SOCK_STREAM, 0, self->wakeup.fds) != 0) {
+        LOG_ERR("socketpair: %d", errno);
+    }
+}
+
+int mqtt_service_group_add(struct mqtt_service_group* self, struct mqtt_service* service) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(service);
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    if (self->count >= MQTT_SERVICE_GROUP_MAX) {
+        k_mutex_unlock(&self->lock);
+        LOG_ERR("Service group is full");
+        return -ENOMEM;
+    }
+
+    service->group = self;
+    self->services[self->count++] = service;
+    k_mutex_unlock(&self->lock);
+
+    mqtt_service_group_wakeup(self);
+    return 0;
+}
 
-	struct mqtt_publish_param param;
-	param.message.topic.qos = qos;
-	param.message.topic.topic.utf8 = (const uint8_t*)topic;
-	param.message.topic.topic.size = strlen(topic);
-	param.message.payload.data = data;
-	param.message.payload.len = len;
-	param.message_id = sys_rand32_get();
-	param.dup_flag = 0U;
-	param.retain_flag = 1U;
-
-	int rc = mqtt_publish(client, &param);
+void mqtt_service_group_start(struct mqtt_service_group* self, const char* name) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->thread.id = k_thread_create(&self->thread.data,
+        self->thread.stack, K_THREAD_STACK_SIZEOF(self->thread.stack),
+        _mqtt_service_group_task, self, NULL, NULL,
+        MQTT_SERVICE_PRIO, 0, K_NO_WAIT);
+    k_thread_name_set(self->thread.id, name ? name : "mqtt_service");
+}
+
+void mqtt_service_group_wakeup(struct mqtt_service_group* self) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    // Work queued from the group thread itself is picked up at the end of
+    // the current pass, no need to wake it. An interrupt taken while the
+    // group thread runs may come after that pass's flush, so it always
+    // wakes it.
+    if (!k_is_in_isr() && self->thread.id != NULL && k_current_get() == self->thread.id) {
+        return;
+    }
+
+    // Only the first wakeup since the service loop last woke up writes a
+    // token, the socket is not available from ISR context so defer that
+    // write to the system work queue.
+    if (!atomic_cas(&self->wakeup.pending, 0, 1)) {
+        return;
+    }
+
+    if (k_is_in_isr()) {
+        k_work_submit(&self->wakeup.work);
+    } else {
+        _mqtt_service_group_wakeup_write(self);
+    }
+}
+
+void mqtt_service_init(struct mqtt_service* self,
+    const char* client_id,
+    const char* broker_addr, uint16_t broker_port,
+    mqtt_service_callback_t callback)
+{
+    NULL_PARAM_CHECK_VOID(self);
+    NULL_PARAM_CHECK_VOID(client_id);
+    NULL_PARAM_CHECK_VOID(broker_addr);
+
+    struct mqtt_client* client = (struct mqtt_client*)&self->client;
+
+    // MQTT service configuration
+    self->state = MQTT_SERVICE_DISCONNECTED;
+    self->callback = callback;
+    self->state_callback = NULL;
+    self->state_context = NULL;
+    self->client.context = self;
+    mqtt_queue_init(&self->queue);
+    k_mutex_init(&self->lock);
+    mqtt_topic_trie_init(&self->handlers.trie);
+    k_mutex_init(&self->handlers.lock);
+    self->stream.active = false;
+    self->group = NULL;
+    self->connection.attempt = 0;
+    self->connection.retry_at = 0;
+    self->connection.ready_events = 0;
+    self->connection.ready = false;
+    mqtt_outbox_init(&self->outbox);
+    self->subscriptions.count = 0;
+    self->subscriptions.changed = false;
+    self->subscriptions.callback = NULL;
+    self->subscriptions.context = NULL;
+    k_mutex_init(&self->subscriptions.lock);
+    self->store.store = NULL;
+    self->store.next_drain = 0;
+    self->session.restore = false;
+    mqtt_telemetry_init(&self->telemetry, k_uptime_get());
+    self->aliases.prefix = NULL;
+    self->aliases.count = 0;
+    mqtt_cache_init(&self->cache);
+    mqtt_dispatch_init(&self->dispatch, self);
+
+    // MQTT broker configuration
+    struct sockaddr_in *broker4 = (struct sockaddr_in *)&self->broker;
+    broker4->sin_family = AF_INET;
+    broker4->sin_port = htons(broker_port);
+    inet_pton(AF_INET, broker_addr, &broker4->sin_addr);
+
+    // MQTT client configuration
+    mqtt_client_init(client);
+    client->broker = &self->broker;
+    client->evt_cb = _mqtt_service_evt_handler;
+    client->client_id.utf8 = (uint8_t*)client_id;
+    client->client_id.size = strlen(client_id);
+    client->clean_session = 1U;
+    client->password = NULL;
+    client->user_name = NULL;
+    client->protocol_version = MQTT_VERSION_3_1_1;
+    client->transport.type = MQTT_TRANSPORT_NON_SECURE;
+
+    // MQTT buffers configuration
+    client->rx_buf = self->buffer.rx;
+    client->rx_buf_size = sizeof(self->buffer.rx);
+    client->tx_buf = self->buffer.tx;
+    client->tx_buf_size = sizeof(self->buffer.tx); 
+}
+
+// Services started on their own share this group and its thread
+static struct mqtt_service_group _mqtt_service_default_group;
+
+void mqtt_service_start(struct mqtt_service* self) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    struct mqtt_service_group* group = &_mqtt_service_default_group;
+    bool start = group->thread.id == NULL;
+
+    if (start) {
+        mqtt_service_group_init(group);
+    }
+
+    mqtt_service_group_add(group, self);
+
+    if (start) {
+        mqtt_service_group_start(group, "mqtt_service");
+    }
+}
+
+int mqtt_service_register_handler(struct mqtt_service* self, const char* topic_filter,
+    mqtt_service_handler_t handler, void* context)
+{
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic_filter);
+
+    // The trie references the filter segments, the filter string must
+    // outlive the registration.
+    k_mutex_lock(&self->handlers.lock, K_FOREVER);
+    int rc = mqtt_topic_trie_insert(&self->handlers.trie, topic_filter, handler, context);
+    k_mutex_unlock(&self->handlers.lock);
+
+    if (rc != 0) {
+        LOG_ERR("Unable to register handler for %s: %d", log_strdup(topic_filter), rc);
+    }
+    return rc;
+}
+
+int mqtt_service_register_stream_handler(struct mqtt_service* self, const char* topic_filter,
+    mqtt_service_stream_handler_t handler, void* context)
+{
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic_filter);
+
+    k_mutex_lock(&self->handlers.lock, K_FOREVER);
+    int rc = mqtt_topic_trie_insert_stream(&self->handlers.trie, topic_filter, handler, context);
+    k_mutex_unlock(&self->handlers.lock);
+
+    if (rc != 0) {
+        LOG_ERR("Unable to register stream handler for %s: %d", log_strdup(topic_filter), rc);
+    }
+    return rc;
+}
+
+int mqtt_service_set_alias_prefix(struct mqtt_service* self, const char* prefix) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(prefix);
+
+    // Leave room for "/map/<n>" in the alias map topics
+    size_t len = snprintf(self->aliases.filter, sizeof(self->aliases.filter), "%s/cmd/+", prefix);
+    if (len + 2 > sizeof(self->aliases.filter)) {
+        LOG_ERR("Alias prefix too long: %s", log_strdup(prefix));
+        return -EINVAL;
+    }
+
+    self->aliases.prefix = prefix;
+    return mqtt_service_subscribe(self, self->aliases.filter, MQTT_QOS_2_EXACTLY_ONCE, NULL, 0);
+}
+
+int mqtt_service_add_topic_alias(struct mqtt_service* self, const char* topic) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic);
+
+    for (size_t i = 0; i < self->aliases.count; i++) {
+        if (strcmp(self->aliases.topics[i], topic) == 0) {
+            return i + 1;
+        }
+    }
+
+    if (self->aliases.count >= MQTT_SERVICE_MAX_ALIASES || strlen(topic) > MQTT_QUEUE_PAYLOAD_LEN) {
+        LOG_ERR("Unable to add topic alias for %s", log_strdup(topic));
+        return -ENOMEM;
+    }
+
+    self->aliases.topics[self->aliases.count++] = topic;
+    return self->aliases.count;
+}
+
+void mqtt_service_set_state_callback(struct mqtt_service* self,
+    mqtt_service_state_callback_t callback, void* context)
+{
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->state_callback = callback;
+    self->state_context = context;
+}
+
+enum mqtt_service_state mqtt_service_get_state(struct mqtt_service* self) {
+    return self != NULL ? self->state : MQTT_SERVICE_DISCONNECTED;
+}
+
+static void _mqtt_service_readiness_changed(uint32_t events, void* context) {
+    mqtt_service_wakeup(context);
+}
+
+int mqtt_service_set_ready_events(struct mqtt_service* self, uint32_t events) {
+    NULL_PARAM_CHECK(self);
+
+    if (self->connection.ready_events == 0 && events != 0) {
+        int rc = readiness_add_listener(_mqtt_service_readiness_changed, self);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    self->connection.ready_events = events;
+    return 0;
+}
+
+void mqtt_service_set_clean_session(struct mqtt_service* self, bool clean_session) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->client.client.clean_session = clean_session ? 1U : 0U;
+}
+
+int mqtt_service_subscribe(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic);
+
+    if (data != NULL) {
+        int rc = mqtt_service_publish(self, topic, MQTT_QOS_0_AT_MOST_ONCE, data, len);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    struct mqtt_service_topic subscription = { .topic = topic, .qos = qos };
+    return mqtt_service_subscribe_batch(self, &subscription, 1);
+}
+
+int mqtt_service_subscribe_batch(struct mqtt_service* self, const struct mqtt_service_topic* topics, size_t count) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topics);
+
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    size_t added = 0;
+    for (size_t i = 0; i < count; i++) {
+        added += _mqtt_service_find_subscription(self, topics[i].topic) == NULL;
+    }
+    if (self->subscriptions.count + added > MQTT_SERVICE_MAX_SUBSCRIPTIONS) {
+        k_mutex_unlock(&self->subscriptions.lock);
+        LOG_ERR("Too many subscriptions");
+        return -ENOMEM;
+    }
+
+    // Remembered so they can be restored on reconnect, sent by the service
+    // thread once connected.
+    for (size_t i = 0; i < count; i++) {
+        struct mqtt_service_subscription* sub = _mqtt_service_find_subscription(self, topics[i].topic);
+        if (sub == NULL) {
+            sub = &self->subscriptions.list[self->subscriptions.count++];
+            sub->topic = topics[i].topic;
+        }
+        sub->qos = topics[i].qos;
+        sub->state = MQTT_SERVICE_SUBSCRIPTION_PENDING;
+    }
+    self->subscriptions.changed = true;
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    mqtt_service_wakeup(self);
+    return 0;
+}
+
+int mqtt_service_unsubscribe(struct mqtt_service* self, const char* topic) {
+    return mqtt_service_unsubscribe_batch(self, &topic, 1);
+}
+
+int mqtt_service_unsubscribe_batch(struct mqtt_service* self, const char* const* topics, size_t count) {
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topics);
+
+    int rc = 0;
+
+    k_mutex_lock(&self->subscriptions.lock, K_FOREVER);
+    for (size_t i = 0; i < count; i++) {
+        struct mqtt_service_subscription* sub = _mqtt_service_find_subscription(self, topics[i]);
+        if (sub == NULL) {
+            rc = -ENOENT;
+            continue;
+        }
+        sub->state = MQTT_SERVICE_SUBSCRIPTION_REMOVED;
+    }
+    self->subscriptions.changed = true;
+    k_mutex_unlock(&self->subscriptions.lock);
+
+    mqtt_service_wakeup(self);
+    return rc;
+}
+
+void mqtt_service_set_subscribe_callback(struct mqtt_service* self,
+    mqtt_service_subscribe_callback_t callback, void* context)
+{
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->subscriptions.callback = callback;
+    self->subscriptions.context = context;
+}
+
+int mqtt_service_publish(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len) {
+    return mqtt_service_publish_cb(self, topic, qos, data, len, NULL, NULL);
+}
+
+int mqtt_service_publish_cb(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len,
+    mqtt_service_complete_t complete, void* context)
+{
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic);
+    NULL_PARAM_CHECK(data);
+
+    // Only enqueue here, the service thread owns the socket and will send the
+    // message on its next pass. Safe to call from ISR context.
+    int rc = mqtt_queue_push(&self->queue, topic, qos, 1U, data, len, complete, context);
+    if (rc != 0) {
+        LOG_WRN("Dropped outbound message: %d", rc);
+        return rc;
+    }
+
+    mqtt_service_wakeup(self);
+    return 0;
+}
+
+int mqtt_service_publish_stamped(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len,
+    uint32_t origin)
+{
+    int rc = mqtt_service_publish_cb(self, topic, qos, data, len, NULL, NULL);
+    if (rc == 0) {
+        MQTT_LATENCY_RECORD(MQTT_LATENCY_ORIGIN_TO_ENQUEUE, origin);
+    }
+    return rc;
+}
+
+void mqtt_service_wakeup(struct mqtt_service* self) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    if (self->group != NULL) {
+        mqtt_service_group_wakeup(self->group);
+    }
+}
+
+void mqtt_service_set_store(struct mqtt_service* self, struct mqtt_store* store) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->store.store = store;
+}
+
+int mqtt_service_add_telemetry(struct mqtt_service* self, const char* topic, uint32_t period,
+    mqtt_service_telemetry_t publish, void* context)
+{
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic);
+    NULL_PARAM_CHECK(publish);
+
+    int rc = mqtt_telemetry_add(&self->telemetry, topic, period, publish, context);
+    if (rc != 0) {
+        LOG_ERR("Unable to add telemetry %s: %d", log_strdup(topic), rc);
+    }
+    return rc;
+}
+
+void mqtt_service_set_stats_topic(struct mqtt_service* self, const char* topic, uint32_t interval) {
+    NULL_PARAM_CHECK_VOID(self);
+
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+    if (topic != NULL && interval > 0) {
+        mqtt_service_add_telemetry(self, topic, interval, _mqtt_service_publish_latency, NULL);
+    }
+#else
+    LOG_WRN("Latency statistics require CONFIG_MQTT_SERVICE_LATENCY");
+#endif
+}
+
+int mqtt_service_set_publish_policy(struct mqtt_service* self, const char* topic,
+    const struct mqtt_cache_policy* policy)
+{
+    NULL_PARAM_CHECK(self);
+    NULL_PARAM_CHECK(topic);
+    NULL_PARAM_CHECK(policy);
+
+    int rc = mqtt_cache_add(&self->cache, topic, policy);
     if (rc != 0) {
-        LOG_ERR("mqtt_publish: %d", rc);
+        LOG_ERR("Unable to set publish policy for %s: %d", log_strdup(topic), rc);
     }
     return rc;
 }
 
+void mqtt_service_get_cache_stats(struct mqtt_service* self, struct mqtt_cache_stats* stats) {
+    NULL_PARAM_CHECK_VOID(self);
+    NULL_PARAM_CHECK_VOID(stats);
+
+    mqtt_cache_get_stats(&self->cache, stats);
+}
+
+void mqtt_service_set_dispatch_queue(struct mqtt_service* self, struct k_work_q* queue) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    mqtt_dispatch_set_queue(&self->dispatch, queue);
+}
+
+void mqtt_service_get_dispatch_stats(struct mqtt_service* self, struct mqtt_dispatch_stats* stats) {
+    NULL_PARAM_CHECK_VOID(self);
+    NULL_PARAM_CHECK_VOID(stats);
+
+    mqtt_dispatch_get_stats(&self->dispatch, stats);
+}
+
+void mqtt_service_set_max_inflight(struct mqtt_service* self, size_t window) {
+    NULL_PARAM_CHECK_VOID(self);
+
+    self->outbox.window = MIN(MAX(window, 1), MQTT_OUTBOX_SIZE);
+    mqtt_service_wakeup(self);
+}
+
+void mqtt_service_get_outbox_stats(struct mqtt_service* self, struct mqtt_outbox_stats* stats) {
+    NULL_PARAM_CHECK_VOID(self);
+    NULL_PARAM_CHECK_VOID(stats);
+
+    mqtt_outbox_get_stats(&self->outbox, stats);
+}
+
+void mqtt_service_get_queue_stats(struct mqtt_service* self, struct mqtt_queue_stats* stats) {
+    NULL_PARAM_CHECK_VOID(self);
+    NULL_PARAM_CHECK_VOID(stats);
 
+    mqtt_queue_get_stats(&self->queue, stats);
+}
+
+void mqtt_service_get_mem_usage(struct mqtt_service_mem_usage* usage) {
+    NULL_PARAM_CHECK_VOID(usage);
+
+    usage->service = sizeof(struct mqtt_service);
+    usage->buffers = sizeof(((struct mqtt_service*)0)->buffer);
+    usage->queue = sizeof(struct mqtt_queue);
+    usage->outbox = sizeof(struct mqtt_outbox);
+    usage->handlers = sizeof(((struct mqtt_service*)0)->handlers);
+    usage->subscriptions = sizeof(((struct mqtt_service*)0)->subscriptions);
+    usage->cache = sizeof(struct mqtt_cache);
+    usage->telemetry = sizeof(struct mqtt_telemetry);
+    usage->dispatch = sizeof(struct mqtt_dispatch);
+    usage->group = sizeof(struct mqtt_service_group);
+    usage->stack = MQTT_SERVICE_STACK_SIZE;
+    usage->pool = MQTT_POOL_SIZE * sizeof(struct mqtt_queue_msg);
+    usage->store = sizeof(struct mqtt_store_ram);
+}
+
+void mqtt_service_log_mem_usage(void) {
+    struct mqtt_service_mem_usage usage;
+    struct mqtt_pool_stats pool;
+
+    mqtt_service_get_mem_usage(&usage);
+    mqtt_pool_get_stats(&pool);
+
+    LOG_INF("Service: %d bytes (buffers %d, queue %d, outbox %d, handlers %d, subscriptions %d, cache %d, telemetry %d)",
+        usage.service, usage.buffers, usage.queue, usage.outbox, usage.handlers, usage.subscriptions, usage.cache,
+        usage.telemetry);
+    LOG_INF("Group: %d bytes (stack %d)", usage.group, usage.stack);
+    LOG_INF("Message pool: %d bytes (%d x %d, used %d, max %d, failures %d)",
+        usage.pool, pool.blocks, pool.block_size, pool.used, pool.max_used, pool.failures);
+}
@@ -3,17 +3,38 @@
 #include <zephyr.h>
 #include <net/mqtt.h>
 
+#include "mqtt_queue.h"
+#include "mqtt_outbox.h"
+#include "mqtt_cache.h"
+#include "mqtt_dispatch.h"
+#include "mqtt_telemetry.h"
+#include "mqtt_store.h"
+#include "mqtt_topic_trie.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define MQTT_SERVICE_STACK_SIZE 2048
+#define MQTT_SERVICE_STACK_SIZE CONFIG_MQTT_SERVICE_STACK_SIZE
 #define MQTT_SERVICE_PRIO 8 
-#define MQTT_MAX_TOPIC_LEN 48
+#define MQTT_SERVICE_RX_BUFFER_SIZE CONFIG_MQTT_SERVICE_RX_BUFFER_SIZE
+#define MQTT_SERVICE_TX_BUFFER_SIZE CONFIG_MQTT_SERVICE_TX_BUFFER_SIZE
+#define MQTT_SERVICE_BATCH_SIZE CONFIG_MQTT_SERVICE_BATCH_SIZE
+#define MQTT_SERVICE_GROUP_MAX CONFIG_MQTT_SERVICE_GROUP_MAX
+#define MQTT_SERVICE_CONNACK_TIMEOUT 5000
+#define MQTT_SERVICE_RETRY_INTERVAL 1000
+#define MQTT_SERVICE_BACKOFF_MIN 500
+#define MQTT_SERVICE_BACKOFF_MAX 60000
+#define MQTT_SERVICE_MAX_SUBSCRIPTIONS CONFIG_MQTT_SERVICE_MAX_SUBSCRIPTIONS
+#define MQTT_SERVICE_STREAM_RETRY_INTERVAL 10
+#define MQTT_SERVICE_CHUNK_SIZE CONFIG_MQTT_SERVICE_CHUNK_SIZE
+#define MQTT_SERVICE_STREAM_BURST 4
+#define MQTT_SERVICE_MAX_ALIASES CONFIG_MQTT_SERVICE_MAX_ALIASES
 
 enum mqtt_service_state {
     MQTT_SERVICE_DISCONNECTED = 0,
     MQTT_SERVICE_CONNECTED = 1,
+    MQTT_SERVICE_CONNECTING = 2,
 };
 
 struct mqtt_service_client {
@@ -22,39 +43,331 @@ struct mqtt_service_client {
 };
 
 struct mqtt_service;
+struct mqtt_service_group;
+
+// Invoked on the service thread, or on the dispatch work queue when set, for
+// every PUBLISH matching the handler's topic filter. The topic points into the receive buffer and is not null
+// terminated. The handler must either consume the payload through
+// mqtt_service_read_payload() or return a negative value to have it discarded.
+typedef mqtt_topic_handler_t mqtt_service_handler_t;
+typedef mqtt_topic_handler_t mqtt_service_callback_t;
+
+// Invoked on the service thread for each chunk of a PUBLISH payload as it
+// arrives from the socket. Return 0 to accept the chunk, -EAGAIN to have the
+// same chunk offered again later (back pressure) or any other negative value
+// to skip the remainder of the message.
+typedef mqtt_topic_stream_handler_t mqtt_service_stream_handler_t;
+
+typedef mqtt_queue_complete_t mqtt_service_complete_t;
+
+typedef mqtt_telemetry_publish_t mqtt_service_telemetry_t;
+
+// Invoked on the service thread with MQTT_SERVICE_CONNECTED once the broker
+// accepted a connection and the session has been restored, and with
+// MQTT_SERVICE_DISCONNECTED when the connection is lost. Messages published
+// from the callback go out in the same batch as the restored session.
+typedef void(*mqtt_service_state_callback_t)(struct mqtt_service* service,
+    enum mqtt_service_state state, void* context);
+
+// Outcome of a subscription: the QoS granted by the broker, -EACCES when the
+// broker refused it or -EMSGSIZE when the topic does not fit a packet.
+// Invoked on the service thread.
+typedef void(*mqtt_service_subscribe_callback_t)(struct mqtt_service* service,
+    const char* topic, int result, void* context);
+
+struct mqtt_service_topic {
+    const char* topic;
+    uint8_t qos;
+};
 
-typedef int(*mqtt_service_callback_t)(
-    struct mqtt_service* service, const char* topic, size_t payload_len);
+enum mqtt_service_subscription_state {
+    // Waiting to be sent
+    MQTT_SERVICE_SUBSCRIPTION_PENDING = 0,
+    // SUBSCRIBE sent, waiting for the SUBACK
+    MQTT_SERVICE_SUBSCRIPTION_REQUESTED = 1,
+    MQTT_SERVICE_SUBSCRIPTION_ACTIVE = 2,
+    // Subscription refused by the broker or too long to send, retried on the
+    // next connection. Unsubscriptions never end up here.
+    MQTT_SERVICE_SUBSCRIPTION_FAILED = 3,
+    // Waiting for the UNSUBSCRIBE to be sent
+    MQTT_SERVICE_SUBSCRIPTION_REMOVED = 4,
+};
+
+struct mqtt_service_subscription {
+    const char* topic;
+    uint8_t qos;
+    enum mqtt_service_subscription_state state;
+    // Of the SUBSCRIBE or UNSUBSCRIBE carrying the topic
+    uint16_t message_id;
+};
+
+struct mqtt_service_stream {
+    bool active;
+    mqtt_service_stream_handler_t handler;
+    // Handler of a message left on the socket until it can be dispatched or
+    // handled in turn
+    mqtt_service_handler_t deferred;
+    void* context;
+    struct mqtt_utf8 topic;
+    uint8_t qos;
+    uint16_t message_id;
+
+    size_t total;
+    size_t received;
+    size_t pending;
+
+    uint32_t timestamp;
+};
 
 typedef struct mqtt_service {
     struct mqtt_service_client client;
     struct sockaddr_storage broker;
 
     struct {
-        uint8_t rx[256];
-        uint8_t tx[256];
+        uint8_t rx[MQTT_SERVICE_RX_BUFFER_SIZE];
+        uint8_t tx[MQTT_SERVICE_TX_BUFFER_SIZE];
+        uint8_t batch[MQTT_SERVICE_BATCH_SIZE];
+        uint8_t chunk[MQTT_SERVICE_CHUNK_SIZE];
     } buffer;
 
+    struct mqtt_queue queue;
+    struct mqtt_outbox outbox;
+    struct mqtt_cache cache;
+    struct mqtt_dispatch dispatch;
+    struct k_mutex lock;
+
+    struct {
+        struct mqtt_service_subscription list[MQTT_SERVICE_MAX_SUBSCRIPTIONS];
+        size_t count;
+        // Some subscription waits to be sent
+        bool changed;
+        struct k_mutex lock;
+        mqtt_service_subscribe_callback_t callback;
+        void* context;
+    } subscriptions;
+
+    struct {
+        bool present;
+        bool restore;
+    } session;
+
+    struct {
+        struct mqtt_store* store;
+        int64_t next_drain;
+    } store;
+
+    struct {
+        struct mqtt_topic_trie trie;
+        struct k_mutex lock;
+    } handlers;
+
+    struct {
+        const char* prefix;
+        const char* topics[MQTT_SERVICE_MAX_ALIASES];
+        size_t count;
+        // "<prefix>/cmd/+"
+        char filter[MQTT_QUEUE_TOPIC_LEN + 1];
+    } aliases;
+
+    struct mqtt_service_stream stream;
+
+    struct {
+        int attempt;
+        int64_t retry_at;
+        int64_t deadline;
+        // Readiness events required before connecting, see readiness.h
+        uint32_t ready_events;
+        bool ready;
+    } connection;
+
+    struct mqtt_telemetry telemetry;
+
+    struct mqtt_service_group* group;
+    enum mqtt_service_state state;
+    mqtt_service_callback_t callback;
+    mqtt_service_state_callback_t state_callback;
+    void* state_context;
+} mqtt_service_t;
+
+// A single service thread driving several clients. All client sockets are
+// polled together, so each additional broker connection only costs its
+// buffers.
+typedef struct mqtt_service_group {
+    struct mqtt_service* services[MQTT_SERVICE_GROUP_MAX];
+    size_t count;
+    struct k_mutex lock;
+
+    struct {
+        int fds[2];
+        atomic_t pending;
+        struct k_work work;
+    } wakeup;
+
     struct {
         struct k_thread data;
         k_tid_t id;
         K_THREAD_STACK_MEMBER(stack, MQTT_SERVICE_STACK_SIZE);
     } thread;
-    
-    enum mqtt_service_state state;
-    mqtt_service_callback_t callback;
-} mqtt_service_t;
+} mqtt_service_group_t;
+
+// Static RAM in bytes taken by the service building blocks, as configured
+struct mqtt_service_mem_usage {
+    // Per service instance, of which:
+    size_t service;
+    size_t buffers;
+    size_t queue;
+    size_t outbox;
+    size_t handlers;
+    size_t subscriptions;
+    size_t cache;
+    size_t telemetry;
+    size_t dispatch;
+    // Per service group, including its thread stack
+    size_t group;
+    size_t stack;
+    // Shared by all services
+    size_t pool;
+    // Per RAM backed store
+    size_t store;
+};
+
+void mqtt_service_get_mem_usage(struct mqtt_service_mem_usage* usage);
+
+// Log the memory usage along with the message pool utilization
+void mqtt_service_log_mem_usage(void);
 
 void mqtt_service_init(struct mqtt_service* self,
     const char* client_id,
     const char* broker_addr, uint16_t broker_port,
     mqtt_service_callback_t callback);
 
+// Start the service on the shared default group thread
 void mqtt_service_start(struct mqtt_service* self);
 
+void mqtt_service_group_init(struct mqtt_service_group* self);
+int mqtt_service_group_add(struct mqtt_service_group* self, struct mqtt_service* service);
+void mqtt_service_group_start(struct mqtt_service_group* self, const char* name);
+void mqtt_service_group_wakeup(struct mqtt_service_group* self);
+
+// Wake the service thread to act on newly queued work. Safe from ISR context.
+void mqtt_service_wakeup(struct mqtt_service* self);
+
+// Returns -ENOSPC when the handler trie is out of nodes, see
+// CONFIG_MQTT_SERVICE_TRIE_NODES
+int mqtt_service_register_handler(struct mqtt_service* self, const char* topic_filter,
+    mqtt_service_handler_t handler, void* context);
+
+int mqtt_service_register_stream_handler(struct mqtt_service* self, const char* topic_filter,
+    mqtt_service_stream_handler_t handler, void* context);
+
+// Must be set before the service is started
+void mqtt_service_set_state_callback(struct mqtt_service* self,
+    mqtt_service_state_callback_t callback, void* context);
+
+// Connection state as last seen by the service thread
+enum mqtt_service_state mqtt_service_get_state(struct mqtt_service* self);
+
+// Hold off connection attempts until all of the readiness `events` are set,
+// typically READINESS_NET_ADDR, rather than failing and backing off while
+// the network comes up. Must be set before the service is started.
+int mqtt_service_set_ready_events(struct mqtt_service* self, uint32_t events);
+
+// Keep the session on the broker across reconnects (defaults to a clean
+// session). Must be set before the service is started.
+void mqtt_service_set_clean_session(struct mqtt_service* self, bool clean_session);
+
+// Subscribe to `topic`, publishing `data` to it first unless NULL. The
+// subscription is kept across reconnects, the topic string must outlive the
+// service.
 int mqtt_service_subscribe(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len);
+
+// Subscribe to all `topics` at once, or to none of them if they do not all
+// fit the subscription table. The service thread packs as many pending topics
+// into each SUBSCRIBE as fit the tx buffer, so subscriptions made together
+// cost a single round trip.
+int mqtt_service_subscribe_batch(struct mqtt_service* self, const struct mqtt_service_topic* topics, size_t count);
+
+// Unsubscribe, packed into UNSUBSCRIBE packets the same way. Returns -ENOENT
+// if any of the topics is not subscribed, the others are still unsubscribed.
+int mqtt_service_unsubscribe(struct mqtt_service* self, const char* topic);
+int mqtt_service_unsubscribe_batch(struct mqtt_service* self, const char* const* topics, size_t count);
+
+// Report the outcome of every subscription from its SUBACK
+void mqtt_service_set_subscribe_callback(struct mqtt_service* self,
+    mqtt_service_subscribe_callback_t callback, void* context);
 int mqtt_service_publish(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len);
 
+// Publish with a callback invoked once a QoS 1/2 message has been
+// acknowledged by the broker.
+int mqtt_service_publish_cb(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len,
+    mqtt_service_complete_t complete, void* context);
+
+// Publish on behalf of an event that happened at cycle count `origin`, e.g.
+// taken on interrupt entry, so the time up to enqueueing is accounted for in
+// the latency statistics. Safe from ISR context.
+int mqtt_service_publish_stamped(struct mqtt_service* self, const char* topic, uint8_t qos, void* data, size_t len,
+    uint32_t origin);
+
+// Topic aliases: messages on an aliased topic are sent on "<prefix>/<n>"
+// instead, and commands for it are accepted on "<prefix>/cmd/<n>", with `n`
+// the alias number returned by mqtt_service_add_topic_alias(). The alias map
+// is published retained as "<prefix>/map/<n>" holding the full topic, ahead
+// of any other traffic on every connection. Handlers always see the full
+// topic. Both must be called before the service is started, the strings
+// must outlive the service.
+int mqtt_service_set_alias_prefix(struct mqtt_service* self, const char* prefix);
+int mqtt_service_add_topic_alias(struct mqtt_service* self, const char* topic);
+
+// Invoke `publish` every `period` milliseconds on the service thread while
+// connected, see mqtt_metrics.h for ready made publishers. Publishers due
+// together run in the same pass and their messages go out in one batch. Must
+// be called before the service is started, the topic string must outlive
+// the service.
+int mqtt_service_add_telemetry(struct mqtt_service* self, const char* topic, uint32_t period,
+    mqtt_service_telemetry_t publish, void* context);
+
+// Periodically publish the latency summaries to `topic`/latency/<stage> as
+// "count,min,p50,p90,p99,max" in microseconds, as a telemetry publisher. Only
+// available with CONFIG_MQTT_SERVICE_LATENCY, an interval of 0 disables
+// publishing.
+void mqtt_service_set_stats_topic(struct mqtt_service* self, const char* topic, uint32_t interval);
+
+// Buffer publishes in `store` while the broker is unreachable and forward
+// them, rate limited, once connected again. QoS 1/2 messages stored in a
+// persistent store complete with -EINPROGRESS right away, ones evicted from a
+// full RAM store with -ENOBUFS. Must be set before the service is started.
+void mqtt_service_set_store(struct mqtt_service* self, struct mqtt_store* store);
+
+// Suppress redundant publishes on `topic` at the source, see struct
+// mqtt_cache_policy. Applied by the service thread as messages are sent, the
+// publish calls themselves are unaffected. QoS 1/2 messages that are
+// suppressed complete with -ECANCELED. Must be set before the service is
+// started, the topic string must outlive the service.
+int mqtt_service_set_publish_policy(struct mqtt_service* self, const char* topic,
+    const struct mqtt_cache_policy* policy);
+
+void mqtt_service_get_cache_stats(struct mqtt_service* self, struct mqtt_cache_stats* stats);
+
+// Run the message handlers on `queue` rather than on the service thread, see
+// mqtt_dispatch.h. Messages are acknowledged once their handler returned.
+// While all dispatch entries are taken the socket is not read. Stream
+// handlers, messages larger than MQTT_QUEUE_PAYLOAD_LEN and messages arriving
+// while the message pool is exhausted are still handled on the service
+// thread, after the earlier messages of their lane. The socket is left unread
+// meanwhile, the service thread never waits on a handler. Must be set before
+// the service is started.
+void mqtt_service_set_dispatch_queue(struct mqtt_service* self, struct k_work_q* queue);
+
+void mqtt_service_get_dispatch_stats(struct mqtt_service* self, struct mqtt_dispatch_stats* stats);
+
+// Number of QoS 1/2 messages sent ahead without waiting for acknowledgement,
+// between 1 (stop-and-wait) and MQTT_OUTBOX_SIZE.
+void mqtt_service_set_max_inflight(struct mqtt_service* self, size_t window);
+
+void mqtt_service_get_outbox_stats(struct mqtt_service* self, struct mqtt_outbox_stats* stats);
+
+void mqtt_service_get_queue_stats(struct mqtt_service* self, struct mqtt_queue_stats* stats);
+
 int mqtt_service_read_payload(struct mqtt_service* self, void* buffer, size_t len);
 
 #ifdef __cplusplus
@@ -0,0 +1,184 @@
+#include "mqtt_shadow.h"
+
+#include <string.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mqtt_shadow, LOG_LEVEL_INF);
+
+static struct mqtt_shadow_entry* _mqtt_shadow_entry(struct mqtt_shadow* self, int index) {
+    if (index < 0 || index >= self->count) {
+        return NULL;
+    }
+    return &self->entries[index];
+}
+
+// Called with the lock held
+static int _mqtt_shadow_send(struct mqtt_shadow* self, struct mqtt_shadow_entry* entry) {
+    int rc = mqtt_service_publish(self->service, entry->reported_topic, entry->qos,
+        entry->reported.data, entry->reported.len);
+    if (rc == 0) {
+        entry->dirty = false;
+    }
+    return rc;
+}
+
+static void _mqtt_shadow_state_changed(struct mqtt_service* service, enum mqtt_service_state state, void* context) {
+    struct mqtt_shadow* self = context;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    self->online = state == MQTT_SERVICE_CONNECTED;
+
+    if (self->online) {
+        uint32_t resynced = 0;
+        for (size_t i = 0; i < self->count; i++) {
+            struct mqtt_shadow_entry* entry = &self->entries[i];
+            if (entry->dirty && _mqtt_shadow_send(self, entry) == 0) {
+                resynced++;
+            }
+        }
+
+        self->stats.resyncs++;
+        self->stats.resynced += resynced;
+        LOG_INF("Resynced %u of %u values", resynced, self->count);
+    }
+    k_mutex_unlock(&self->lock);
+}
+
+static int _mqtt_shadow_desired(struct mqtt_service* service, const struct mqtt_utf8* topic,
+    size_t payload_len, void* context)
+{
+    struct mqtt_shadow_entry* entry = context;
+    struct mqtt_shadow* self = entry->shadow;
+    uint8_t value[MQTT_QUEUE_PAYLOAD_LEN];
+
+    if (payload_len > sizeof(value)) {
+        LOG_ERR("Desired value too large: %d", payload_len);
+        return -1;
+    }
+    if (mqtt_service_read_payload(service, value, payload_len) < 0) {
+        return -1;
+    }
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    entry->has_desired = true;
+    entry->desired.len = payload_len;
+    memcpy(entry->desired.data, value, payload_len);
+    k_mutex_unlock(&self->lock);
+
+    // Outside of the lock, the handler is expected to report back
+    if (entry->handler != NULL) {
+        entry->handler(self, entry - self->entries, value, payload_len, entry->context);
+    }
+    return 0;
+}
+
+void mqtt_shadow_init(struct mqtt_shadow* self, struct mqtt_service* service) {
+    self->service = service;
+    self->count = 0;
+    self->online = false;
+    k_mutex_init(&self->lock);
+
+    self->stats.reports = 0;
+    self->stats.resyncs = 0;
+    self->stats.resynced = 0;
+
+    mqtt_service_set_state_callback(service, _mqtt_shadow_state_changed, self);
+}
+
+int mqtt_shadow_bind(struct mqtt_shadow* self, const char* reported_topic, const char* desired_topic,
+    uint8_t qos, mqtt_shadow_handler_t handler, void* context)
+{
+    if (reported_topic == NULL && desired_topic == NULL) {
+        return -EINVAL;
+    }
+    if (self->count >= MQTT_SHADOW_SIZE) {
+        LOG_ERR("Too many shadow entries");
+        return -ENOMEM;
+    }
+
+    struct mqtt_shadow_entry* entry = &self->entries[self->count];
+    entry->shadow = self;
+    entry->reported_topic = reported_topic;
+    entry->desired_topic = desired_topic;
+    entry->qos = qos;
+    entry->handler = handler;
+    entry->context = context;
+    entry->has_desired = false;
+    entry->has_reported = false;
+    entry->dirty = false;
+
+    if (desired_topic != NULL) {
+        int rc = mqtt_service_register_handler(self->service, desired_topic, _mqtt_shadow_desired, entry);
+        if (rc == 0) {
+            rc = mqtt_service_subscribe(self->service, desired_topic, qos, NULL, 0);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    return self->count++;
+}
+
+int mqtt_shadow_report(struct mqtt_shadow* self, int index, const void* data, size_t len) {
+    struct mqtt_shadow_entry* entry = _mqtt_shadow_entry(self, index);
+    if (entry == NULL || entry->reported_topic == NULL) {
+        return -EINVAL;
+    }
+    if (len > sizeof(entry->reported.data)) {
+        return -ENOMEM;
+    }
+
+    int rc = 0;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    if (!entry->has_reported || entry->reported.len != len || memcmp(entry->reported.data, data, len) != 0) {
+        entry->has_reported = true;
+        entry->reported.len = len;
+        memcpy(entry->reported.data, data, len);
+        entry->dirty = true;
+        self->stats.reports++;
+
+        // Otherwise sent once connected, along with the other changes
+        if (self->online) {
+            rc = _mqtt_shadow_send(self, entry);
+        }
+    }
+    k_mutex_unlock(&self->lock);
+
+    return rc;
+}
+
+int mqtt_shadow_get_desired(struct mqtt_shadow* self, int index, void* buffer, size_t len) {
+    struct mqtt_shadow_entry* entry = _mqtt_shadow_entry(self, index);
+    if (entry == NULL) {
+        return -EINVAL;
+    }
+
+    int rc;
+
+    k_mutex_lock(&self->lock, K_FOREVER);
+    if (!entry->has_desired) {
+        rc = -ENOENT;
+    } else if (entry->desired.len > len) {
+        rc = -ENOMEM;
+    } else {
+        memcpy(buffer, entry->desired.data, entry->desired.len);
+        rc = entry->desired.len;
+    }
+    k_mutex_unlock(&self->lock);
+
+    return rc;
+}
+
+void mqtt_shadow_get_stats(struct mqtt_shadow* self, struct mqtt_shadow_stats* stats) {
+    k_mutex_lock(&self->lock, K_FOREVER);
+    stats->reports = self->stats.reports;
+    stats->resyncs = self->stats.resyncs;
+    stats->resynced = self->stats.resynced;
+    stats->dirty = 0;
+    for (size_t i = 0; i < self->count; i++) {
+        stats->dirty += self->entries[i].dirty;
+    }
+    k_mutex_unlock(&self->lock);
+}
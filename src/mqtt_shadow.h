@@ -0,0 +1,96 @@
+#pragma once
+
+#include <zephyr.h>
+
+#include "mqtt_service.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_SHADOW_SIZE CONFIG_MQTT_SERVICE_SHADOW_SIZE
+
+struct mqtt_shadow;
+
+// Invoked from the message handler, on the service thread or its dispatch
+// work queue, with a new desired value for entry `index` to be applied to
+// the device. The resulting state is to be reported back through
+// mqtt_shadow_report().
+typedef void(*mqtt_shadow_handler_t)(struct mqtt_shadow* shadow, int index,
+    const uint8_t* value, size_t len, void* context);
+
+struct mqtt_shadow_value {
+    uint16_t len;
+    uint8_t data[MQTT_QUEUE_PAYLOAD_LEN];
+};
+
+struct mqtt_shadow_entry {
+    struct mqtt_shadow* shadow;
+    // Either may be NULL
+    const char* reported_topic;
+    const char* desired_topic;
+    uint8_t qos;
+
+    mqtt_shadow_handler_t handler;
+    void* context;
+
+    // Last value received on the desired topic
+    bool has_desired;
+    struct mqtt_shadow_value desired;
+
+    // Current state of the device
+    bool has_reported;
+    struct mqtt_shadow_value reported;
+
+    // The broker has not seen the reported value yet
+    bool dirty;
+};
+
+struct mqtt_shadow_stats {
+    uint32_t reports;
+    uint32_t resyncs;
+    uint32_t resynced;
+    uint32_t dirty;
+};
+
+// Device shadow on top of a service: keeps the desired and reported value of
+// every bound topic. Reported values are published right away while
+// connected and marked dirty otherwise. Once the service has connected, only
+// the dirty values are published, in one batch with the restored session.
+// Takes over the state callback of the service.
+struct mqtt_shadow {
+    struct mqtt_service* service;
+    struct mqtt_shadow_entry entries[MQTT_SHADOW_SIZE];
+    size_t count;
+    bool online;
+    struct k_mutex lock;
+
+    struct {
+        uint32_t reports;
+        uint32_t resyncs;
+        uint32_t resynced;
+    } stats;
+};
+
+void mqtt_shadow_init(struct mqtt_shadow* self, struct mqtt_service* service);
+
+// Bind a value published on `reported_topic` and/or received on
+// `desired_topic`, subscribed at `qos`. Returns the index of the entry or a
+// negative error. Must be called before the service is started, the topic
+// strings must outlive the shadow.
+int mqtt_shadow_bind(struct mqtt_shadow* self, const char* reported_topic, const char* desired_topic,
+    uint8_t qos, mqtt_shadow_handler_t handler, void* context);
+
+// Update the reported value of entry `index`, a value equal to the current
+// one is not published again.
+int mqtt_shadow_report(struct mqtt_shadow* self, int index, const void* data, size_t len);
+
+// Copy the last desired value of entry `index` to `buffer`, returns its
+// length, -ENOENT if none has been received yet or -ENOMEM if it does not fit.
+int mqtt_shadow_get_desired(struct mqtt_shadow* self, int index, void* buffer, size_t len);
+
+void mqtt_shadow_get_stats(struct mqtt_shadow* self, struct mqtt_shadow_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
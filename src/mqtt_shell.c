@@ -0,0 +1,339 @@
+#include "mqtt_shell.h"
+#include "mqtt_bench.h"
+#include "mqtt_latency.h"
+#include "mqtt_metrics.h"
+#include "mqtt_pool.h"
+#include "readiness.h"
+#include "trace.h"
+
+#if defined(CONFIG_SHELL)
+
+#include <shell/shell.h>
+
+#include <stdlib.h>
+
+static struct mqtt_service* _mqtt_shell_service;
+static const char* _mqtt_shell_bench_topic;
+
+void mqtt_shell_set_service(struct mqtt_service* service) {
+    _mqtt_shell_service = service;
+}
+
+void mqtt_shell_set_bench_topic(const char* topic) {
+    _mqtt_shell_bench_topic = topic;
+}
+
+static int _mqtt_shell_stats(const struct shell* shell, size_t argc, char** argv) {
+#if defined(CONFIG_MQTT_SERVICE_LATENCY)
+    shell_print(shell, "%-8s %10s %10s %10s %10s %10s %10s",
+        "stage", "count", "min", "p50", "p90", "p99", "max");
+
+    for (int stage = 0; stage < MQTT_LATENCY_STAGE_COUNT; stage++) {
+        struct mqtt_latency_summary summary;
+        mqtt_latency_summary(stage, &summary);
+        shell_print(shell, "%-8s %10u %10u %10u %10u %10u %10u",
+            mqtt_latency_stage_name(stage), summary.count,
+            summary.min, summary.p50, summary.p90, summary.p99, summary.max);
+    }
+    shell_print(shell, "(latencies in us, percentiles rounded up to a power of two)");
+#else
+    shell_warn(shell, "Built without CONFIG_MQTT_SERVICE_LATENCY");
+#endif
+    return 0;
+}
+
+static int _mqtt_shell_stats_reset(const struct shell* shell, size_t argc, char** argv) {
+    mqtt_latency_reset();
+    shell_print(shell, "Latency statistics cleared");
+    return 0;
+}
+
+static int _mqtt_shell_mem(const struct shell* shell, size_t argc, char** argv) {
+    struct mqtt_service_mem_usage usage;
+    struct mqtt_pool_stats pool;
+
+    mqtt_service_get_mem_usage(&usage);
+    mqtt_pool_get_stats(&pool);
+
+    shell_print(shell, "Per service:       %6d bytes", usage.service);
+    shell_print(shell, "  buffers          %6d", usage.buffers);
+    shell_print(shell, "  queue            %6d", usage.queue);
+    shell_print(shell, "  outbox           %6d", usage.outbox);
+    shell_print(shell, "  handlers         %6d", usage.handlers);
+    shell_print(shell, "  subscriptions    %6d", usage.subscriptions);
+    shell_print(shell, "  cache            %6d", usage.cache);
+    shell_print(shell, "  telemetry        %6d", usage.telemetry);
+    shell_print(shell, "  dispatch         %6d", usage.dispatch);
+    shell_print(shell, "Per group:         %6d bytes", usage.group);
+    shell_print(shell, "  stack            %6d", usage.stack);
+    shell_print(shell, "Message pool:      %6d bytes", usage.pool);
+    shell_print(shell, "  blocks           %6d x %d bytes", pool.blocks, pool.block_size);
+    shell_print(shell, "  used             %6d (max %d)", pool.used, pool.max_used);
+    shell_print(shell, "  failures         %6d", pool.failures);
+    shell_print(shell, "RAM store:         %6d bytes", usage.store);
+    return 0;
+}
+
+static void _mqtt_shell_print_thread(const struct mqtt_metrics_thread* info, void* context) {
+    const struct shell* shell = context;
+    uint32_t uptime = (uint32_t)k_uptime_get();
+    uint32_t cpu_ms = (uint32_t)(info->cycles * MSEC_PER_SEC / sys_clock_hw_cycles_per_sec());
+
+    if (info->stack_size == 0) {
+        shell_print(shell, "%-16s %6s %6s %4s %10u %3u%%", info->name, "-", "-", "-",
+            cpu_ms, uptime > 0 ? (uint32_t)((uint64_t)cpu_ms * 100 / uptime) : 0);
+        return;
+    }
+    shell_print(shell, "%-16s %6u %6u %3u%% %10u %3u%%", info->name,
+        info->stack_size, info->stack_used, info->stack_used * 100 / info->stack_size,
+        cpu_ms, uptime > 0 ? (uint32_t)((uint64_t)cpu_ms * 100 / uptime) : 0);
+}
+
+static void _mqtt_shell_print_occupancy(const struct shell* shell, const char* name,
+    uint32_t used, uint32_t max_used, uint32_t size)
+{
+    shell_print(shell, "%-16s %6u %6u %6u", name, used, max_used, size);
+}
+
+static int _mqtt_shell_resources(const struct shell* shell, size_t argc, char** argv) {
+    struct mqtt_service* service = _mqtt_shell_service;
+    struct mqtt_queue_stats queue;
+    struct mqtt_outbox_stats outbox;
+    struct mqtt_pool_stats pool;
+    struct mqtt_dispatch_stats dispatch;
+
+    shell_print(shell, "%-16s %6s %6s %4s %10s %4s", "thread", "stack", "used", "", "cpu (ms)", "cpu");
+    if (mqtt_metrics_foreach_thread(_mqtt_shell_print_thread, (void*)shell) < 0) {
+        shell_warn(shell, "Built without CONFIG_THREAD_MONITOR");
+    }
+#if !defined(CONFIG_THREAD_STACK_INFO) || !defined(CONFIG_INIT_STACKS)
+    shell_warn(shell, "Stack usage requires CONFIG_THREAD_STACK_INFO and CONFIG_INIT_STACKS");
+#endif
+#if !defined(CONFIG_THREAD_RUNTIME_STATS)
+    shell_warn(shell, "CPU time requires CONFIG_THREAD_RUNTIME_STATS");
+#endif
+
+    mqtt_pool_get_stats(&pool);
+    shell_print(shell, "");
+    shell_print(shell, "%-16s %6s %6s %6s", "buffer", "used", "max", "size");
+    _mqtt_shell_print_occupancy(shell, "message pool", pool.used, pool.max_used, pool.blocks);
+    if (service == NULL) {
+        return 0;
+    }
+
+    mqtt_service_get_queue_stats(service, &queue);
+    mqtt_service_get_outbox_stats(service, &outbox);
+    mqtt_service_get_dispatch_stats(service, &dispatch);
+    _mqtt_shell_print_occupancy(shell, "queue", queue.used, queue.max_used, MQTT_QUEUE_SIZE);
+    _mqtt_shell_print_occupancy(shell, "outbox", outbox.inflight, outbox.max_inflight, outbox.window);
+    _mqtt_shell_print_occupancy(shell, "dispatch", dispatch.pending, dispatch.max_pending, MQTT_DISPATCH_DEPTH);
+    return 0;
+}
+
+static bool _mqtt_shell_parse(const struct shell* shell, const char* arg, const char* name,
+    unsigned long max, unsigned long* value)
+{
+    char* end;
+    *value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || *value > max) {
+        shell_error(shell, "Invalid %s: %s (0 to %lu)", name, arg, max);
+        return false;
+    }
+    return true;
+}
+
+static void _mqtt_shell_print_latency(const struct shell* shell, const struct mqtt_bench_latency* latency) {
+    if (latency->count == 0) {
+        return;
+    }
+    shell_print(shell, "latency (us)   min %u avg %u max %u over %u messages",
+        latency->min, mqtt_bench_latency_avg(latency), latency->max, latency->count);
+}
+
+static int _mqtt_shell_bench_pub(const struct shell* shell, size_t argc, char** argv) {
+    unsigned long count, size, qos, rate;
+    if (!_mqtt_shell_parse(shell, argv[1], "count", UINT32_MAX, &count) ||
+        !_mqtt_shell_parse(shell, argv[2], "size", MQTT_QUEUE_PAYLOAD_LEN, &size) ||
+        !_mqtt_shell_parse(shell, argv[3], "qos", MQTT_QOS_2_EXACTLY_ONCE, &qos) ||
+        !_mqtt_shell_parse(shell, argv[4], "rate", UINT32_MAX, &rate)) {
+        return -EINVAL;
+    }
+
+    const struct mqtt_bench_pub_params params = {
+        .topic = argc > 5 ? argv[5] : _mqtt_shell_bench_topic,
+        .count = count,
+        .size = size,
+        .qos = qos,
+        .rate = rate,
+    };
+    if (_mqtt_shell_service == NULL || params.topic == NULL) {
+        shell_error(shell, "No service or topic to publish to");
+        return -ENOENT;
+    }
+    if (!readiness_test(READINESS_MQTT_CONNECTED)) {
+        shell_warn(shell, "Not connected, messages are queued until the broker is reached");
+    }
+
+    struct mqtt_bench_pub_result result;
+    shell_print(shell, "Publishing %u x %u bytes at QoS %u to %s", params.count, params.size,
+        params.qos, params.topic);
+    int rc = mqtt_bench_publish(_mqtt_shell_service, &params, &result);
+    if (rc == -EBUSY || rc == -EINVAL) {
+        shell_error(shell, "Unable to run: %d", rc);
+        return rc;
+    }
+    if (rc == -ENOTCONN && result.published == 0) {
+        shell_error(shell, "Not connected, QoS 0 messages would only be stored");
+        return rc;
+    }
+
+    uint32_t elapsed = MAX(result.elapsed_ms, 1U);
+    shell_print(shell, "published      %u in %u ms, %u msg/s, %u B/s", result.completed, result.elapsed_ms,
+        (uint32_t)((uint64_t)result.completed * MSEC_PER_SEC / elapsed),
+        (uint32_t)((uint64_t)result.completed * params.size * MSEC_PER_SEC / elapsed));
+    shell_print(shell, "errors         %u failed, %u unacknowledged, queue full %u times",
+        result.failed, result.published - MIN(result.published, result.completed + result.failed),
+        result.stalls);
+    _mqtt_shell_print_latency(shell, &result.latency);
+    if (rc == -ETIMEDOUT) {
+        shell_warn(shell, "Gave up waiting after %d ms without progress", MQTT_BENCH_TIMEOUT_MS);
+    } else if (rc == -ENOTCONN) {
+        shell_warn(shell, "Disconnected during the run, unsent messages were stored");
+    }
+    return 0;
+}
+
+static int _mqtt_shell_bench_sub(const struct shell* shell, size_t argc, char** argv) {
+    unsigned long qos = MQTT_QOS_0_AT_MOST_ONCE;
+    if (argc > 2 && !_mqtt_shell_parse(shell, argv[2], "qos", MQTT_QOS_2_EXACTLY_ONCE, &qos)) {
+        return -EINVAL;
+    }
+    if (_mqtt_shell_service == NULL) {
+        shell_error(shell, "No service to subscribe with");
+        return -ENOENT;
+    }
+
+    int rc = mqtt_bench_subscribe(_mqtt_shell_service, argv[1], qos);
+    if (rc != 0) {
+        shell_error(shell, "Unable to subscribe to %s: %d", argv[1], rc);
+        return rc;
+    }
+    shell_print(shell, "Counting messages on %s, see \"mqtt bench status\"", argv[1]);
+    return 0;
+}
+
+static int _mqtt_shell_bench_status(const struct shell* shell, size_t argc, char** argv) {
+    const char* filter = mqtt_bench_get_filter();
+    struct mqtt_bench_sub_stats stats;
+
+    if (filter == NULL) {
+        shell_print(shell, "Not subscribed, see \"mqtt bench sub\"");
+        return 0;
+    }
+
+    mqtt_bench_get_sub_stats(&stats);
+    uint32_t elapsed = MAX(stats.elapsed_ms, 1U);
+    shell_print(shell, "filter         %s", filter);
+    shell_print(shell, "received       %u in %u ms, %u msg/s, %u B/s", stats.received, stats.elapsed_ms,
+        (uint32_t)((uint64_t)stats.received * MSEC_PER_SEC / elapsed),
+        (uint32_t)((uint64_t)stats.bytes * MSEC_PER_SEC / elapsed));
+    shell_print(shell, "own messages   %u, %u out of order", stats.latency.count, stats.reordered);
+    _mqtt_shell_print_latency(shell, &stats.latency);
+    return 0;
+}
+
+static int _mqtt_shell_bench_stop(const struct shell* shell, size_t argc, char** argv) {
+    if (_mqtt_shell_service == NULL || mqtt_bench_unsubscribe(_mqtt_shell_service) != 0) {
+        shell_print(shell, "Not subscribed");
+        return 0;
+    }
+    shell_print(shell, "Unsubscribed");
+    return 0;
+}
+
+static int _mqtt_shell_boot(const struct shell* shell, size_t argc, char** argv) {
+    uint32_t events = readiness_get();
+    int64_t previous = 0;
+
+    shell_print(shell, "%-18s %10s %10s %s", "phase", "at (ms)", "took (ms)", "now");
+    for (int i = 0; i < READINESS_EVENT_COUNT; i++) {
+        int64_t timestamp = readiness_timestamp(BIT(i));
+        const char* state = (events & BIT(i)) ? "set" : "clear";
+        if (timestamp < 0) {
+            shell_print(shell, "%-18s %10s %10s %s", readiness_event_name(BIT(i)), "-", "-", state);
+            continue;
+        }
+        shell_print(shell, "%-18s %10u %10u %s", readiness_event_name(BIT(i)),
+            (uint32_t)timestamp, (uint32_t)(timestamp - previous), state);
+        previous = timestamp;
+    }
+    return 0;
+}
+
+// One hex line per record, decoded by trace.py on the host
+static int _mqtt_shell_trace_dump(const struct shell* shell, size_t argc, char** argv) {
+    uint32_t first = trace_first();
+    uint32_t head = trace_head();
+
+    shell_print(shell, "trace 1 %u %u %u", sys_clock_hw_cycles_per_sec(), first, head);
+    for (uint32_t i = first; i != head; i++) {
+        struct trace_record record;
+        if (!trace_get(i, &record)) {
+            // Overwritten while dumping
+            continue;
+        }
+        shell_print(shell, "%08x %02x %02x %04x %08x",
+            record.timestamp, record.event, record.arg0, record.arg1, record.arg2);
+    }
+    shell_print(shell, "trace end");
+    return 0;
+}
+
+static int _mqtt_shell_trace_clear(const struct shell* shell, size_t argc, char** argv) {
+    trace_clear();
+    shell_print(shell, "Trace cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_mqtt_shell_trace_cmds,
+    SHELL_CMD(dump, NULL, "Print the trace records for trace.py", _mqtt_shell_trace_dump),
+    SHELL_CMD(clear, NULL, "Forget the trace records", _mqtt_shell_trace_clear),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_mqtt_shell_bench_cmds,
+    SHELL_CMD_ARG(pub, NULL, "<count> <size> <qos> <rate> [topic]: publish and report throughput, "
+        "latency and errors, a rate of 0 publishes as fast as possible", _mqtt_shell_bench_pub, 5, 1),
+    SHELL_CMD_ARG(sub, NULL, "<filter> [qos]: count the messages received on filter",
+        _mqtt_shell_bench_sub, 2, 1),
+    SHELL_CMD(status, NULL, "Messages received since \"mqtt bench sub\"", _mqtt_shell_bench_status),
+    SHELL_CMD(stop, NULL, "Unsubscribe from the benchmark filter", _mqtt_shell_bench_stop),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_mqtt_shell_stats_cmds,
+    SHELL_CMD(reset, NULL, "Clear the latency histograms", _mqtt_shell_stats_reset),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(_mqtt_shell_cmds,
+    SHELL_CMD(stats, &_mqtt_shell_stats_cmds, "Latency per stage of the MQTT service", _mqtt_shell_stats),
+    SHELL_CMD(mem, NULL, "Memory used by the MQTT service", _mqtt_shell_mem),
+    SHELL_CMD(resources, NULL, "Stack, CPU and buffer usage", _mqtt_shell_resources),
+    SHELL_CMD(boot, NULL, "Time taken by each startup phase", _mqtt_shell_boot),
+    SHELL_CMD(trace, &_mqtt_shell_trace_cmds, "Binary event trace", NULL),
+    SHELL_CMD(bench, &_mqtt_shell_bench_cmds, "Load generator", NULL),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(mqtt, &_mqtt_shell_cmds, "MQTT service commands", NULL);
+
+#else
+
+void mqtt_shell_set_service(struct mqtt_service* service) {
+}
+
+void mqtt_shell_set_bench_topic(const char* topic) {
+}
+
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "mqtt_service.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Service whose queues "mqtt resources" reports on, the shell commands that
+// are not tied to a service work without one
+void mqtt_shell_set_service(struct mqtt_service* service);
+
+// Default topic of "mqtt bench pub", the string must outlive the shell
+void mqtt_shell_set_bench_topic(const char* topic);
+
+#ifdef __cplusplus
+}
+#endif
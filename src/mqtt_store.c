@@ -0,0 +1,94 @@
+#include "mqtt_store.h"
+
+#include <string.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mqtt_store, LOG_LEVEL_INF);
+
+int mqtt_store_append(struct mqtt_store* self, const struct mqtt_queue_msg* msg) {
+    // Make room by dropping the oldest message
+    if (mqtt_store_count(self) >= self->capacity) {
+        int rc = mqtt_store_pop(self);
+        if (rc != 0) {
+            return rc;
+        }
+        self->evicted++;
+    }
+
+    return self->api->append(self, msg);
+}
+
+size_t mqtt_store_drain(struct mqtt_store* self, size_t max, mqtt_store_drain_t fn, void* context) {
+    struct mqtt_queue_msg msg;
+    size_t taken = 0;
+    int rc;
+
+    while (taken < max && (rc = mqtt_store_peek(self, &msg)) != -ENOENT) {
+        if (rc != 0) {
+            LOG_ERR("Discarding unreadable stored message: %d", rc);
+            self->discarded++;
+            mqtt_store_pop(self);
+            continue;
+        }
+
+        rc = fn(&msg, context);
+        if (rc == -EAGAIN) {
+            break;
+        }
+        taken += rc == 0;
+        mqtt_store_pop(self);
+    }
+
+    return taken;
+}
+
+static int _mqtt_store_ram_append(struct mqtt_store* base, const struct mqtt_queue_msg* msg) {
+    struct mqtt_store_ram* self = CONTAINER_OF(base, struct mqtt_store_ram, base);
+    struct mqtt_queue_msg* slot = &self->msgs[self->head % MQTT_STORE_RAM_SIZE];
+
+    memcpy(slot, msg, sizeof(*slot));
+    self->head++;
+    return 0;
+}
+
+static int _mqtt_store_ram_peek(struct mqtt_store* base, struct mqtt_queue_msg* msg) {
+    struct mqtt_store_ram* self = CONTAINER_OF(base, struct mqtt_store_ram, base);
+    if (self->head == self->tail) {
+        return -ENOENT;
+    }
+
+    memcpy(msg, &self->msgs[self->tail % MQTT_STORE_RAM_SIZE], sizeof(*msg));
+    return 0;
+}
+
+static int _mqtt_store_ram_pop(struct mqtt_store* base) {
+    struct mqtt_store_ram* self = CONTAINER_OF(base, struct mqtt_store_ram, base);
+    if (self->head == self->tail) {
+        return -ENOENT;
+    }
+
+    self->tail++;
+    return 0;
+}
+
+static size_t _mqtt_store_ram_count(struct mqtt_store* base) {
+    struct mqtt_store_ram* self = CONTAINER_OF(base, struct mqtt_store_ram, base);
+    return self->head - self->tail;
+}
+
+static const struct mqtt_store_api _mqtt_store_ram_api = {
+    .append = _mqtt_store_ram_append,
+    .peek = _mqtt_store_ram_peek,
+    .pop = _mqtt_store_ram_pop,
+    .count = _mqtt_store_ram_count,
+};
+
+void mqtt_store_ram_init(struct mqtt_store_ram* self) {
+    self->base.api = &_mqtt_store_ram_api;
+    self->base.capacity = MQTT_STORE_RAM_SIZE;
+    self->base.evicted = 0;
+    self->base.discarded = 0;
+    self->base.persistent = false;
+    self->head = 0;
+    self->tail = 0;
+}
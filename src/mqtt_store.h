@@ -0,0 +1,98 @@
+#pragma once
+
+#include <zephyr.h>
+
+#include "mqtt_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Messages moved from the store to the send path per drain interval
+#define MQTT_STORE_DRAIN_BATCH 8
+#define MQTT_STORE_DRAIN_INTERVAL 100
+
+#define MQTT_STORE_RAM_SIZE CONFIG_MQTT_SERVICE_STORE_RAM_SIZE
+
+BUILD_ASSERT((MQTT_STORE_RAM_SIZE & (MQTT_STORE_RAM_SIZE - 1)) == 0,
+    "MQTT_STORE_RAM_SIZE must be a power of two");
+
+struct mqtt_store;
+
+struct mqtt_store_api {
+    int (*append)(struct mqtt_store* self, const struct mqtt_queue_msg* msg);
+    int (*peek)(struct mqtt_store* self, struct mqtt_queue_msg* msg);
+    int (*pop)(struct mqtt_store* self);
+    size_t (*count)(struct mqtt_store* self);
+};
+
+// Append-only message log buffering publishes while the broker is
+// unreachable. Bounded to `capacity` messages, evicting the oldest one when
+// full. Completion callbacks travel with the messages unless the store is
+// `persistent`, as they would not survive a reset; the service then completes
+// QoS 1/2 messages with -EINPROGRESS as they are stored. Only to be used from
+// the service thread.
+struct mqtt_store {
+    const struct mqtt_store_api* api;
+    size_t capacity;
+    uint32_t evicted;
+    // Records dropped by mqtt_store_drain() as unreadable
+    uint32_t discarded;
+    bool persistent;
+};
+
+// Takes a message handed out by mqtt_store_drain(), returns 0 once it did,
+// -EAGAIN to leave it in the store and stop, any other error to drop it.
+typedef int (*mqtt_store_drain_t)(const struct mqtt_queue_msg* msg, void* context);
+
+static inline size_t mqtt_store_count(struct mqtt_store* self) {
+    return self->api->count(self);
+}
+
+static inline int mqtt_store_peek(struct mqtt_store* self, struct mqtt_queue_msg* msg) {
+    return self->api->peek(self, msg);
+}
+
+static inline int mqtt_store_pop(struct mqtt_store* self) {
+    return self->api->pop(self);
+}
+
+int mqtt_store_append(struct mqtt_store* self, const struct mqtt_queue_msg* msg);
+
+// Hand the oldest messages to `fn`, popping each one it took or dropped,
+// until `max` were taken, `fn` returns -EAGAIN or the store is empty. A
+// record that cannot be read is popped and counted in `discarded` rather
+// than holding up the messages behind it for good. Returns the number of
+// messages taken.
+size_t mqtt_store_drain(struct mqtt_store* self, size_t max, mqtt_store_drain_t fn, void* context);
+
+// RAM backed store, does not survive a reset
+struct mqtt_store_ram {
+    struct mqtt_store base;
+    struct mqtt_queue_msg msgs[MQTT_STORE_RAM_SIZE];
+    uint32_t head;
+    uint32_t tail;
+};
+
+void mqtt_store_ram_init(struct mqtt_store_ram* self);
+
+#if defined(CONFIG_MQTT_SERVICE_STORE_NVS)
+#include <fs/nvs.h>
+
+// Flash backed store on top of NVS in the `storage` flash partition. Records
+// are written to a ring of NVS ids along with their position in the log, from
+// which head and tail are rebuilt on mount so the log survives a reset
+// without a flash write of its own per append or pop.
+struct mqtt_store_nvs {
+    struct mqtt_store base;
+    struct nvs_fs fs;
+    uint32_t head;
+    uint32_t tail;
+};
+
+int mqtt_store_nvs_init(struct mqtt_store_nvs* self);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,168 @@
+#include "mqtt_store.h"
+
+#if defined(CONFIG_MQTT_SERVICE_STORE_NVS)
+
+#include <drivers/flash.h>
+#include <storage/flash_map.h>
+#include <string.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mqtt_store_nvs, LOG_LEVEL_INF);
+
+#define MQTT_STORE_NVS_ID_BASE 16
+
+// Stored record, only the used part of the topic and payload is written
+struct mqtt_store_nvs_record {
+    // Position in the log, kept first so it can be read on its own
+    uint32_t position;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t data[MQTT_QUEUE_TOPIC_LEN + MQTT_QUEUE_PAYLOAD_LEN];
+} __packed;
+
+static uint16_t _mqtt_store_nvs_id(uint32_t position) {
+    return MQTT_STORE_NVS_ID_BASE + position % CONFIG_MQTT_SERVICE_STORE_NVS_CAPACITY;
+}
+
+static int _mqtt_store_nvs_append(struct mqtt_store* base, const struct mqtt_queue_msg* msg) {
+    struct mqtt_store_nvs* self = CONTAINER_OF(base, struct mqtt_store_nvs, base);
+    struct mqtt_store_nvs_record record;
+
+    record.position = self->head;
+    record.qos = msg->qos;
+    record.retain = msg->retain;
+    record.topic_len = msg->topic_len;
+    record.payload_len = msg->payload_len;
+    memcpy(record.data, msg->topic, msg->topic_len);
+    memcpy(record.data + msg->topic_len, msg->payload, msg->payload_len);
+
+    size_t len = offsetof(struct mqtt_store_nvs_record, data) + msg->topic_len + msg->payload_len;
+    ssize_t rc = nvs_write(&self->fs, _mqtt_store_nvs_id(self->head), &record, len);
+    if (rc < 0) {
+        LOG_ERR("nvs_write: %d", rc);
+        return rc;
+    }
+
+    self->head++;
+    return 0;
+}
+
+static int _mqtt_store_nvs_peek(struct mqtt_store* base, struct mqtt_queue_msg* msg) {
+    struct mqtt_store_nvs* self = CONTAINER_OF(base, struct mqtt_store_nvs, base);
+    struct mqtt_store_nvs_record record;
+
+    if (self->head == self->tail) {
+        return -ENOENT;
+    }
+
+    ssize_t rc = nvs_read(&self->fs, _mqtt_store_nvs_id(self->tail), &record, sizeof(record));
+    if (rc < 0) {
+        LOG_ERR("nvs_read: %d", rc);
+        return rc;
+    }
+
+    if (record.position != self->tail ||
+        record.topic_len > MQTT_QUEUE_TOPIC_LEN || record.payload_len > MQTT_QUEUE_PAYLOAD_LEN) {
+        return -EBADMSG;
+    }
+
+    msg->complete = NULL;
+    msg->context = NULL;
+    msg->qos = record.qos;
+    msg->retain = record.retain;
+    msg->topic_len = record.topic_len;
+    msg->payload_len = record.payload_len;
+    msg->timestamp = 0;
+    memcpy(msg->topic, record.data, record.topic_len);
+    memcpy(msg->payload, record.data + record.topic_len, record.payload_len);
+    return 0;
+}
+
+static int _mqtt_store_nvs_pop(struct mqtt_store* base) {
+    struct mqtt_store_nvs* self = CONTAINER_OF(base, struct mqtt_store_nvs, base);
+    if (self->head == self->tail) {
+        return -ENOENT;
+    }
+
+    nvs_delete(&self->fs, _mqtt_store_nvs_id(self->tail));
+    self->tail++;
+    return 0;
+}
+
+// Pick up where the previous boot left off: the records left form the log
+// from the lowest position to the highest
+static void _mqtt_store_nvs_restore(struct mqtt_store_nvs* self) {
+    bool found = false;
+
+    for (uint32_t i = 0; i < CONFIG_MQTT_SERVICE_STORE_NVS_CAPACITY; i++) {
+        uint32_t position;
+        ssize_t rc = nvs_read(&self->fs, MQTT_STORE_NVS_ID_BASE + i, &position, sizeof(position));
+        if (rc < (ssize_t)sizeof(position) || _mqtt_store_nvs_id(position) != MQTT_STORE_NVS_ID_BASE + i) {
+            continue;
+        }
+
+        if (!found || position < self->tail) {
+            self->tail = position;
+        }
+        if (!found || position >= self->head) {
+            self->head = position + 1;
+        }
+        found = true;
+    }
+
+    if (found) {
+        LOG_INF("Restored %d stored messages", self->head - self->tail);
+    }
+}
+
+static size_t _mqtt_store_nvs_count(struct mqtt_store* base) {
+    struct mqtt_store_nvs* self = CONTAINER_OF(base, struct mqtt_store_nvs, base);
+    return self->head - self->tail;
+}
+
+static const struct mqtt_store_api _mqtt_store_nvs_api = {
+    .append = _mqtt_store_nvs_append,
+    .peek = _mqtt_store_nvs_peek,
+    .pop = _mqtt_store_nvs_pop,
+    .count = _mqtt_store_nvs_count,
+};
+
+int mqtt_store_nvs_init(struct mqtt_store_nvs* self) {
+    struct flash_pages_info info;
+
+    self->base.api = &_mqtt_store_nvs_api;
+    self->base.capacity = CONFIG_MQTT_SERVICE_STORE_NVS_CAPACITY;
+    self->base.evicted = 0;
+    self->base.discarded = 0;
+    self->base.persistent = true;
+    self->head = 0;
+    self->tail = 0;
+
+    struct device* flash = device_get_binding(DT_CHOSEN_ZEPHYR_FLASH_CONTROLLER_LABEL);
+    if (flash == NULL) {
+        LOG_ERR("Flash controller not found");
+        return -ENODEV;
+    }
+
+    self->fs.offset = FLASH_AREA_OFFSET(storage);
+    int rc = flash_get_page_info_by_offs(flash, self->fs.offset, &info);
+    if (rc != 0) {
+        LOG_ERR("flash_get_page_info_by_offs: %d", rc);
+        return rc;
+    }
+    self->fs.sector_size = info.size;
+    self->fs.sector_count = FLASH_AREA_SIZE(storage) / info.size;
+
+    rc = nvs_init(&self->fs, DT_CHOSEN_ZEPHYR_FLASH_CONTROLLER_LABEL);
+    if (rc != 0) {
+        LOG_ERR("nvs_init: %d", rc);
+        return rc;
+    }
+
+    _mqtt_store_nvs_restore(self);
+    return 0;
+}
+
+#endif
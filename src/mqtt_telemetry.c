@@ -0,0 +1,117 @@
+#include "mqtt_telemetry.h"
+
+#include <string.h>
+
+#define MQTT_TELEMETRY_MASK (MQTT_TELEMETRY_SLOTS - 1)
+
+void mqtt_telemetry_init(struct mqtt_telemetry* self, int64_t now) {
+    memset(self->wheel, 0, sizeof(self->wheel));
+    self->count = 0;
+    self->current = 0;
+    self->start = now;
+}
+
+static void _mqtt_telemetry_insert(struct mqtt_telemetry* self, struct mqtt_telemetry_entry* entry) {
+    uint32_t delta = entry->expires - self->current;
+    uint32_t revolutions = (entry->expires >> MQTT_TELEMETRY_SLOT_BITS) - (self->current >> MQTT_TELEMETRY_SLOT_BITS);
+    struct mqtt_telemetry_entry** slot;
+
+    if (delta < MQTT_TELEMETRY_SLOTS) {
+        slot = &self->wheel[0][entry->expires & MQTT_TELEMETRY_MASK];
+    } else if (revolutions < MQTT_TELEMETRY_SLOTS) {
+        slot = &self->wheel[1][(entry->expires >> MQTT_TELEMETRY_SLOT_BITS) & MQTT_TELEMETRY_MASK];
+    } else {
+        // Too far out, parked in the last slot and inserted again from there
+        slot = &self->wheel[1][((self->current >> MQTT_TELEMETRY_SLOT_BITS) - 1) & MQTT_TELEMETRY_MASK];
+    }
+
+    entry->next = *slot;
+    *slot = entry;
+}
+
+int mqtt_telemetry_add(struct mqtt_telemetry* self, const char* topic, uint32_t period,
+    mqtt_telemetry_publish_t publish, void* context)
+{
+    if (self->count >= MQTT_TELEMETRY_SIZE) {
+        return -ENOMEM;
+    }
+
+    struct mqtt_telemetry_entry* entry = &self->entries[self->count++];
+    entry->topic = topic;
+    entry->publish = publish;
+    entry->context = context;
+    entry->period = MAX(DIV_ROUND_UP(period, MQTT_TELEMETRY_TICK), 1);
+    // Each entry a tick behind the previous one, so entries with a common
+    // period never come due together and flood the queue
+    entry->expires = self->current + entry->period + self->count - 1;
+    _mqtt_telemetry_insert(self, entry);
+    return 0;
+}
+
+int mqtt_telemetry_run(struct mqtt_telemetry* self, struct mqtt_service* service, int64_t now) {
+    uint32_t target = (now - self->start) / MQTT_TELEMETRY_TICK;
+    struct mqtt_telemetry_entry* due = NULL;
+
+    // Collect first and reschedule after, so an entry fires once however far
+    // behind the wheel is.
+    while ((int32_t)(target - self->current) > 0) {
+        self->current++;
+
+        if ((self->current & MQTT_TELEMETRY_MASK) == 0) {
+            struct mqtt_telemetry_entry** slot =
+                &self->wheel[1][(self->current >> MQTT_TELEMETRY_SLOT_BITS) & MQTT_TELEMETRY_MASK];
+            struct mqtt_telemetry_entry* entry = *slot;
+            *slot = NULL;
+
+            while (entry != NULL) {
+                struct mqtt_telemetry_entry* next = entry->next;
+                _mqtt_telemetry_insert(self, entry);
+                entry = next;
+            }
+        }
+
+        struct mqtt_telemetry_entry** slot = &self->wheel[0][self->current & MQTT_TELEMETRY_MASK];
+        while (*slot != NULL) {
+            struct mqtt_telemetry_entry* entry = *slot;
+            *slot = entry->next;
+            entry->next = due;
+            due = entry;
+        }
+    }
+
+    int count = 0;
+    while (due != NULL) {
+        struct mqtt_telemetry_entry* entry = due;
+        due = entry->next;
+
+        entry->publish(service, entry->topic, entry->context);
+        count++;
+
+        entry->expires += entry->period;
+        if ((int32_t)(entry->expires - self->current) <= 0) {
+            entry->expires = self->current + entry->period;
+        }
+        _mqtt_telemetry_insert(self, entry);
+    }
+
+    return count;
+}
+
+int64_t mqtt_telemetry_next_deadline(const struct mqtt_telemetry* self) {
+    for (uint32_t i = 1; i < MQTT_TELEMETRY_SLOTS; i++) {
+        uint32_t tick = self->current + i;
+        if (self->wheel[0][tick & MQTT_TELEMETRY_MASK] != NULL) {
+            return self->start + (int64_t)tick * MQTT_TELEMETRY_TICK;
+        }
+    }
+
+    // Wake up to cascade the next occupied slot of the second level
+    for (uint32_t i = 1; i <= MQTT_TELEMETRY_SLOTS; i++) {
+        uint32_t revolution = (self->current >> MQTT_TELEMETRY_SLOT_BITS) + i;
+        if (self->wheel[1][revolution & MQTT_TELEMETRY_MASK] != NULL) {
+            return self->start + ((int64_t)revolution << MQTT_TELEMETRY_SLOT_BITS) * MQTT_TELEMETRY_TICK;
+        }
+    }
+
+    return INT64_MAX;
+}
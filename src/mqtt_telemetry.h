@@ -0,0 +1,62 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_TELEMETRY_SIZE CONFIG_MQTT_SERVICE_TELEMETRY_SIZE
+// Resolution of the periods in milliseconds
+#define MQTT_TELEMETRY_TICK 100
+#define MQTT_TELEMETRY_SLOT_BITS 6
+#define MQTT_TELEMETRY_SLOTS (1 << MQTT_TELEMETRY_SLOT_BITS)
+
+struct mqtt_service;
+
+// Invoked on the service thread when due, to publish on `topic`
+typedef void(*mqtt_telemetry_publish_t)(struct mqtt_service* service, const char* topic, void* context);
+
+struct mqtt_telemetry_entry {
+    struct mqtt_telemetry_entry* next;
+    const char* topic;
+    mqtt_telemetry_publish_t publish;
+    void* context;
+    // In ticks
+    uint32_t period;
+    uint32_t expires;
+};
+
+// Periodic publishers driven by a two level timer wheel: the first level has
+// a slot per tick, the second a slot per revolution of the first, so
+// scheduling and expiry cost the same whatever the number of entries. Periods
+// beyond the second level are rescheduled once it comes around. Only to be
+// used from the service thread, entries are to be added before the service
+// starts.
+struct mqtt_telemetry {
+    struct mqtt_telemetry_entry entries[MQTT_TELEMETRY_SIZE];
+    size_t count;
+
+    struct mqtt_telemetry_entry* wheel[2][MQTT_TELEMETRY_SLOTS];
+    // Last tick processed, counted from `start`
+    uint32_t current;
+    int64_t start;
+};
+
+void mqtt_telemetry_init(struct mqtt_telemetry* self, int64_t now);
+
+// First due one period from now, plus a tick for every entry added before
+// it so publishers sharing a period take turns. `period` in milliseconds.
+int mqtt_telemetry_add(struct mqtt_telemetry* self, const char* topic, uint32_t period,
+    mqtt_telemetry_publish_t publish, void* context);
+
+// Invoke every publisher due by `now`, each at most once however late.
+// Returns the number of publishers invoked.
+int mqtt_telemetry_run(struct mqtt_telemetry* self, struct mqtt_service* service, int64_t now);
+
+// Uptime at which the next publisher may be due, INT64_MAX if none
+int64_t mqtt_telemetry_next_deadline(const struct mqtt_telemetry* self);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,219 @@
+#include "mqtt_topic_trie.h"
+
+#include <string.h>
+
+#define MQTT_TOPIC_TRIE_ROOT 0
+#define MQTT_TOPIC_TRIE_EDGES (MQTT_TOPIC_TRIE_MAX_NODES * 2)
+
+static uint32_t _mqtt_topic_trie_hash(const uint8_t* data, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t _mqtt_topic_trie_edge_slot(uint16_t parent, uint32_t hash) {
+    return (hash ^ (parent * 2654435761U)) & (MQTT_TOPIC_TRIE_EDGES - 1);
+}
+
+static uint16_t _mqtt_topic_trie_alloc(struct mqtt_topic_trie* self, uint16_t parent,
+    const char* segment, size_t len, uint32_t hash)
+{
+    if (self->count >= MQTT_TOPIC_TRIE_MAX_NODES) {
+        return MQTT_TOPIC_TRIE_NONE;
+    }
+
+    uint16_t index = self->count++;
+    struct mqtt_topic_trie_node* node = &self->nodes[index];
+    node->segment = segment;
+    node->segment_len = len;
+    node->segment_hash = hash;
+    node->parent = parent;
+    node->plus = MQTT_TOPIC_TRIE_NONE;
+    node->hash = MQTT_TOPIC_TRIE_NONE;
+    node->handler = NULL;
+    node->stream = NULL;
+    node->context = NULL;
+    return index;
+}
+
+static uint16_t _mqtt_topic_trie_find(const struct mqtt_topic_trie* self, uint16_t parent,
+    const uint8_t* segment, size_t len, uint32_t hash)
+{
+    uint32_t slot = _mqtt_topic_trie_edge_slot(parent, hash);
+
+    for (size_t probe = 0; probe < MQTT_TOPIC_TRIE_EDGES; probe++) {
+        uint16_t index = self->edges[slot];
+        if (index == MQTT_TOPIC_TRIE_NONE) {
+            break;
+        }
+
+        const struct mqtt_topic_trie_node* node = &self->nodes[index];
+        if (node->parent == parent && node->segment_hash == hash &&
+            node->segment_len == len && memcmp(node->segment, segment, len) == 0) {
+            return index;
+        }
+
+        slot = (slot + 1) & (MQTT_TOPIC_TRIE_EDGES - 1);
+    }
+
+    return MQTT_TOPIC_TRIE_NONE;
+}
+
+static uint16_t _mqtt_topic_trie_child(struct mqtt_topic_trie* self, uint16_t parent,
+    const char* segment, size_t len)
+{
+    struct mqtt_topic_trie_node* node = &self->nodes[parent];
+
+    if (len == 1 && segment[0] == '+') {
+        if (node->plus == MQTT_TOPIC_TRIE_NONE) {
+            node->plus = _mqtt_topic_trie_alloc(self, parent, segment, len, 0);
+        }
+        return node->plus;
+    }
+
+    if (len == 1 && segment[0] == '#') {
+        if (node->hash == MQTT_TOPIC_TRIE_NONE) {
+            node->hash = _mqtt_topic_trie_alloc(self, parent, segment, len, 0);
+        }
+        return node->hash;
+    }
+
+    uint32_t hash = _mqtt_topic_trie_hash((const uint8_t*)segment, len);
+    uint16_t index = _mqtt_topic_trie_find(self, parent, (const uint8_t*)segment, len, hash);
+    if (index != MQTT_TOPIC_TRIE_NONE) {
+        return index;
+    }
+
+    index = _mqtt_topic_trie_alloc(self, parent, segment, len, hash);
+    if (index == MQTT_TOPIC_TRIE_NONE) {
+        return index;
+    }
+
+    // The edge table holds twice as many slots as there are nodes, so there
+    // is always a free slot to be found.
+    uint32_t slot = _mqtt_topic_trie_edge_slot(parent, hash);
+    while (self->edges[slot] != MQTT_TOPIC_TRIE_NONE) {
+        slot = (slot + 1) & (MQTT_TOPIC_TRIE_EDGES - 1);
+    }
+    self->edges[slot] = index;
+
+    return index;
+}
+
+void mqtt_topic_trie_init(struct mqtt_topic_trie* self) {
+    memset(self->edges, 0xFF, sizeof(self->edges));
+    self->count = 0;
+    _mqtt_topic_trie_alloc(self, MQTT_TOPIC_TRIE_NONE, "", 0, 0);
+}
+
+static bool _mqtt_topic_trie_bound(const struct mqtt_topic_trie* self, uint16_t index) {
+    return index != MQTT_TOPIC_TRIE_NONE &&
+        (self->nodes[index].handler != NULL || self->nodes[index].stream != NULL);
+}
+
+static int _mqtt_topic_trie_insert(struct mqtt_topic_trie* self, const char* filter,
+    mqtt_topic_handler_t handler, mqtt_topic_stream_handler_t stream, void* context)
+{
+    uint16_t index = MQTT_TOPIC_TRIE_ROOT;
+    const char* segment = filter;
+
+    while (1) {
+        const char* end = strchr(segment, '/');
+        size_t len = end ? (size_t)(end - segment) : strlen(segment);
+
+        // Wildcards must occupy a whole level and '#' must be the last one
+        if ((memchr(segment, '+', len) != NULL || memchr(segment, '#', len) != NULL) && len != 1) {
+            return -EINVAL;
+        }
+        if (len == 1 && segment[0] == '#' && end != NULL) {
+            return -EINVAL;
+        }
+
+        index = _mqtt_topic_trie_child(self, index, segment, len);
+        if (index == MQTT_TOPIC_TRIE_NONE) {
+            return -ENOSPC;
+        }
+
+        if (end == NULL) {
+            break;
+        }
+        segment = end + 1;
+    }
+
+    self->nodes[index].handler = handler;
+    self->nodes[index].stream = stream;
+    self->nodes[index].context = context;
+    return 0;
+}
+
+int mqtt_topic_trie_insert(struct mqtt_topic_trie* self, const char* filter,
+    mqtt_topic_handler_t handler, void* context)
+{
+    return _mqtt_topic_trie_insert(self, filter, handler, NULL, context);
+}
+
+int mqtt_topic_trie_insert_stream(struct mqtt_topic_trie* self, const char* filter,
+    mqtt_topic_stream_handler_t handler, void* context)
+{
+    return _mqtt_topic_trie_insert(self, filter, NULL, handler, context);
+}
+
+static uint16_t _mqtt_topic_trie_match(const struct mqtt_topic_trie* self, uint16_t index,
+    const uint8_t* topic, const uint8_t* end)
+{
+    const struct mqtt_topic_trie_node* node = &self->nodes[index];
+
+    // All levels consumed, "a/#" also matches its parent level "a"
+    if (topic > end) {
+        if (_mqtt_topic_trie_bound(self, index)) {
+            return index;
+        }
+        if (_mqtt_topic_trie_bound(self, node->hash)) {
+            return node->hash;
+        }
+        return MQTT_TOPIC_TRIE_NONE;
+    }
+
+    const uint8_t* sep = memchr(topic, '/', end - topic);
+    size_t len = (sep ? sep : end) - topic;
+    const uint8_t* next = topic + len + 1;
+
+    // Prefer the most specific match: literal, then '+', then '#'
+    uint32_t hash = _mqtt_topic_trie_hash(topic, len);
+    uint16_t child = _mqtt_topic_trie_find(self, index, topic, len, hash);
+    if (child != MQTT_TOPIC_TRIE_NONE) {
+        uint16_t match = _mqtt_topic_trie_match(self, child, next, end);
+        if (match != MQTT_TOPIC_TRIE_NONE) {
+            return match;
+        }
+    }
+
+    // Wildcards never match topics starting with '$' at the first level
+    if (index == MQTT_TOPIC_TRIE_ROOT && len > 0 && topic[0] == '$') {
+        return MQTT_TOPIC_TRIE_NONE;
+    }
+
+    if (node->plus != MQTT_TOPIC_TRIE_NONE) {
+        uint16_t match = _mqtt_topic_trie_match(self, node->plus, next, end);
+        if (match != MQTT_TOPIC_TRIE_NONE) {
+            return match;
+        }
+    }
+
+    if (_mqtt_topic_trie_bound(self, node->hash)) {
+        return node->hash;
+    }
+
+    return MQTT_TOPIC_TRIE_NONE;
+}
+
+const struct mqtt_topic_trie_node* mqtt_topic_trie_match(const struct mqtt_topic_trie* self,
+    const uint8_t* topic, size_t len)
+{
+    uint16_t index = _mqtt_topic_trie_match(self, MQTT_TOPIC_TRIE_ROOT, topic, topic + len);
+    return index != MQTT_TOPIC_TRIE_NONE ? &self->nodes[index] : NULL;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <zephyr.h>
+#include <net/mqtt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MQTT_TOPIC_TRIE_MAX_NODES CONFIG_MQTT_SERVICE_TRIE_NODES
+#define MQTT_TOPIC_TRIE_NONE 0xFFFF
+
+BUILD_ASSERT((MQTT_TOPIC_TRIE_MAX_NODES & (MQTT_TOPIC_TRIE_MAX_NODES - 1)) == 0 &&
+    MQTT_TOPIC_TRIE_MAX_NODES < MQTT_TOPIC_TRIE_NONE,
+    "CONFIG_MQTT_SERVICE_TRIE_NODES must be a power of two below 65535");
+
+struct mqtt_service;
+
+typedef int(*mqtt_topic_handler_t)(struct mqtt_service* service,
+    const struct mqtt_utf8* topic, size_t payload_len, void* context);
+
+struct mqtt_topic_chunk {
+    const uint8_t* data;
+    size_t len;
+    size_t offset;
+    size_t total;
+};
+
+typedef int(*mqtt_topic_stream_handler_t)(struct mqtt_service* service,
+    const struct mqtt_utf8* topic, const struct mqtt_topic_chunk* chunk, void* context);
+
+struct mqtt_topic_trie_node {
+    // Segment text, points into the registered topic filter
+    const char* segment;
+    uint16_t segment_len;
+    uint16_t parent;
+    uint32_t segment_hash;
+
+    // Wildcard children, literal children live in the edge table
+    uint16_t plus;
+    uint16_t hash;
+
+    // At most one of both handlers is set
+    mqtt_topic_handler_t handler;
+    mqtt_topic_stream_handler_t stream;
+    void* context;
+};
+
+// Topic filter trie with one level per topic segment.
+//
+// Literal children are found through an open addressing hash table keyed on
+// (parent, segment) so a lookup costs one probe per topic level regardless of
+// the number of registered filters. The `+` and `#` wildcards are stored as
+// direct child links on their parent node.
+struct mqtt_topic_trie {
+    struct mqtt_topic_trie_node nodes[MQTT_TOPIC_TRIE_MAX_NODES];
+    uint16_t edges[MQTT_TOPIC_TRIE_MAX_NODES * 2];
+    uint16_t count;
+};
+
+void mqtt_topic_trie_init(struct mqtt_topic_trie* self);
+
+// Bind `filter` to a handler, replacing any previous binding. Every topic
+// level not shared with an earlier filter takes a node. Returns -EINVAL for a
+// malformed filter and -ENOSPC once the nodes are used up, in which case the
+// levels added so far stay in the trie unbound.
+int mqtt_topic_trie_insert(struct mqtt_topic_trie* self, const char* filter,
+    mqtt_topic_handler_t handler, void* context);
+
+int mqtt_topic_trie_insert_stream(struct mqtt_topic_trie* self, const char* filter,
+    mqtt_topic_stream_handler_t handler, void* context);
+
+const struct mqtt_topic_trie_node* mqtt_topic_trie_match(const struct mqtt_topic_trie* self,
+    const uint8_t* topic, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
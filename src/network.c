@@ -5,107 +5,138 @@ LOG_MODULE_REGISTER(network, LOG_LEVEL_INF);
 #include <net/net_if.h>
 #include <net/net_mgmt.h>
 
+#include "readiness.h"
+
 #if !defined(CONFIG_NET_CONFIG_SETTINGS)
+#if defined(CONFIG_NET_DHCPV4)
+
+static void _network_init_ipv4(struct net_if* iface) {
+    LOG_INF("Starting dhcpv4 client...");
+    net_dhcpv4_start(iface);
+}
+
+#else
+
+static void _network_init_ipv4(struct net_if* iface) {
+    struct in_addr addr;
+
+    if (net_addr_pton(AF_INET, CONFIG_NET_CONFIG_MY_IPV4_ADDR, &addr)) {
+        LOG_ERR("Invalid address: %s", CONFIG_NET_CONFIG_MY_IPV4_ADDR);
+        return;
+    }
+
+    // Reported through NET_EVENT_IPV4_ADDR_ADD
+    net_if_ipv4_addr_add(iface, &addr, NET_ADDR_MANUAL, 0);
+
+    if (net_addr_pton(AF_INET, CONFIG_NET_CONFIG_MY_IPV4_GW, &addr)) {
+        LOG_ERR("Invalid gateway: %s", CONFIG_NET_CONFIG_MY_IPV4_GW);
+        return;
+    }
+
+    net_if_ipv4_set_gw(iface, &addr);
+}
+
+#endif
+#endif
+
+// Configure the address once the interface is up, once only: the DHCP client
+// restarts on its own and a static address stays assigned.
+static atomic_t _network_ipv4_started;
+static void _network_start_ipv4(struct net_if* iface) {
+#if !defined(CONFIG_NET_CONFIG_SETTINGS)
+    if (atomic_cas(&_network_ipv4_started, 0, 1)) {
+        _network_init_ipv4(iface);
+    }
+#endif
+}
+
+static void _network_log_ipv4(struct net_if* iface) {
+    char hr_addr[NET_IPV4_ADDR_LEN];
+
+    for (int i = 0; i < NET_IF_MAX_IPV4_ADDR; i++) {
+        struct net_if_addr *if_addr = &iface->config.ip.ipv4->unicast[i];
+        if (!if_addr->is_used) {
+            continue;
+        }
+
+        LOG_INF("IPv4 address: %s",
+            log_strdup(net_addr_ntop(AF_INET,
+                        &if_addr->address.in_addr,
+                        hr_addr, NET_IPV4_ADDR_LEN)));
+#if defined(CONFIG_NET_DHCPV4)
+        if (if_addr->addr_type == NET_ADDR_DHCP) {
+            LOG_INF("Lease time: %u seconds",
+                iface->config.dhcpv4.lease_time);
+        }
+#endif
+        LOG_INF("Subnet: %s",
+            log_strdup(net_addr_ntop(AF_INET,
+                        &iface->config.ip.ipv4->netmask,
+                        hr_addr, NET_IPV4_ADDR_LEN)));
+        LOG_INF("Gateway: %s",
+            log_strdup(net_addr_ntop(AF_INET,
+                        &iface->config.ip.ipv4->gw,
+                        hr_addr, NET_IPV4_ADDR_LEN)));
+        break;
+    }
+}
+
+static bool _network_has_ipv4(struct net_if* iface) {
+    return net_if_ipv4_get_global_addr(iface, NET_ADDR_PREFERRED) != NULL;
+}
 
 static struct net_mgmt_event_callback _network_l2_event_cb;
 static void _network_l2_event_handler(struct net_mgmt_event_callback *cb, uint32_t event, struct net_if *iface) {
     switch (event) {
         case NET_EVENT_IF_UP: {
             LOG_INF("Interface: %s up", log_strdup(iface->if_dev->dev->name));
+            readiness_set(READINESS_NET_IF_UP);
+            _network_start_ipv4(iface);
         } return;
 
         case NET_EVENT_IF_DOWN: {
             LOG_INF("Interface: %s down", log_strdup(iface->if_dev->dev->name));
+            readiness_clear(READINESS_NET_IF_UP | READINESS_NET_ADDR);
         } return;
     }
 }
 
-#if defined(CONFIG_NET_DHCPV4)
-
 static struct net_mgmt_event_callback _network_l3_event_cb;
 static void _network_l3_event_handler(struct net_mgmt_event_callback *cb, uint32_t event, struct net_if *iface) {
     switch (event) {
         case NET_EVENT_IPV4_ADDR_ADD: {
-            char hr_addr[NET_IPV4_ADDR_LEN];
-            int i = 0;
-
-            for (i = 0; i < NET_IF_MAX_IPV4_ADDR; i++) {
-                struct net_if_addr *if_addr = &iface->config.ip.ipv4->unicast[i];
-                if (if_addr->addr_type != NET_ADDR_DHCP || !if_addr->is_used) {
-                    continue;
-                }
-
-                LOG_INF("IPv4 address: %s",
-                    log_strdup(net_addr_ntop(AF_INET,
-                                &if_addr->address.in_addr,
-                                hr_addr, NET_IPV4_ADDR_LEN)));
-                LOG_INF("Lease time: %u seconds",
-                    iface->config.dhcpv4.lease_time);
-                LOG_INF("Subnet: %s",
-                    log_strdup(net_addr_ntop(AF_INET,
-                                &iface->config.ip.ipv4->netmask,
-                                hr_addr, NET_IPV4_ADDR_LEN)));
-                LOG_INF("Gateway: %s",
-                    log_strdup(net_addr_ntop(AF_INET,
-                                &iface->config.ip.ipv4->gw,
-                                hr_addr, NET_IPV4_ADDR_LEN)));
-                break;
+            _network_log_ipv4(iface);
+            readiness_set(READINESS_NET_ADDR);
+        } return;
+
+        case NET_EVENT_IPV4_ADDR_DEL: {
+            if (!_network_has_ipv4(iface)) {
+                LOG_INF("IPv4 address lost");
+                readiness_clear(READINESS_NET_ADDR);
             }
         } return;
     }
 }
 
-static void _network_init_ipv4(struct net_if* iface) {
-	net_mgmt_init_event_callback(&_network_l3_event_cb, _network_l3_event_handler, NET_EVENT_IPV4_ADDR_ADD);
-	net_mgmt_add_event_callback(&_network_l3_event_cb);
-
-    LOG_INF("Starting dhcpv4 client...");
-    net_dhcpv4_start(iface);
-
-    LOG_INF("Waiting for IPv4 address to be assigned...");
-    net_mgmt_event_wait_on_iface(iface, NET_EVENT_IPV4_ADDR_ADD, NULL, NULL, NULL, K_FOREVER);
-}
-
-#else
-
-static void _network_init_ipv4(struct net_if* iface) {
-    char hr_addr[NET_IPV4_ADDR_LEN];
-	struct in_addr addr;
-
-	if (net_addr_pton(AF_INET, CONFIG_NET_CONFIG_MY_IPV4_ADDR, &addr)) {
-		LOG_ERR("Invalid address: %s", CONFIG_NET_CONFIG_MY_IPV4_ADDR);
-		return;
-	}
-
-	net_if_ipv4_addr_add(iface, &addr, NET_ADDR_MANUAL, 0);
-	LOG_INF("IPv4 address: %s",
-		log_strdup(net_addr_ntop(AF_INET, &addr, hr_addr,
-					 NET_IPV4_ADDR_LEN)));
-
-	if (net_addr_pton(AF_INET, CONFIG_NET_CONFIG_MY_IPV4_GW, &addr)) {
-		LOG_ERR("Invalid gateway: %s", CONFIG_NET_CONFIG_MY_IPV4_GW);
-		return;
-	}
-
-    net_if_ipv4_set_gw(iface, &addr);
-    LOG_INF("Gateway: %s",
-        log_strdup(net_addr_ntop(AF_INET,
-                    &iface->config.ip.ipv4->gw,
-                    hr_addr, NET_IPV4_ADDR_LEN)));
-}
-
-#endif
-#endif
-
+// Returns right away, progress is reported through the READINESS_NET_*
+// events as the interface comes up and gets its address.
 void network_init() {
-#if !defined(CONFIG_NET_CONFIG_SETTINGS)
-	net_mgmt_init_event_callback(&_network_l2_event_cb, _network_l2_event_handler, NET_EVENT_IF_UP | NET_EVENT_IF_DOWN);
-	net_mgmt_add_event_callback(&_network_l2_event_cb);
-
+    net_mgmt_init_event_callback(&_network_l2_event_cb, _network_l2_event_handler, NET_EVENT_IF_UP | NET_EVENT_IF_DOWN);
+    net_mgmt_add_event_callback(&_network_l2_event_cb);
+    net_mgmt_init_event_callback(&_network_l3_event_cb, _network_l3_event_handler,
+        NET_EVENT_IPV4_ADDR_ADD | NET_EVENT_IPV4_ADDR_DEL);
+    net_mgmt_add_event_callback(&_network_l3_event_cb);
+
+    // The interface may well be up, even configured, before the callbacks
+    // were in place.
     struct net_if* iface = net_if_get_default();
-    LOG_INF("Waiting for interface %s to be up...", log_strdup(iface->if_dev->dev->name));
-    net_mgmt_event_wait_on_iface(iface, NET_EVENT_IF_UP, NULL, NULL, NULL, K_FOREVER);
-
-    _network_init_ipv4(iface);
-#endif
-}
\ No newline at end of file
+    if (net_if_is_up(iface)) {
+        readiness_set(READINESS_NET_IF_UP);
+        _network_start_ipv4(iface);
+    } else {
+        LOG_INF("Waiting for interface %s to be up...", log_strdup(iface->if_dev->dev->name));
+    }
+    if (_network_has_ipv4(iface)) {
+        readiness_set(READINESS_NET_ADDR);
+    }
+}
@@ -0,0 +1,166 @@
+#include "readiness.h"
+
+#include <sys/slist.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(readiness, LOG_LEVEL_INF);
+
+// A thread blocked in readiness_wait(), woken on every change
+struct _readiness_waiter {
+    sys_snode_t node;
+    struct k_sem changed;
+};
+
+static K_MUTEX_DEFINE(_readiness_lock);
+static sys_slist_t _readiness_waiters = SYS_SLIST_STATIC_INIT(&_readiness_waiters);
+
+static uint32_t _readiness_events;
+static int64_t _readiness_timestamps[READINESS_EVENT_COUNT] = { -1, -1, -1, -1 };
+
+static struct {
+    readiness_listener_t listener;
+    void* context;
+} _readiness_listeners[READINESS_MAX_LISTENERS];
+static size_t _readiness_listener_count;
+
+static const char* const _readiness_names[READINESS_EVENT_COUNT] = {
+    "interface up",
+    "address assigned",
+    "connected",
+    "subscribed",
+};
+
+static int _readiness_index(enum readiness_event event) {
+    for (int i = 0; i < READINESS_EVENT_COUNT; i++) {
+        if (event == BIT(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void _readiness_update(uint32_t set, uint32_t clear) {
+    int64_t now = k_uptime_get();
+
+    k_mutex_lock(&_readiness_lock, K_FOREVER);
+    uint32_t previous = _readiness_events;
+    _readiness_events = (_readiness_events & ~clear) | set;
+    uint32_t events = _readiness_events;
+
+    for (int i = 0; i < READINESS_EVENT_COUNT; i++) {
+        if ((set & BIT(i)) && _readiness_timestamps[i] < 0) {
+            _readiness_timestamps[i] = now;
+            LOG_INF("Boot phase: %s at %u ms", _readiness_names[i], (uint32_t)now);
+        }
+    }
+    size_t listener_count = _readiness_listener_count;
+    if (events != previous) {
+        sys_snode_t* node;
+        while ((node = sys_slist_get(&_readiness_waiters)) != NULL) {
+            k_sem_give(&CONTAINER_OF(node, struct _readiness_waiter, node)->changed);
+        }
+    }
+    k_mutex_unlock(&_readiness_lock);
+
+    // Outside of the lock, listeners may query the events themselves
+    for (size_t i = 0; events != previous && i < listener_count; i++) {
+        _readiness_listeners[i].listener(events, _readiness_listeners[i].context);
+    }
+}
+
+void readiness_set(uint32_t events) {
+    _readiness_update(events, 0);
+}
+
+void readiness_clear(uint32_t events) {
+    _readiness_update(0, events);
+}
+
+uint32_t readiness_get(void) {
+    k_mutex_lock(&_readiness_lock, K_FOREVER);
+    uint32_t events = _readiness_events;
+    k_mutex_unlock(&_readiness_lock);
+    return events;
+}
+
+int readiness_wait(uint32_t events, k_timeout_t timeout) {
+    int64_t end = K_TIMEOUT_EQ(timeout, K_FOREVER) ? INT64_MAX : k_uptime_get() + k_ticks_to_ms_ceil64(timeout.ticks);
+    int rc = 0;
+    struct _readiness_waiter waiter;
+
+    k_sem_init(&waiter.changed, 0, 1);
+
+    k_mutex_lock(&_readiness_lock, K_FOREVER);
+    while ((_readiness_events & events) != events) {
+        int64_t remaining = end - k_uptime_get();
+        if (remaining <= 0) {
+            rc = -EAGAIN;
+            break;
+        }
+
+        // Queued under the lock so no change can slip in before sleeping
+        sys_slist_append(&_readiness_waiters, &waiter.node);
+        k_mutex_unlock(&_readiness_lock);
+        k_sem_take(&waiter.changed, end == INT64_MAX ? K_FOREVER : K_MSEC(remaining));
+        k_mutex_lock(&_readiness_lock, K_FOREVER);
+
+        // Still queued when the wait timed out
+        sys_slist_find_and_remove(&_readiness_waiters, &waiter.node);
+    }
+    k_mutex_unlock(&_readiness_lock);
+
+    return rc;
+}
+
+int readiness_add_listener(readiness_listener_t listener, void* context) {
+    if (listener == NULL) {
+        return -EINVAL;
+    }
+
+    int rc = 0;
+
+    k_mutex_lock(&_readiness_lock, K_FOREVER);
+    if (_readiness_listener_count >= READINESS_MAX_LISTENERS) {
+        rc = -ENOMEM;
+    } else {
+        _readiness_listeners[_readiness_listener_count].listener = listener;
+        _readiness_listeners[_readiness_listener_count].context = context;
+        _readiness_listener_count++;
+    }
+    k_mutex_unlock(&_readiness_lock);
+
+    return rc;
+}
+
+int64_t readiness_timestamp(enum readiness_event event) {
+    int index = _readiness_index(event);
+    if (index < 0) {
+        return -1;
+    }
+
+    k_mutex_lock(&_readiness_lock, K_FOREVER);
+    int64_t timestamp = _readiness_timestamps[index];
+    k_mutex_unlock(&_readiness_lock);
+    return timestamp;
+}
+
+const char* readiness_event_name(enum readiness_event event) {
+    int index = _readiness_index(event);
+    return index < 0 ? "unknown" : _readiness_names[index];
+}
+
+void readiness_log_timing(void) {
+    int64_t previous = 0;
+
+    for (int i = 0; i < READINESS_EVENT_COUNT; i++) {
+        int64_t timestamp = readiness_timestamp(BIT(i));
+        if (timestamp < 0) {
+            LOG_INF("%s: not reached", _readiness_names[i]);
+            continue;
+        }
+        // Logging arguments are 32 bit wide
+        LOG_INF("%s: %u ms (+%u ms)", _readiness_names[i],
+            (uint32_t)timestamp, (uint32_t)(timestamp - previous));
+        previous = timestamp;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define READINESS_MAX_LISTENERS 4
+
+// Milestones of the startup, each set once reached and cleared when lost
+enum readiness_event {
+    // Set by network.c
+    READINESS_NET_IF_UP = BIT(0),
+    READINESS_NET_ADDR = BIT(1),
+    // Set by the MQTT service once the session is restored after CONNACK,
+    // then once every subscription has been acknowledged
+    READINESS_MQTT_CONNECTED = BIT(2),
+    READINESS_MQTT_SUBSCRIBED = BIT(3),
+};
+
+#define READINESS_EVENT_COUNT 4
+
+// Invoked from the thread setting or clearing events, with all events now set
+typedef void(*readiness_listener_t)(uint32_t events, void* context);
+
+// Set or clear `events`, waking everything waiting on them. The first time an
+// event is set is kept as its boot phase timestamp. May not be called from
+// ISR context.
+void readiness_set(uint32_t events);
+void readiness_clear(uint32_t events);
+
+uint32_t readiness_get(void);
+
+static inline bool readiness_test(uint32_t events) {
+    return (readiness_get() & events) == events;
+}
+
+// Wait until all of `events` are set, returns 0 or -EAGAIN on timeout
+int readiness_wait(uint32_t events, k_timeout_t timeout);
+
+// Called on every change, up to READINESS_MAX_LISTENERS
+int readiness_add_listener(readiness_listener_t listener, void* context);
+
+// Uptime in milliseconds at which `event` was first set, -1 if never
+int64_t readiness_timestamp(enum readiness_event event);
+
+const char* readiness_event_name(enum readiness_event event);
+
+// Log the time each event was first reached and the duration of each phase
+void readiness_log_timing(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,82 @@
+#include "trace.h"
+
+uint16_t trace_hash(const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return (uint16_t)((hash >> 16) ^ hash);
+}
+
+#if defined(CONFIG_PCU_TRACE)
+
+static struct trace_record _trace_ring[TRACE_SIZE];
+// Records written since boot and index of the first one not cleared
+static uint32_t _trace_head;
+static uint32_t _trace_start;
+
+void trace_write(uint8_t event, uint8_t arg0, uint16_t arg1, uint32_t arg2) {
+    // Timestamped under the lock, so records are in time order
+    unsigned int key = irq_lock();
+    struct trace_record* record = &_trace_ring[_trace_head++ & (TRACE_SIZE - 1)];
+    record->timestamp = k_cycle_get_32();
+    record->event = event;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+    record->arg2 = arg2;
+    irq_unlock(key);
+}
+
+uint32_t trace_first(void) {
+    unsigned int key = irq_lock();
+    uint32_t first = _trace_head > TRACE_SIZE ? _trace_head - TRACE_SIZE : 0;
+    first = MAX(first, _trace_start);
+    irq_unlock(key);
+    return first;
+}
+
+uint32_t trace_head(void) {
+    unsigned int key = irq_lock();
+    uint32_t head = _trace_head;
+    irq_unlock(key);
+    return head;
+}
+
+bool trace_get(uint32_t index, struct trace_record* record) {
+    bool valid;
+
+    unsigned int key = irq_lock();
+    valid = index < _trace_head && _trace_head - index <= TRACE_SIZE && index >= _trace_start;
+    if (valid) {
+        *record = _trace_ring[index & (TRACE_SIZE - 1)];
+    }
+    irq_unlock(key);
+
+    return valid;
+}
+
+void trace_clear(void) {
+    unsigned int key = irq_lock();
+    _trace_start = _trace_head;
+    irq_unlock(key);
+}
+
+#else
+
+uint32_t trace_first(void) {
+    return 0;
+}
+
+uint32_t trace_head(void) {
+    return 0;
+}
+
+bool trace_get(uint32_t index, struct trace_record* record) {
+    return false;
+}
+
+void trace_clear(void) {
+}
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <zephyr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Numbering is shared with trace.py, only ever append
+enum trace_event {
+    // arg0: new state, arg1: connection attempt
+    TRACE_MQTT_STATE = 1,
+    // arg0: session present, arg2: result
+    TRACE_MQTT_CONNACK = 2,
+    // arg2: result
+    TRACE_MQTT_DISCONNECT = 3,
+    // arg0: QoS, arg1: message id, arg2: topic hash << 16 | payload length
+    TRACE_MQTT_PUBLISH_IN = 4,
+    // Encoded for sending, same as above with 0x80 set in arg0 when resent
+    TRACE_MQTT_PUBLISH_OUT = 5,
+    // arg1: message id
+    TRACE_MQTT_PUBACK = 6,
+    TRACE_MQTT_PUBREC = 7,
+    TRACE_MQTT_PUBREL = 8,
+    TRACE_MQTT_PUBCOMP = 9,
+    TRACE_MQTT_SUBACK = 10,
+    TRACE_MQTT_UNSUBACK = 11,
+    // arg2: result
+    TRACE_MQTT_PINGRESP = 12,
+    // arg0: QoS, arg1: message id of the PUBACK/PUBREC sent
+    TRACE_MQTT_ACK_OUT = 13,
+    // arg0: lane, arg1: message id
+    TRACE_MQTT_DISPATCH = 14,
+    // arg1: message id, arg2: handler result
+    TRACE_MQTT_HANDLED = 15,
+    // arg0: pin, arg1: value
+    TRACE_GPIO_IRQ = 16,
+    // arg0: pin, arg1: value, arg2: edges since the last run
+    TRACE_GPIO_DEFERRED = 17,
+};
+
+// 12 bytes, the timestamp is a cycle count
+struct trace_record {
+    uint32_t timestamp;
+    uint8_t event;
+    uint8_t arg0;
+    uint16_t arg1;
+    uint32_t arg2;
+};
+
+#if defined(CONFIG_PCU_TRACE)
+
+#define TRACE_SIZE CONFIG_PCU_TRACE_SIZE
+
+BUILD_ASSERT((TRACE_SIZE & (TRACE_SIZE - 1)) == 0, "CONFIG_PCU_TRACE_SIZE must be a power of two");
+
+#define TRACE(event, arg0, arg1, arg2) \
+    trace_write((event), (uint8_t)(arg0), (uint16_t)(arg1), (uint32_t)(arg2))
+
+// Append a record, overwriting the oldest one once the ring is full. Costs
+// a cycle count read and a dozen stores with interrupts locked, safe from
+// ISR context.
+void trace_write(uint8_t event, uint8_t arg0, uint16_t arg1, uint32_t arg2);
+
+#else
+
+#define TRACE(event, arg0, arg1, arg2) \
+    do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+
+#endif
+
+// 16 bit FNV-1a of a topic, for the decoder to map back to topic names
+uint16_t trace_hash(const void* data, size_t len);
+
+// Records are numbered from 0 since boot. Those from trace_first() up to,
+// but excluding, trace_head() can be read, unless overwritten meanwhile.
+uint32_t trace_first(void);
+uint32_t trace_head(void);
+bool trace_get(uint32_t index, struct trace_record* record);
+
+// Forget the records written so far
+void trace_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
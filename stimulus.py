@@ -1,20 +1,84 @@
-import os, sys, re
+import os, sys, re, struct
 from urllib.parse import urlparse
 import paho.mqtt.client as mosquitto
 
 re_io_peripheral = r"^dev/(?P<dev>[\w\d]+)/uuid/(?P<uuid>[\da-f\-]+)/(?P<dir>in|out)/(?P<peripheral>[\w]+)/(?P<index>\d+)$"
+re_io_group = r"^dev/(?P<dev>[\w\d]+)/uuid/(?P<uuid>[\da-f\-]+)/(?P<dir>in|out)/group/(?P<peripheral>[\w]+)$"
+re_alias_map = r"^(?P<prefix>a/[^/]+)/map/(?P<alias>\d+)$"
+re_capture = r"^dev/(?P<dev>[\w\d]+)/uuid/(?P<uuid>[\da-f\-]+)/in/capture$"
+
+CAPTURE_HEADER = struct.Struct("<BBHHII")
+
+def decode_capture(payload):
+    # See src/capture_frame.h: returns the header fields and a list of
+    # (seconds since the first event, channel, value).
+    version, count, seq, dropped, frequency, base = CAPTURE_HEADER.unpack_from(payload)
+    if version != 1:
+        raise ValueError("unknown capture frame version {}".format(version))
+
+    events = []
+    offset = CAPTURE_HEADER.size
+    elapsed = 0
+    for _ in range(count):
+        zigzag, shift = 0, 0
+        while True:
+            byte = payload[offset]
+            offset += 1
+            zigzag |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        elapsed += (zigzag >> 1) ^ -(zigzag & 1)
+        events.append((elapsed / frequency, payload[offset] >> 1, payload[offset] & 1))
+        offset += 1
+
+    return seq, dropped, events
+
+# Topic aliases announced by the devices: alias topic -> full topic, and full
+# topic -> topic to send commands for it on.
+aliases = {}
+commands = {}
+
+def publish(mqttc, topic, payload, qos=0):
+    mqttc.publish(commands.get(topic, topic), payload, qos=qos)
 
 def on_message(mqttc, obj, msg):
-    match = re.match(re_io_peripheral, msg.topic)
+    match = re.match(re_alias_map, msg.topic)
+    if match:
+        topic = msg.payload.decode()
+        aliases["{prefix}/{alias}".format(**match.groupdict())] = topic
+        commands[topic] = "{prefix}/cmd/{alias}".format(**match.groupdict())
+        print("alias " + msg.topic + " " + topic)
+        return
+
+    topic = aliases.get(msg.topic, msg.topic)
+
+    if re.match(re_capture, topic):
+        seq, dropped, events = decode_capture(msg.payload)
+        print("{} seq {} ({} dropped)".format(topic, seq, dropped))
+        for t, channel, value in events:
+            print("  {:12.6f} sw/{} {}".format(t, channel, value))
+        return
+
+    # Channel frames (see src/channel_frame.h) map switch n onto LED n as is
+    match = re.match(re_io_group, topic)
+    if match:
+        print(topic + " " + str(msg.qos) + " " + msg.payload.hex())
+        if match.group("peripheral") == "sw":
+            dest_topic = "dev/{dev}/uuid/{uuid}/out/group/led".format(**match.groupdict())
+            publish(mqttc, dest_topic, msg.payload, qos=1)
+        return
+
+    match = re.match(re_io_peripheral, topic)
     if not match:
         print("Invalid topic format")
         return
 
-    print(msg.topic + " " + str(msg.qos) + " " + str(msg.payload))
+    print(topic + " " + str(msg.qos) + " " + str(msg.payload))
 
     if match.group("peripheral") == "sw":
         dest_topic = "dev/{dev}/uuid/{uuid}/out/led/{index}".format(**match.groupdict())
-        mqttc.publish(dest_topic, msg.payload)
+        publish(mqttc, dest_topic, msg.payload)
 
 if __name__ == "__main__":
     mqttc = mosquitto.Client()
@@ -27,6 +91,10 @@ if __name__ == "__main__":
 
     mqttc.connect(url.hostname, url.port)
     mqttc.subscribe('dev/pcu/uuid/+/in/sw/+')
+    mqttc.subscribe('dev/pcu/uuid/+/in/group/sw')
+    mqttc.subscribe('dev/pcu/uuid/+/in/capture')
+    mqttc.subscribe('a/+/map/+')
+    mqttc.subscribe('a/+/+')
 
     rc = 0
     while rc == 0:
@@ -0,0 +1,221 @@
+#include <ztest.h>
+#include <string.h>
+
+#include "mqtt_store.h"
+
+static struct mqtt_store_ram store;
+
+// Messages are told apart by their first payload byte
+static void _msg_init(struct mqtt_queue_msg* msg, uint8_t seq) {
+    memset(msg, 0, sizeof(*msg));
+    msg->qos = 1;
+    msg->topic_len = 1;
+    msg->topic[0] = 't';
+    msg->payload_len = 1;
+    msg->payload[0] = seq;
+}
+
+static void _append(struct mqtt_store* base, uint8_t seq) {
+    struct mqtt_queue_msg msg;
+    _msg_init(&msg, seq);
+    zassert_equal(mqtt_store_append(base, &msg), 0, "append %u", seq);
+}
+
+static void _expect_next(struct mqtt_store* base, uint8_t seq) {
+    struct mqtt_queue_msg msg;
+    zassert_equal(mqtt_store_peek(base, &msg), 0, "peek %u", seq);
+    zassert_equal(msg.payload[0], seq, "expected %u, got %u", seq, msg.payload[0]);
+    zassert_equal(mqtt_store_pop(base), 0, "pop %u", seq);
+}
+
+static void _setup(void) {
+    mqtt_store_ram_init(&store);
+}
+
+static void test_ram_order(void) {
+    struct mqtt_store* base = &store.base;
+    struct mqtt_queue_msg msg;
+
+    zassert_equal(mqtt_store_peek(base, &msg), -ENOENT, "empty store");
+    zassert_equal(mqtt_store_pop(base), -ENOENT, "empty store");
+
+    _append(base, 1);
+    _append(base, 2);
+    _append(base, 3);
+    zassert_equal(mqtt_store_count(base), 3, NULL);
+
+    _expect_next(base, 1);
+    _expect_next(base, 2);
+    _expect_next(base, 3);
+    zassert_equal(mqtt_store_count(base), 0, NULL);
+}
+
+static void _complete(struct mqtt_service* service, uint16_t message_id, int result, void* context) {
+}
+
+static void test_ram_keeps_completion(void) {
+    struct mqtt_store* base = &store.base;
+    struct mqtt_queue_msg msg;
+    int context;
+
+    _msg_init(&msg, 1);
+    msg.complete = _complete;
+    msg.context = &context;
+    zassert_equal(mqtt_store_append(base, &msg), 0, NULL);
+
+    memset(&msg, 0, sizeof(msg));
+    zassert_equal(mqtt_store_peek(base, &msg), 0, NULL);
+    zassert_equal_ptr(msg.complete, _complete, NULL);
+    zassert_equal_ptr(msg.context, &context, NULL);
+    zassert_false(base->persistent, NULL);
+}
+
+static void test_ram_evicts_oldest(void) {
+    struct mqtt_store* base = &store.base;
+
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE + 2; i++) {
+        _append(base, i);
+    }
+    zassert_equal(mqtt_store_count(base), MQTT_STORE_RAM_SIZE, NULL);
+    zassert_equal(base->evicted, 2, NULL);
+
+    for (uint8_t i = 2; i < MQTT_STORE_RAM_SIZE + 2; i++) {
+        _expect_next(base, i);
+    }
+    zassert_equal(mqtt_store_count(base), 0, NULL);
+}
+
+static void test_ram_wraps(void) {
+    struct mqtt_store* base = &store.base;
+
+    // Around the ring several times, then across the 32 bit positions
+    for (int round = 0; round < 2; round++) {
+        uint8_t seq = 0;
+        for (int i = 0; i < MQTT_STORE_RAM_SIZE * 3; i++) {
+            _append(base, seq + 1);
+            _append(base, seq + 2);
+            _expect_next(base, seq + 1);
+            _expect_next(base, seq + 2);
+            seq += 2;
+        }
+        zassert_equal(mqtt_store_count(base), 0, NULL);
+
+        store.head = UINT32_MAX - 1;
+        store.tail = UINT32_MAX - 1;
+    }
+
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE; i++) {
+        _append(base, i);
+    }
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE; i++) {
+        _expect_next(base, i);
+    }
+}
+
+struct drain_log {
+    uint8_t seqs[MQTT_STORE_RAM_SIZE];
+    size_t count;
+    // Answer for each message after the first `take` taken
+    size_t take;
+    int rc;
+};
+
+static int _drain(const struct mqtt_queue_msg* msg, void* context) {
+    struct drain_log* log = context;
+    if (log->count >= log->take) {
+        return log->rc;
+    }
+    log->seqs[log->count++] = msg->payload[0];
+    return 0;
+}
+
+static void test_drain_batches(void) {
+    struct mqtt_store* base = &store.base;
+    struct drain_log log = { .count = 0, .take = SIZE_MAX };
+
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE; i++) {
+        _append(base, i);
+    }
+
+    zassert_equal(mqtt_store_drain(base, 3, _drain, &log), 3, NULL);
+    zassert_equal(mqtt_store_count(base), MQTT_STORE_RAM_SIZE - 3, NULL);
+    zassert_equal(mqtt_store_drain(base, MQTT_STORE_RAM_SIZE, _drain, &log), MQTT_STORE_RAM_SIZE - 3, NULL);
+    zassert_equal(mqtt_store_count(base), 0, NULL);
+
+    zassert_equal(log.count, MQTT_STORE_RAM_SIZE, NULL);
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE; i++) {
+        zassert_equal(log.seqs[i], i, NULL);
+    }
+}
+
+static void test_drain_stops_when_full(void) {
+    struct mqtt_store* base = &store.base;
+    struct drain_log log = { .count = 0, .take = 1, .rc = -EAGAIN };
+
+    _append(base, 1);
+    _append(base, 2);
+
+    // The message refused is left for the next drain
+    zassert_equal(mqtt_store_drain(base, 8, _drain, &log), 1, NULL);
+    zassert_equal(mqtt_store_count(base), 1, NULL);
+    _expect_next(base, 2);
+}
+
+static void test_drain_drops_rejected(void) {
+    struct mqtt_store* base = &store.base;
+    struct drain_log log = { .count = 0, .take = 0, .rc = -EMSGSIZE };
+
+    _append(base, 1);
+    _append(base, 2);
+
+    zassert_equal(mqtt_store_drain(base, 8, _drain, &log), 0, NULL);
+    zassert_equal(mqtt_store_count(base), 0, NULL);
+    zassert_equal(base->discarded, 0, NULL);
+}
+
+// RAM store whose records with an odd first payload byte cannot be read
+static const struct mqtt_store_api* ram_api;
+static struct mqtt_store_api faulty_api;
+
+static int _faulty_peek(struct mqtt_store* base, struct mqtt_queue_msg* msg) {
+    int rc = ram_api->peek(base, msg);
+    if (rc == 0 && (msg->payload[0] & 1)) {
+        return -EBADMSG;
+    }
+    return rc;
+}
+
+static void test_drain_skips_unreadable(void) {
+    struct mqtt_store* base = &store.base;
+    struct drain_log log = { .count = 0, .take = SIZE_MAX };
+
+    ram_api = base->api;
+    faulty_api = *ram_api;
+    faulty_api.peek = _faulty_peek;
+    base->api = &faulty_api;
+
+    for (uint8_t i = 0; i < MQTT_STORE_RAM_SIZE; i++) {
+        _append(base, i);
+    }
+
+    // Unreadable records neither stop the drain nor count against the batch
+    zassert_equal(mqtt_store_drain(base, MQTT_STORE_RAM_SIZE, _drain, &log), MQTT_STORE_RAM_SIZE / 2, NULL);
+    zassert_equal(mqtt_store_count(base), 0, NULL);
+    zassert_equal(base->discarded, MQTT_STORE_RAM_SIZE / 2, NULL);
+    for (size_t i = 0; i < log.count; i++) {
+        zassert_equal(log.seqs[i], i * 2, NULL);
+    }
+}
+
+void test_main(void) {
+    ztest_test_suite(mqtt_store,
+        ztest_unit_test_setup_teardown(test_ram_order, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_ram_keeps_completion, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_ram_evicts_oldest, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_ram_wraps, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_drain_batches, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_drain_stops_when_full, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_drain_drops_rejected, _setup, unit_test_noop),
+        ztest_unit_test_setup_teardown(test_drain_skips_unreadable, _setup, unit_test_noop));
+    ztest_run_test_suite(mqtt_store);
+}
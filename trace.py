@@ -0,0 +1,99 @@
+import sys, re, argparse
+
+# Renders the output of "mqtt trace dump" as a timeline, see src/trace.h for
+# the record layout and the event numbers.
+
+re_header = re.compile(r"trace 1 (?P<frequency>\d+) (?P<first>\d+) (?P<head>\d+)")
+re_record = re.compile(r"(?P<timestamp>[0-9a-f]{8}) (?P<event>[0-9a-f]{2}) (?P<arg0>[0-9a-f]{2}) "
+                       r"(?P<arg1>[0-9a-f]{4}) (?P<arg2>[0-9a-f]{8})")
+re_escape = re.compile(r"\x1b\[[0-9;]*[A-Za-z]")
+
+STATES = {0: "disconnected", 1: "connected", 2: "connecting"}
+
+def signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+def publish(arg0, arg1, arg2, topics):
+    topic_hash, length = arg2 >> 16, arg2 & 0xffff
+    topic = topics.get(topic_hash, "#{:04x}".format(topic_hash))
+    text = "qos={} id={} len={} topic={}".format(arg0 & 0x03, arg1, length, topic)
+    return text + " dup" if arg0 & 0x80 else text
+
+def message_id(arg0, arg1, arg2, topics):
+    return "id={}".format(arg1)
+
+def result(arg0, arg1, arg2, topics):
+    return "result={}".format(signed(arg2))
+
+EVENTS = {
+    1: ("state", lambda a0, a1, a2, t: "{} attempt={}".format(STATES.get(a0, a0), a1)),
+    2: ("CONNACK", lambda a0, a1, a2, t: "session={} result={}".format(a0, signed(a2))),
+    3: ("DISCONNECT", result),
+    4: ("PUBLISH in", publish),
+    5: ("PUBLISH out", publish),
+    6: ("PUBACK in", message_id),
+    7: ("PUBREC in", message_id),
+    8: ("PUBREL in", message_id),
+    9: ("PUBCOMP in", message_id),
+    10: ("SUBACK", message_id),
+    11: ("UNSUBACK", message_id),
+    12: ("PINGRESP", result),
+    13: ("ack out", lambda a0, a1, a2, t: "qos={} id={}".format(a0, a1)),
+    14: ("dispatch", lambda a0, a1, a2, t: "lane={} id={}".format(a0, a1)),
+    15: ("handled", lambda a0, a1, a2, t: "id={} result={}".format(a1, signed(a2))),
+    16: ("GPIO irq", lambda a0, a1, a2, t: "pin={} value={}".format(a0, a1)),
+    17: ("GPIO deferred", lambda a0, a1, a2, t: "pin={} value={} edges={}".format(a0, a1, a2)),
+}
+
+def trace_hash(topic):
+    # Same as trace_hash() in src/trace.c
+    value = 2166136261
+    for byte in topic.encode():
+        value = ((value ^ byte) * 16777619) & 0xffffffff
+    return ((value >> 16) ^ value) & 0xffff
+
+def parse(lines):
+    # Returns the cycle frequency, the number of records lost before the
+    # dump and the records, from the last dump found in `lines`.
+    dump = None
+    for line in lines:
+        line = re_escape.sub("", line).strip()
+        match = re_header.search(line)
+        if match:
+            dump = (int(match.group("frequency")), int(match.group("first")), [])
+            continue
+        match = re_record.search(line)
+        if match and dump is not None:
+            dump[2].append(tuple(int(v, 16) for v in match.groups()))
+
+    if dump is None:
+        raise ValueError("no trace dump found")
+    return dump
+
+def render(frequency, records, topics, out=sys.stdout):
+    # Cycle counts are 32 bit, unwrap them assuming records are in order and
+    # less than a full wrap apart.
+    elapsed, previous_cycles, previous_time = 0, None, 0.0
+    for timestamp, event, arg0, arg1, arg2 in records:
+        if previous_cycles is not None:
+            elapsed += (timestamp - previous_cycles) & 0xffffffff
+        previous_cycles = timestamp
+
+        time = elapsed * 1000.0 / frequency
+        name, describe = EVENTS.get(event, ("event {}".format(event), lambda *args: ""))
+        out.write("{:12.3f} ms  {:+10.3f}  {:<14} {}\n".format(
+            time, time - previous_time, name, describe(arg0, arg1, arg2, topics)))
+        previous_time = time
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Timeline of an \"mqtt trace dump\" console capture")
+    parser.add_argument("file", nargs="?", help="console output, stdin by default")
+    parser.add_argument("--topic", action="append", default=[], help="topic to show by name, repeatable")
+    args = parser.parse_args()
+
+    lines = open(args.file, errors="replace") if args.file else sys.stdin
+    frequency, first, records = parse(lines)
+    topics = {trace_hash(topic): topic for topic in args.topic}
+
+    print("{} records at {} Hz, {} earlier ones overwritten or cleared".format(len(records), frequency, first))
+    render(frequency, records, topics)